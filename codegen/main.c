@@ -0,0 +1,113 @@
+/*
+   Copyright (C) 2021 BIAGINI Nathan
+
+   This software is provided 'as-is', without any express or implied
+   warranty.  In no event will the authors be held liable for any damages
+   arising from the use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NBSM_IMPL
+#define NBSM_JSON_BUILDER
+
+#include "../nbsm.h"
+
+static char *ReadFileContent(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+
+    long size = ftell(f);
+
+    fseek(f, 0, SEEK_SET);
+
+    char *content = malloc(size + 1);
+
+    if (fread(content, 1, size, f) != (size_t)size)
+    {
+        free(content);
+        fclose(f);
+
+        return NULL;
+    }
+
+    content[size] = '\0';
+
+    fclose(f);
+
+    return content;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 4)
+    {
+        fprintf(stderr, "Usage: nbsm_codegen [JSON PATH] [NAME] [OUTPUT PATH]\n");
+        fprintf(stderr, "The generated code is written to the standard output when no output path is given\n");
+
+        return 1;
+    }
+
+    char *json = ReadFileContent(argv[1]);
+
+    if (!json)
+    {
+        fprintf(stderr, "Failed to read file: %s\n", argv[1]);
+
+        return 1;
+    }
+
+    FILE *out = argc == 4 ? fopen(argv[3], "w") : stdout;
+
+    if (!out)
+    {
+        fprintf(stderr, "Failed to open file: %s\n", argv[3]);
+        free(json);
+
+        return 1;
+    }
+
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    bool generated = NBSM_GenerateC(builder, argv[2], out);
+
+    if (!generated && builder->state_count == 0)
+        fprintf(stderr, "Failed to generate code: the state machine has no state\n");
+    else if (!generated)
+        fprintf(stderr, "Failed to generate code: a state or variable name maps to a C identifier that is already used\n");
+
+    NBSM_DestroyBuilder(builder);
+    free(json);
+
+    if (out != stdout)
+    {
+        fclose(out);
+
+        if (!generated)
+            remove(argv[3]);
+    }
+
+    return generated ? 0 : 1;
+}
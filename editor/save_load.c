@@ -297,7 +297,7 @@ static void LoadConditions(EditorStateMachine *machine, EditorTransition *trans,
 
             NBSM_ConditionOperandBlueprint right_op = {
                 .type = NBSM_OPERAND_VAR,
-                .data = {.var_name = json_object_get_string(var_obj)}};
+                .data = {.var_name = (char *)json_object_get_string(var_obj)}};
         }
         else
         {
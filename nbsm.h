@@ -40,6 +40,26 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <stdint.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#define NBSM_POSIX
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#endif
+
+#ifdef NBSM_PARALLEL
+
+#include <pthread.h>
+
+#endif // NBSM_PARALLEL
 
 #ifdef NBSM_JSON_BUILDER
 
@@ -49,32 +69,76 @@
 
 #pragma region "Types"
 
+#pragma region "Allocator"
+
+// Memory allocation interface, user_data is passed to every call (memory areas, accounting, etc.)
+typedef struct
+{
+    void *(*alloc)(void *user_data, size_t size);
+    void *(*realloc)(void *user_data, void *ptr, size_t size);
+    void (*free)(void *user_data, void *ptr);
+    void *user_data;
+} NBSM_Allocator;
+
+#pragma endregion // Allocator
+
 #pragma region "Hash table"
 
-#define NBSM_HTABLE_DEFAULT_INITIAL_CAPACITY 200
 #define NBSM_HTABLE_LOAD_FACTOR_THRESHOLD 0.75
 
 typedef struct
 {
-    const char *key;
+    const char *key; // NULL for an empty slot
     void *item;
-    unsigned int slot;
+    unsigned int hash;
 } NBSM_HTableEntry;
 
+// Open addressing hash table with robin hood linear probing, the entries are stored inline
 typedef struct
 {
-    NBSM_HTableEntry **internal_array;
-    unsigned int capacity;
+    NBSM_HTableEntry *entries;
+    unsigned int capacity; // always a power of two
     unsigned int count;
-    float load_factor;
+    const NBSM_Allocator *allocator; // allocator of the table's owner
 } NBSM_HTable;
 
-typedef void (*HTableDestroyItemFunc)(void *);
+typedef void (*HTableDestroyItemFunc)(const NBSM_Allocator *, void *);
 
 #pragma endregion // Hash table
 
+#pragma region "String pool"
+
+#define NBSM_STRING_CHUNK_SIZE 4096 // strings are interned in chunks of this size (longer strings get their own chunk)
+
+typedef struct NBSM_StringChunk
+{
+    struct NBSM_StringChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} NBSM_StringChunk;
+
+// Strings interned once and released all at once, equal strings share the same memory
+typedef struct
+{
+    NBSM_HTable *strings;
+    NBSM_StringChunk *chunks; // the first one is being filled
+    NBSM_Allocator allocator;
+} NBSM_StringPool;
+
+#pragma endregion // String pool
+
 #pragma region "State machine"
 
+#define NBSM_MACHINE_DEFAULT_CAPACITY 8 // number of states and variables NBSM_Create makes room for
+#define NBSM_BLOCK_ALIGNMENT 8 // alignment of the parts of a state machine built in a single memory block
+#define NBSM_BINARY_VERSION 1 // version of the binary definition format written by NBSM_WriteBinary
+
+// Size of the chunks read by the streaming JSON loader
+#ifndef NBSM_JSON_STREAM_CHUNK_SIZE
+#define NBSM_JSON_STREAM_CHUNK_SIZE 4096
+#endif
+
 #ifndef NBSM_Alloc
 #define NBSM_Alloc malloc
 #endif
@@ -93,10 +157,10 @@ typedef void (*HTableDestroyItemFunc)(void *);
             abort();      \
     }
 
-#define NBSM_CONST_I(v) ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_INTEGER, { .i = v } } } })
-#define NBSM_CONST_F(v) ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_FLOAT, { .f = v } } } })
-#define NBSM_TRUE ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_BOOLEAN, { .b = true } } } })
-#define NBSM_FALSE ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_BOOLEAN, { .b = false } } } })
+#define NBSM_CONST_I(v) ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_INTEGER, { .i = v }, false, 0 } } })
+#define NBSM_CONST_F(v) ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_FLOAT, { .f = v }, false, 0 } } })
+#define NBSM_TRUE ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_BOOLEAN, { .b = true }, false, 0 } } })
+#define NBSM_FALSE ((NBSM_ConditionOperand){ NBSM_OPERAND_CONST, .data = { .constant = (NBSM_Value){ NBSM_BOOLEAN, { .b = false }, false, 0 } } })
 #define NBSM_VAR(machine, name) ((NBSM_ConditionOperand){ NBSM_OPERAND_VAR, .data = { .var = NBSM_GetVariable(machine, name) } })
 
 typedef enum
@@ -122,30 +186,109 @@ typedef enum
     NBSM_OPERAND_VAR
 } NBSM_ConditionOperandType;
 
+typedef union
+{
+    int i;
+    float f;
+    bool b;
+} NBSM_Variant;
+
+// States and variables are numbered in the order they are added, resolve the ids once from the names
+// to avoid hashing strings at runtime
+typedef unsigned int NBSM_StateId;
+typedef unsigned int NBSM_VarId;
+
+// Condition instructions, specialized by comparison, value type and right operand kind (constant or variable)
+typedef enum
+{
+    NBSM_OP_EQ_INT_CONST,
+    NBSM_OP_EQ_INT_VAR,
+    NBSM_OP_NEQ_INT_CONST,
+    NBSM_OP_NEQ_INT_VAR,
+    NBSM_OP_LT_INT_CONST,
+    NBSM_OP_LT_INT_VAR,
+    NBSM_OP_LTE_INT_CONST,
+    NBSM_OP_LTE_INT_VAR,
+    NBSM_OP_GT_INT_CONST,
+    NBSM_OP_GT_INT_VAR,
+    NBSM_OP_GTE_INT_CONST,
+    NBSM_OP_GTE_INT_VAR,
+    NBSM_OP_EQ_FLOAT_CONST,
+    NBSM_OP_EQ_FLOAT_VAR,
+    NBSM_OP_NEQ_FLOAT_CONST,
+    NBSM_OP_NEQ_FLOAT_VAR,
+    NBSM_OP_LT_FLOAT_CONST,
+    NBSM_OP_LT_FLOAT_VAR,
+    NBSM_OP_LTE_FLOAT_CONST,
+    NBSM_OP_LTE_FLOAT_VAR,
+    NBSM_OP_GT_FLOAT_CONST,
+    NBSM_OP_GT_FLOAT_VAR,
+    NBSM_OP_GTE_FLOAT_CONST,
+    NBSM_OP_GTE_FLOAT_VAR,
+    NBSM_OP_EQ_BOOL_CONST,
+    NBSM_OP_EQ_BOOL_VAR,
+    NBSM_OP_NEQ_BOOL_CONST,
+    NBSM_OP_NEQ_BOOL_VAR
+} NBSM_Opcode;
+
+// Value of a state machine variable (or of a constant condition operand)
+// The NBSM_Set* functions are the only supported way to change a variable: writing to value directly does not mark
+// the variable dirty, so NBSM_Update keeps skipping the transitions depending on it
 typedef struct
 {
     NBSM_ValueType type;
-
-    union
-    {
-        int i;
-        float f;
-        bool b;
-    } value;
+    NBSM_Variant value;
+    bool dirty; // changed since the conditions depending on it were last evaluated
+    NBSM_VarId id; // id of the variable, unused for constants
 } NBSM_Value;
 
 typedef struct __NBSM_State NBSM_State;
+typedef struct __NBSM_CompiledTransition NBSM_CompiledTransition;
+typedef struct __NBSM_CompiledCondition NBSM_CompiledCondition;
+typedef struct __NBSM_Machine NBSM_Machine;
 
-typedef struct
+struct __NBSM_Machine
 {
+    NBSM_Allocator allocator; // used for all of the state machine's memory
     NBSM_HTable *states;
     NBSM_HTable *variables;
+    NBSM_State **states_by_id;
+    NBSM_Value **variables_by_id;
+    unsigned int variable_count;
+    unsigned int state_capacity;
+    unsigned int variable_capacity;
     NBSM_State *current;
     NBSM_State *initial_state;
     void *user_data;
-} NBSM_Machine;
 
-typedef bool (*NBSM_ConditionFunc)(NBSM_Value *v1, NBSM_Value *v2);
+    // evaluate the current state's transitions on the next update even if none of its dependencies changed
+    bool force_evaluation;
+
+    unsigned int state_count;
+
+    // contiguous layout used by NBSM_Update once the machine has been compiled (see NBSM_Compile)
+    bool is_compiled;
+    NBSM_State *state_array; // indexed by state id
+    NBSM_CompiledTransition *transitions;
+    NBSM_CompiledCondition *conditions;
+
+    // memory block holding the whole state machine when built from a machine builder (see NBSM_Build)
+    void *block;
+    size_t block_size;
+    bool owns_block;
+
+    // names are stored at the end of the block from this offset, the state machines of a pool are cloned without
+    // them and share the names of the pool's prototype
+    size_t names_offset;
+    const NBSM_Machine *prototype; // state machine holding the names when they are shared, NULL otherwise
+
+    // contiguous variable values (indexed by id) and the image of their default values NBSM_Reset copies over them,
+    // only for state machines built from a machine builder
+    NBSM_Value *values;
+    const NBSM_Value *default_values;
+
+    unsigned int pool_index; // index in the machine pool the state machine belongs to
+};
 
 typedef struct __NBSM_Condition NBSM_Condition;
 
@@ -162,7 +305,7 @@ typedef struct
 
 struct __NBSM_Condition
 {
-    NBSM_ConditionFunc func;
+    NBSM_Opcode op;
     NBSM_Value *left_op; // left operand, points to a state machine's variable
 
     // right operand, can be either a constant value or a state machine's variable
@@ -175,6 +318,7 @@ typedef struct __NBSM_Transition NBSM_Transition;
 
 struct __NBSM_Transition
 {
+    NBSM_State *source_state;
     NBSM_State *target_state;
     NBSM_Condition *conditions;
     NBSM_Transition *next;
@@ -184,12 +328,38 @@ typedef void (*NBSM_StateHookFunc)(NBSM_Machine *machine, void *user_data);
 
 struct __NBSM_State
 {
+    NBSM_StateId id;
     const char *name;
     NBSM_Transition *transitions;
     NBSM_StateHookFunc on_enter;
     NBSM_StateHookFunc on_exit;
     NBSM_StateHookFunc on_update;
     void *user_data;
+
+    // variables used by the conditions of the state's transitions, NBSM_Update skips the state's
+    // transitions when none of them is dirty
+    NBSM_Value **dependencies;
+    unsigned int dependency_count;
+    unsigned int unconditional_transition_count;
+
+    // range of the state's transitions in the compiled layout
+    unsigned int first_transition;
+    unsigned int transition_count;
+};
+
+struct __NBSM_CompiledCondition
+{
+    NBSM_Opcode op;
+    const NBSM_Variant *left_op;
+    const NBSM_Variant *right_op; // points to either a variable's value or to the constant below
+    NBSM_Variant constant;
+};
+
+struct __NBSM_CompiledTransition
+{
+    unsigned int target_state; // index in the machine's state array
+    unsigned int first_condition;
+    unsigned int condition_count;
 };
 
 typedef struct
@@ -202,6 +372,7 @@ typedef struct
 {
     char *name;
     NBSM_ValueType type;
+    NBSM_Variant default_value; // value the variable is initialized and reset to
 } NBSM_VariableBlueprint;
 
 typedef struct
@@ -211,7 +382,7 @@ typedef struct
     union
     {
         NBSM_Value constant;
-        const char *var_name;
+        char *var_name;
     } data;
 } NBSM_ConditionOperandBlueprint;
 
@@ -243,25 +414,363 @@ typedef struct
     unsigned int transition_count; 
 
     bool free_strings;
+    NBSM_Allocator allocator;
+    NBSM_StringPool *string_pool; // names of the machine builders loaded from JSON, NULL otherwise
+
+    // machine builders loaded from binary definitions store their blueprints in the same allocation and their
+    // names point into the binary data (see NBSM_CreateBuilderFromBinary)
+    bool is_packed;
+    void *mapping; // binary file released with the machine builder (see NBSM_LoadBinaryFile)
+    size_t mapping_size;
 } NBSM_MachineBuilder;
 
-typedef struct NBSM_MachinePoolFreeBlock
+// Read up to size bytes of a stream into buffer, returns the number of bytes read (0 at the end of the stream)
+typedef size_t (*NBSM_ReadFunc)(void *user_data, char *buffer, size_t size);
+
+// Machine builders loaded from a directory, by file name
+typedef struct
 {
-    NBSM_Machine m;
-    struct NBSM_MachinePoolFreeBlock *next;
-} NBSM_MachinePoolFreeBlock;
+    char **names; // file names without the .json extension
+    NBSM_MachineBuilder **builders;
+    unsigned int count;
+    NBSM_HTable *builders_by_name;
+} NBSM_BuilderRegistry;
 
 typedef struct
 {
+    NBSM_Allocator allocator; // used for the pool and its state machines
     NBSM_MachineBuilder *builder;
-    NBSM_Machine **machines;
+    NBSM_Machine *prototype; // built once, new state machines are cloned from it
+
+    // state machines are cloned in place in slabs of contiguous fixed size blocks, each growth of the pool
+    // allocates a single slab
+    size_t machine_size;
+    void **slabs;
+    unsigned int slab_count;
+
+    NBSM_Machine **machines; // in slab order
+    uint32_t *generations; // incremented every time the state machine with the same index is recycled
     unsigned int count;
     unsigned int idx;
-    NBSM_MachinePoolFreeBlock *free;
+    NBSM_Machine **free; // stack of recycled machines
+    unsigned int free_count;
+
+    // state machines currently taken from the pool, packed at the beginning of the array (recycling a state machine
+    // moves the last one to its place)
+    NBSM_Machine **live;
+    unsigned int live_count;
+    unsigned int *live_slots; // position of each state machine in the live array, indexed by pool index
+    NBSM_Machine *updated; // state machine being updated by NBSM_UpdatePool, the only one its hooks can recycle
 } NBSM_MachinePool;
 
+// Reference to a state machine of a machine pool that can be checked for validity, a handle becomes invalid
+// once its state machine is recycled
+typedef struct
+{
+    uint32_t index;
+    uint32_t generation;
+} NBSM_MachineHandle;
+
+// Handle that never resolves to a state machine
+#define NBSM_NULL_HANDLE ((NBSM_MachineHandle){ 0, 0 })
+
 #pragma endregion // State machine
 
+#pragma region "Definition"
+
+typedef struct NBSM_Instance NBSM_Instance;
+typedef struct NBSM_Scheduler NBSM_Scheduler;
+
+typedef void (*NBSM_InstanceHookFunc)(NBSM_Instance *instance, void *user_data);
+
+typedef struct
+{
+    NBSM_Opcode op;
+    NBSM_ConditionType type;
+    NBSM_ValueType value_type;
+    unsigned int left_var; // index of the left operand variable
+
+    // right operand, can be either a constant value or the index of a variable
+    // var is 0 for a constant operand so that the variable it points to can be fetched unconditionally
+    NBSM_ConditionOperandType right_type;
+
+    struct
+    {
+        NBSM_Variant constant;
+        unsigned int var;
+    } right_op;
+} NBSM_DefinitionCondition;
+
+typedef struct
+{
+    unsigned int target_state;
+    unsigned int first_condition;
+    unsigned int condition_count;
+} NBSM_DefinitionTransition;
+
+typedef struct
+{
+    char *name;
+    unsigned int first_transition;
+    unsigned int transition_count;
+    NBSM_InstanceHookFunc on_enter;
+    NBSM_InstanceHookFunc on_exit;
+    NBSM_InstanceHookFunc on_update;
+    void *user_data;
+
+    // range of the indices of the variables used by the conditions of the state's transitions
+    unsigned int first_dependency;
+    unsigned int dependency_count;
+
+    bool can_sleep; // no transition without condition, the state cannot be left until a dependency changes
+} NBSM_DefinitionState;
+
+typedef struct
+{
+    char *name;
+    NBSM_ValueType type;
+} NBSM_DefinitionVariable;
+
+// Immutable state machine topology shared by all the instances built from the same machine builder
+typedef struct
+{
+    NBSM_DefinitionState *states;
+    unsigned int state_count;
+
+    NBSM_DefinitionVariable *variables;
+    unsigned int variable_count;
+    NBSM_Variant *default_values; // copied over the variables of an instance when it is created or reset
+
+    NBSM_DefinitionTransition *transitions;
+    unsigned int transition_count;
+
+    NBSM_DefinitionCondition *conditions;
+    unsigned int condition_count;
+
+    unsigned int *dependencies;
+
+    unsigned int initial_state;
+
+    NBSM_HTable *state_lookup;
+    NBSM_HTable *variable_lookup;
+
+    char *names; // names of the states and variables, stored once for all the instances
+} NBSM_Definition;
+
+typedef enum
+{
+    NBSM_AWAKE,
+    NBSM_DROWSY, // will be put to sleep at the end of the current scheduler update unless woken up before
+    NBSM_ASLEEP
+} NBSM_SleepState;
+
+// Per-instance state of a definition: the current state index and a packed block of variable values
+struct NBSM_Instance
+{
+    unsigned int current;
+    void *user_data;
+
+    // set when the instance has been added to a scheduler
+    NBSM_Scheduler *scheduler;
+    unsigned int scheduler_slot; // index in the scheduler's active array when not asleep
+    NBSM_SleepState sleep_state;
+
+    NBSM_Variant variables[];
+};
+
+// Updates only the instances of a definition that can execute a transition, instances stuck in a state
+// are put to sleep until one of the variables used by the conditions of that state changes
+struct NBSM_Scheduler
+{
+    const NBSM_Definition *definition;
+    NBSM_Instance **active;
+    unsigned int active_count;
+    unsigned int active_capacity;
+    unsigned int instance_count;
+    bool is_updating;
+};
+
+typedef struct
+{
+    NBSM_InstanceHookFunc func;
+    NBSM_Instance *instance;
+    void *user_data;
+} NBSM_DeferredHook;
+
+typedef struct
+{
+    NBSM_DeferredHook *hooks;
+    unsigned int count;
+    unsigned int capacity;
+} NBSM_DeferredHooks;
+
+#pragma endregion // Definition
+
+#pragma region "Registry"
+
+typedef uint32_t NBSM_DefinitionId;
+
+#define NBSM_INVALID_DEFINITION_ID UINT32_MAX
+
+typedef struct NBSM_Registry NBSM_Registry;
+
+// Called every time a definition of a registry is created, before its first instance is created
+// Definitions are destroyed when unused and created again when needed, so this is where state hooks are set
+typedef void (*NBSM_DefinitionLoadFunc)(
+    NBSM_Registry *registry, NBSM_DefinitionId id, NBSM_Definition *definition, void *user_data);
+
+typedef struct
+{
+    const char *name;
+    NBSM_MachineBuilder *builder;
+    NBSM_Definition *definition; // NULL while unloaded
+    unsigned int ref_count; // live instances plus NBSM_RetainDefinition calls
+
+    // released instances, reused by the next instances of the definition
+    NBSM_Instance **free_instances;
+    unsigned int free_count;
+    unsigned int free_capacity;
+} NBSM_RegistryEntry;
+
+// Collection of definitions identified by compact ids, a definition is only loaded while it is in use
+struct NBSM_Registry
+{
+    NBSM_RegistryEntry *entries; // indexed by definition id
+    unsigned int count;
+    unsigned int capacity;
+    NBSM_HTable *ids_by_name; // ids are stored + 1 since NULL means not found
+    NBSM_StringPool *names;
+    NBSM_DefinitionLoadFunc on_load;
+    void *user_data; // passed to on_load
+};
+
+#pragma endregion // Registry
+
+#pragma region "Population"
+
+// Number of instances evaluated at once by NBSM_UpdatePopulation
+#define NBSM_POPULATION_BLOCK_SIZE 8
+
+typedef enum
+{
+    NBSM_SIMD_NONE,
+    NBSM_SIMD_SSE2,
+    NBSM_SIMD_AVX2
+} NBSM_SIMDLevel;
+
+// Structure of arrays storage for a large number of instances of the same definition
+typedef struct
+{
+    const NBSM_Definition *definition;
+    unsigned int count;
+    unsigned int capacity; // always a multiple of NBSM_POPULATION_BLOCK_SIZE
+    unsigned int *states; // current state of every instance
+
+    // one column of "capacity" values per variable, boolean values are stored as 0 or 1 integers
+    NBSM_Variant *columns;
+} NBSM_Population;
+
+#pragma endregion // Population
+
+#ifdef NBSM_PARALLEL
+
+#pragma region "Parallel"
+
+// Number of instances processed by a worker at once by NBSM_UpdateParallel
+#ifndef NBSM_PARALLEL_CHUNK_SIZE
+#define NBSM_PARALLEL_CHUNK_SIZE 1024
+#endif
+
+// Run the state hooks on the worker threads instead of deferring them to the calling thread
+#define NBSM_PARALLEL_RUN_HOOKS_ON_WORKERS (1 << 0)
+
+typedef struct NBSM_WorkerPool NBSM_WorkerPool;
+
+typedef struct
+{
+    NBSM_WorkerPool *pool;
+    unsigned int index;
+
+    // range of chunks left to process, begin in the high 32 bits and end in the low 32 bits
+    // the owner takes chunks from the beginning and other workers steal from the end
+    uint64_t range;
+
+    NBSM_DeferredHooks deferred_hooks;
+    void *scratch;
+    size_t scratch_size;
+} NBSM_Worker;
+
+struct NBSM_WorkerPool
+{
+    pthread_t *threads;
+    NBSM_Worker *workers;
+    unsigned int worker_count; // the calling thread is the first worker
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    unsigned int job_id;
+    unsigned int running_count;
+    bool quit;
+
+    // current job, run by every worker
+    void (*job)(NBSM_Worker *worker);
+
+    // NBSM_UpdateParallel job
+    const NBSM_Definition *definition;
+    NBSM_Instance **instances;
+    unsigned int count;
+    unsigned int flags;
+
+    // NBSM_LoadBuildersFromDirectoryParallel job
+    NBSM_BuilderRegistry *registry;
+    const char *directory;
+    unsigned int next_file;
+};
+
+// Number of state machines held by a pool cache, half of them are given back to the concurrent pool when it is full
+#ifndef NBSM_POOL_CACHE_SIZE
+#define NBSM_POOL_CACHE_SIZE 32
+#endif
+
+#define NBSM_CONCURRENT_POOL_MAX_SLABS 32
+
+// Header stored right before each state machine of a concurrent pool
+typedef struct
+{
+    uint32_t index;
+    uint32_t next; // index + 1 of the next free slot, 0 for none
+} NBSM_PoolSlot;
+
+// Machine pool safe to use from several threads at once, acquiring and recycling never take a lock
+typedef struct
+{
+    NBSM_Allocator allocator;
+    NBSM_Machine *prototype;
+    size_t slot_size;
+
+    // slabs are never moved nor released before the pool is destroyed, slab k holds base_slab_capacity << k slots
+    char *slabs[NBSM_CONCURRENT_POOL_MAX_SLABS];
+    unsigned int slab_count;
+    unsigned int base_slab_capacity; // power of two
+    bool is_growing;
+
+    // head of the free list of slots, slot index + 1 in the low 32 bits and a tag incremented on every change
+    // in the high 32 bits to detect a head that was popped and pushed back in between (ABA)
+    uint64_t free_head;
+} NBSM_ConcurrentPool;
+
+// Per thread cache of state machines of a concurrent pool, must only be used by one thread at a time
+typedef struct
+{
+    NBSM_ConcurrentPool *pool;
+    NBSM_Machine *machines[NBSM_POOL_CACHE_SIZE];
+    unsigned int count;
+} NBSM_PoolCache;
+
+#pragma endregion // Parallel
+
+#endif // NBSM_PARALLEL
+
 #pragma endregion // Types
 
 #pragma region "Public API"
@@ -269,12 +778,47 @@ typedef struct
 // Create a new empty state machine
 NBSM_Machine *NBSM_Create(void);
 
+// Create a new empty state machine with room for the given number of states and variables
+// More states and variables can still be added, the state machine will grow as needed
+NBSM_Machine *NBSM_CreateWithCapacity(unsigned int state_count, unsigned int variable_count);
+
+// Same as NBSM_CreateWithCapacity but all memory is allocated with the given allocator (copied, its user data must
+// outlive the state machine)
+NBSM_Machine *NBSM_CreateWithAllocator(
+    unsigned int state_count, unsigned int variable_count, const NBSM_Allocator *allocator);
+
 // Create a new state machine from a machine builder
+// The whole state machine (states, transitions, conditions, variables and names) is stored in a single memory block
 NBSM_Machine *NBSM_Build(NBSM_MachineBuilder *builder);
 
+// Same as NBSM_Build but the state machine's memory block is allocated with the given allocator
+NBSM_Machine *NBSM_BuildWithAllocator(NBSM_MachineBuilder *builder, const NBSM_Allocator *allocator);
+
+// Get the size of the memory block required to build a state machine from a machine builder
+size_t NBSM_GetBuildSize(NBSM_MachineBuilder *builder);
+
+// Build a state machine from a machine builder in a caller provided memory block of NBSM_GetBuildSize bytes
+// (aligned on NBSM_BLOCK_ALIGNMENT bytes), the block is not released by NBSM_Destroy
+NBSM_Machine *NBSM_BuildInPlace(NBSM_MachineBuilder *builder, void *buffer);
+
+// Create a copy of a state machine built from a machine builder (current state, variables, hooks and user data
+// included), much faster than building a new one
+NBSM_Machine *NBSM_Clone(NBSM_Machine *machine);
+
+// Get the size of the memory block required to copy a state machine with NBSM_CloneInPlace
+size_t NBSM_GetCloneSize(NBSM_Machine *machine);
+
+// Copy a state machine built from a machine builder in a caller provided memory block of NBSM_GetCloneSize bytes
+// (aligned on NBSM_BLOCK_ALIGNMENT bytes), the block is not released by NBSM_Destroy
+NBSM_Machine *NBSM_CloneInPlace(NBSM_Machine *machine, void *buffer);
+
 // Create a new machine pool
 NBSM_MachinePool *NBSM_CreatePool(NBSM_MachineBuilder *builder, unsigned int initial_count);
 
+// Same as NBSM_CreatePool but the pool and its state machines are allocated with the given allocator
+NBSM_MachinePool *NBSM_CreatePoolWithAllocator(
+    NBSM_MachineBuilder *builder, unsigned int initial_count, const NBSM_Allocator *allocator);
+
 // Get a new state machine from a machine pool. If there is no free machine left in the pool, the pool size
 // will be increased (new memory will be allocated)
 NBSM_Machine *NBSM_GetFromPool(NBSM_MachinePool *pool);
@@ -283,7 +827,19 @@ NBSM_Machine *NBSM_GetFromPool(NBSM_MachinePool *pool);
 // The current state will be set back to the initial one
 void NBSM_Recycle(NBSM_MachinePool *pool, NBSM_Machine *machine);
 
-// Reset a state machine (set the current state to the initial one)
+// Update all the state machines currently taken from a machine pool (see pool->live), state hooks may recycle
+// the state machine being updated and take new ones from the pool (they will not be updated until the next call)
+// Hooks must not recycle any other state machine of the pool: the last live state machine is moved in place of
+// a recycled one, so it could be updated twice or skipped
+void NBSM_UpdatePool(NBSM_MachinePool *pool);
+
+// Get a handle to a state machine taken from a machine pool
+NBSM_MachineHandle NBSM_GetMachineHandle(NBSM_MachinePool *pool, NBSM_Machine *machine);
+
+// Get the state machine a handle refers to, NULL if it has been recycled since the handle was created
+NBSM_Machine *NBSM_ResolveHandle(NBSM_MachinePool *pool, NBSM_MachineHandle handle);
+
+// Reset a state machine (set the current state to the initial one and the variables to their default values)
 void NBSM_Reset(NBSM_Machine *machine);
 
 // Destroy a state machine and release memory
@@ -298,9 +854,25 @@ void NBSM_DestroyPool(NBSM_MachinePool *pool);
 // Update the state machine (check if any transition needs to be executed based on conditions)
 void NBSM_Update(NBSM_Machine *machine);
 
+// Compile the states, transitions and conditions of a state machine into contiguous arrays used by NBSM_Update
+// No state, transition or condition can be added to the state machine once it has been compiled and the
+// transitions returned by NBSM_AddTransition are no longer valid
+// State machines created with NBSM_Build are already compiled
+void NBSM_Compile(NBSM_Machine *machine);
+
 // Change the current state of the state machine, ignoring transitions and conditions
 void NBSM_ChangeState(NBSM_Machine *machine, const char *name);
 
+// Same as NBSM_ChangeState but using a state id
+void NBSM_ChangeStateById(NBSM_Machine *machine, NBSM_StateId id);
+
+// Get the id of a state from its name
+// Machines created from the same machine builder share the same state ids
+NBSM_StateId NBSM_GetStateId(NBSM_Machine *machine, const char *name);
+
+// Get the id of the current state of the state machine
+NBSM_StateId NBSM_GetCurrentStateId(NBSM_Machine *machine);
+
 // Add a state to the state machine
 void NBSM_AddState(NBSM_Machine *machine, const char *name, bool is_initial);
 
@@ -316,6 +888,18 @@ void NBSM_OnStateExit(NBSM_Machine *machine, const char *name, NBSM_StateHookFun
 // Add an "OnUpdate" hook on the given state
 void NBSM_OnStateUpdate(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func);
 
+// Same as NBSM_AttachDataToState but using a state id
+void NBSM_AttachDataToStateById(NBSM_Machine *machine, NBSM_StateId id, void *user_data);
+
+// Same as NBSM_OnStateEnter but using a state id
+void NBSM_OnStateEnterById(NBSM_Machine *machine, NBSM_StateId id, NBSM_StateHookFunc hook_func);
+
+// Same as NBSM_OnStateExit but using a state id
+void NBSM_OnStateExitById(NBSM_Machine *machine, NBSM_StateId id, NBSM_StateHookFunc hook_func);
+
+// Same as NBSM_OnStateUpdate but using a state id
+void NBSM_OnStateUpdateById(NBSM_Machine *machine, NBSM_StateId id, NBSM_StateHookFunc hook_func);
+
 // Add a new transition between two states
 NBSM_Transition *NBSM_AddTransition(NBSM_Machine *machine, const char *from, const char *to);
 
@@ -323,7 +907,7 @@ NBSM_Transition *NBSM_AddTransition(NBSM_Machine *machine, const char *from, con
 void NBSM_AddCondition(
     NBSM_Machine *machine, NBSM_Transition *transition, const char *var_name, NBSM_ConditionType type, NBSM_ConditionOperand right_op);
 
-// Add a new variable to the state machine
+// Add a new variable to the state machine, cannot be used on state machines created from a machine builder
 NBSM_Value *NBSM_AddVariable(NBSM_Machine *machine, const char *name, NBSM_ValueType type);
 
 // Add a new integer variable to the state machine
@@ -336,6 +920,8 @@ NBSM_Value *NBSM_AddFloat(NBSM_Machine *machine, const char *name);
 NBSM_Value *NBSM_AddBoolean(NBSM_Machine *machine, const char *name);
 
 // Set the value of an integer variable of the state machine
+// Setting a variable to a different value marks it dirty, NBSM_Update only evaluates the transitions of the
+// current state when one of the variables used by their conditions is dirty
 void NBSM_SetInteger(NBSM_Value *var, int value);
 
 // Set the value of a float variable of the state machine
@@ -356,1192 +942,5954 @@ bool NBSM_GetBoolean(NBSM_Value *var);
 // Get a variable from the state machine
 NBSM_Value *NBSM_GetVariable(NBSM_Machine *machine, const char *name);
 
+// Get the id of a variable from its name
+// Machines created from the same machine builder share the same variable ids
+NBSM_VarId NBSM_GetVariableId(NBSM_Machine *machine, const char *name);
+
+// Get a variable from the state machine using its id
+NBSM_Value *NBSM_GetVariableById(NBSM_Machine *machine, NBSM_VarId id);
+
 // Create a new machine builder from a JSON file
 NBSM_MachineBuilder *NBSM_CreateBuilderFromJSON(const char *json);
 
-#pragma endregion // Public API
+// Same as NBSM_CreateBuilderFromJSON but the machine builder (including the JSON parsing) is allocated with
+// the given allocator
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONWithAllocator(const char *json, const NBSM_Allocator *allocator);
 
-#pragma region "Implementation"
+// Create a new machine builder from a JSON stream, the JSON is read in chunks of NBSM_JSON_STREAM_CHUNK_SIZE bytes and
+// the blueprints are filled while reading it, so the whole file is never held in memory (does not require json.h)
+// Returns NULL if the JSON is invalid
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONStream(NBSM_ReadFunc read, void *user_data);
 
-#ifdef NBSM_IMPL
+// Same as NBSM_CreateBuilderFromJSONStream but the machine builder is allocated with the given allocator
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONStreamWithAllocator(
+    NBSM_ReadFunc read, void *user_data, const NBSM_Allocator *allocator);
 
-#pragma region "Hash table"
+#ifdef NBSM_POSIX
 
-static unsigned long HashSDBM(const char *str)
-{
-    unsigned long hash = 0;
-    int c;
+// Create a new machine builder from a JSON file descriptor (see NBSM_CreateBuilderFromJSONStream)
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONFd(int fd);
 
-    while ((c = *str++))
-    {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
+#endif // NBSM_POSIX
 
-    return hash;
-}
+#ifdef NBSM_POSIX
 
-static NBSM_HTableEntry *FindHTableEntry(NBSM_HTable *htable, const char *key)
-{
-    unsigned long hash = HashSDBM(key);
-    unsigned int slot;
+// Create a machine builder from every .json file of a directory (see NBSM_CreateBuilderFromJSONFd)
+// The machine builders are named after their file names without the .json extension, entries that are not regular
+// files or not valid JSON files are skipped
+// Returns NULL if the directory cannot be opened
+NBSM_BuilderRegistry *NBSM_LoadBuildersFromDirectory(const char *path);
 
-    //quadratic probing
+#endif // NBSM_POSIX
 
-    NBSM_HTableEntry *current_entry;
-    unsigned int i = 0;
+// Get a machine builder from a registry using its name, returns NULL if there is no such machine builder
+NBSM_MachineBuilder *NBSM_GetBuilder(NBSM_BuilderRegistry *registry, const char *name);
 
-    do
-    {
-        slot = (hash + (int)pow(i, 2)) % htable->capacity;
-        current_entry = htable->internal_array[slot];
+// Destroy a registry and all of its machine builders
+void NBSM_DestroyBuilderRegistry(NBSM_BuilderRegistry *registry);
 
-        if (current_entry != NULL && strcmp(current_entry->key, key) == 0)
-        {
-            return current_entry;
-        }
+// Write a machine builder to a FILE in the binary definition format (see NBSM_CreateBuilderFromBinary)
+// Returns false if writing failed
+bool NBSM_WriteBinary(NBSM_MachineBuilder *builder, FILE *out);
 
-        i++;
-    } while (i < htable->capacity);
+// Create a new machine builder from binary definition data written by NBSM_WriteBinary (aligned on 4 bytes)
+// Nothing is parsed nor copied: the blueprints are filled from fixed size records in a single allocation and the names
+// point into the data, which must outlive the machine builder
+// Returns NULL if the data is not a binary definition of the current version (NBSM_BINARY_VERSION)
+NBSM_MachineBuilder *NBSM_CreateBuilderFromBinary(const void *data, size_t size);
 
-    return NULL;
-}
+// Create a new machine builder from a binary definition file, the file is memory mapped (when supported) for as long
+// as the machine builder exists
+// Returns NULL if the file cannot be read or is not a binary definition of the current version
+NBSM_MachineBuilder *NBSM_LoadBinaryFile(const char *path);
 
-static bool DoesEntryExist(NBSM_HTable *htable, const char *key)
-{
-    return !!FindHTableEntry(htable, key);
-}
+// Write a standalone C source file implementing the state machine described by a machine builder
+// Variables become fields of a struct, the update function is a switch on the current state with the conditions
+// written as plain comparisons; all generated identifiers are prefixed with the given name
+// Returns false, without writing anything, if the state machine has no state, if distinct names map to the same C
+// identifier (such as "a-b" and "a_b") or if a name maps to an identifier the generated code already uses
+bool NBSM_GenerateC(NBSM_MachineBuilder *builder, const char *name, FILE *out);
 
-static unsigned int FindFreeSlotInHTable(NBSM_HTable *htable, NBSM_HTableEntry *entry, bool *use_existing_slot)
-{
-    unsigned long hash = HashSDBM(entry->key);
-    unsigned int slot;
+// Create a new definition from a machine builder, the definition is shared by all its instances
+NBSM_Definition *NBSM_CreateDefinition(NBSM_MachineBuilder *builder);
 
-    // quadratic probing
+// Destroy a definition and release memory, all of its instances must be destroyed first
+void NBSM_DestroyDefinition(NBSM_Definition *definition);
 
-    NBSM_HTableEntry *current_entry;
-    unsigned int i = 0;
+// Create a new instance of a definition (the current state is set to the initial one)
+NBSM_Instance *NBSM_CreateInstance(const NBSM_Definition *definition);
 
-    do
-    {
-        slot = (hash + (int)pow(i, 2)) % htable->capacity;
-        current_entry = htable->internal_array[slot];
+// Destroy an instance and release memory
+void NBSM_DestroyInstance(NBSM_Instance *instance);
 
-        i++;
-    } while (current_entry != NULL && current_entry->key != entry->key);
+// Reset an instance (set the current state to the initial one and the variables to their default values)
+void NBSM_ResetInstance(const NBSM_Definition *definition, NBSM_Instance *instance);
 
-    if (current_entry != NULL) // it means the current entry as the same key as the inserted entry
-    {
-        *use_existing_slot = true;
+// Update an instance (check if any transition needs to be executed based on conditions)
+void NBSM_UpdateInstance(const NBSM_Definition *definition, NBSM_Instance *instance);
 
-        NBSM_Dealloc(current_entry);
-    }
+// Update many instances of the same definition at once
+// Instances are grouped by current state so the transitions and conditions of a state are evaluated for all the
+// instances in that state in a row; all instances are evaluated before any state hook is called
+// Instances added to a scheduler cannot be updated in a batch
+void NBSM_UpdateBatch(const NBSM_Definition *definition, NBSM_Instance **instances, unsigned int count);
 
-    return slot;
-}
+// Change the current state of an instance, ignoring transitions and conditions
+void NBSM_ChangeInstanceState(const NBSM_Definition *definition, NBSM_Instance *instance, const char *name);
 
-static NBSM_HTable *CreateHTableWithCapacity(unsigned int capacity)
-{
-    NBSM_HTable *htable = NBSM_Alloc(sizeof(NBSM_HTable));
+// Same as NBSM_ChangeInstanceState but using a state id
+void NBSM_ChangeInstanceStateById(const NBSM_Definition *definition, NBSM_Instance *instance, NBSM_StateId id);
 
-    htable->internal_array = NBSM_Alloc(sizeof(NBSM_HTableEntry *) * capacity);
-    htable->capacity = capacity;
-    htable->count = 0;
-    htable->load_factor = 0;
+// Get the id of a state of a definition from its name, the current state of an instance is its id
+NBSM_StateId NBSM_GetDefinitionStateId(const NBSM_Definition *definition, const char *name);
 
-    for (unsigned int i = 0; i < htable->capacity; i++)
-        htable->internal_array[i] = NULL;
+// Get the name of the current state of an instance
+const char *NBSM_GetInstanceState(const NBSM_Definition *definition, NBSM_Instance *instance);
 
-    return htable;
-}
+// Attach some user defined data to a given state of a definition
+void NBSM_AttachDataToDefinitionState(NBSM_Definition *definition, const char *name, void *user_data);
 
-static void InsertHTableEntry(NBSM_HTable *htable, NBSM_HTableEntry *entry)
-{
-    bool use_existing_slot = false;
-    unsigned int slot = FindFreeSlotInHTable(htable, entry, &use_existing_slot);
+// Add an "OnEnter" hook on the given state of a definition
+void NBSM_OnDefinitionStateEnter(NBSM_Definition *definition, const char *name, NBSM_InstanceHookFunc hook_func);
 
-    entry->slot = slot;
-    htable->internal_array[slot] = entry;
+// Add an "OnExit" hook on the given state of a definition
+void NBSM_OnDefinitionStateExit(NBSM_Definition *definition, const char *name, NBSM_InstanceHookFunc hook_func);
 
-    if (!use_existing_slot)
-    {
-        htable->count++;
-        htable->load_factor = (float)htable->count / htable->capacity;
-    }
-}
+// Add an "OnUpdate" hook on the given state of a definition
+void NBSM_OnDefinitionStateUpdate(NBSM_Definition *definition, const char *name, NBSM_InstanceHookFunc hook_func);
 
-static void RemoveHTableEntry(NBSM_HTable *htable, NBSM_HTableEntry *entry)
-{
-    htable->internal_array[entry->slot] = NULL;
+// Get the index of a definition's variable, used to access the variable in the instances
+unsigned int NBSM_GetVariableIndex(const NBSM_Definition *definition, const char *name);
 
-    NBSM_Dealloc(entry);
+// Set the value of an integer variable of an instance
+void NBSM_SetInstanceInteger(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var, int value);
 
-    htable->count--;
-    htable->load_factor = htable->count / htable->capacity;
-}
+// Set the value of a float variable of an instance
+void NBSM_SetInstanceFloat(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var, float value);
 
-static NBSM_HTable *CreateHTable()
-{
-    return CreateHTableWithCapacity(NBSM_HTABLE_DEFAULT_INITIAL_CAPACITY);
-}
+// Set the value of a boolean variable of an instance
+void NBSM_SetInstanceBoolean(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var, bool value);
 
-static void DestroyHTable(
-    NBSM_HTable *htable, bool destroy_items, HTableDestroyItemFunc destroy_item_func, bool destroy_keys)
-{
-    for (unsigned int i = 0; i < htable->capacity; i++)
-    {
-        NBSM_HTableEntry *entry = htable->internal_array[i];
+// Get the value of an integer variable of an instance
+int NBSM_GetInstanceInteger(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var);
 
-        if (entry)
-        {
-            if (destroy_items)
-                destroy_item_func(entry->item);
+// Get the value of a float variable of an instance
+float NBSM_GetInstanceFloat(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var);
 
-            if (destroy_keys)
-                NBSM_Dealloc((void *)entry->key);
+// Get the value of a boolean variable of an instance
+bool NBSM_GetInstanceBoolean(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var);
 
-            NBSM_Dealloc(entry);
-        }
-    }
+// Create a registry of definitions, on_load (can be NULL) is called with user_data every time a definition is created
+NBSM_Registry *NBSM_CreateRegistry(NBSM_DefinitionLoadFunc on_load, void *user_data);
 
-    NBSM_Dealloc(htable->internal_array);
-    NBSM_Dealloc(htable);
-}
+// Destroy a registry and its definitions, all instances must have been released and all definitions unpinned
+// The machine builders are not destroyed
+void NBSM_DestroyRegistry(NBSM_Registry *registry);
 
-static void GrowHTable(NBSM_HTable *htable)
-{
-    unsigned int old_capacity = htable->capacity;
-    unsigned int new_capacity = old_capacity * 2;
-    NBSM_HTableEntry **old_internal_array = htable->internal_array;
-    NBSM_HTableEntry **new_internal_array = NBSM_Alloc(sizeof(NBSM_HTableEntry *) * new_capacity);
+// Add a definition to a registry and return its id, ids are given in order starting from 0
+// The definition is created from the machine builder (which must outlive the registry) when first needed
+NBSM_DefinitionId NBSM_RegisterDefinition(NBSM_Registry *registry, const char *name, NBSM_MachineBuilder *builder);
 
-    for (unsigned int i = 0; i < new_capacity; i++)
-    {
-        new_internal_array[i] = NULL;
-    }
+// Add all the machine builders of a builder registry to a registry, under their names
+void NBSM_RegisterBuilders(NBSM_Registry *registry, NBSM_BuilderRegistry *builders);
 
-    htable->internal_array = new_internal_array;
-    htable->capacity = new_capacity;
-    htable->count = 0;
-    htable->load_factor = 0;
+// Get the id of a definition from its name, NBSM_INVALID_DEFINITION_ID if there is no such definition
+NBSM_DefinitionId NBSM_GetDefinitionId(NBSM_Registry *registry, const char *name);
 
-    // rehash
+// Get a definition of a registry, NULL if it is not loaded (it has no instance and is not pinned)
+NBSM_Definition *NBSM_GetRegistryDefinition(NBSM_Registry *registry, NBSM_DefinitionId id);
 
-    for (unsigned int i = 0; i < old_capacity; i++)
-    {
-        if (old_internal_array[i])
-            InsertHTableEntry(htable, old_internal_array[i]);
-    }
+// Pin a definition so it stays loaded without instances, the definition is created if needed
+NBSM_Definition *NBSM_RetainDefinition(NBSM_Registry *registry, NBSM_DefinitionId id);
 
-    NBSM_Dealloc(old_internal_array);
-}
+// Unpin a definition, it is destroyed once it has no instance left and is no longer pinned
+void NBSM_ReleaseDefinition(NBSM_Registry *registry, NBSM_DefinitionId id);
 
-static void AddToHTable(NBSM_HTable *htable, const char *key, void *item)
-{
-    NBSM_HTableEntry *entry = NBSM_Alloc(sizeof(NBSM_HTableEntry));
+// Create an instance of a definition of a registry, the definition is created if needed
+// Released instances of the same definition are reused
+NBSM_Instance *NBSM_CreateRegistryInstance(NBSM_Registry *registry, NBSM_DefinitionId id);
 
-    entry->key = key;
-    entry->item = item;
+// Release an instance created with NBSM_CreateRegistryInstance, the definition is destroyed with its last instance
+void NBSM_ReleaseRegistryInstance(NBSM_Registry *registry, NBSM_DefinitionId id, NBSM_Instance *instance);
 
-    InsertHTableEntry(htable, entry);
+// Create a scheduler for the instances of a definition
+NBSM_Scheduler *NBSM_CreateScheduler(const NBSM_Definition *definition);
 
-    if (htable->load_factor >= NBSM_HTABLE_LOAD_FACTOR_THRESHOLD)
-        GrowHTable(htable);
-}
+// Destroy a scheduler and release memory, all instances must have been removed from it
+void NBSM_DestroyScheduler(NBSM_Scheduler *scheduler);
 
-static void *GetInHTable(NBSM_HTable *htable, const char *key)
-{
-    NBSM_HTableEntry *entry = FindHTableEntry(htable, key);
+// Add an instance to a scheduler, an instance can only belong to one scheduler and cannot be updated with
+// NBSM_UpdateBatch or NBSM_UpdateParallel while it belongs to it
+void NBSM_AddToScheduler(NBSM_Scheduler *scheduler, NBSM_Instance *instance);
 
-    return entry ? entry->item : NULL;
-}
+// Remove an instance from a scheduler, cannot be called from a state hook during NBSM_UpdateScheduler
+void NBSM_RemoveFromScheduler(NBSM_Scheduler *scheduler, NBSM_Instance *instance);
 
-static void *RemoveFromHTable(NBSM_HTable *htable, const char *key)
-{
-    NBSM_HTableEntry *entry = FindHTableEntry(htable, key);
+// Update the awake instances of a scheduler and return how many were updated
+// An instance that did not execute a transition and whose current state has no transition without condition
+// is put to sleep: it is no longer updated (its "OnUpdate" hook is not called either) until one of the
+// variables used by the conditions of its current state is set to a different value or its state is changed
+unsigned int NBSM_UpdateScheduler(NBSM_Scheduler *scheduler);
 
-    if (entry)
-    {
-        void *item = entry->item;
+// Create a new population of instances of a definition
+NBSM_Population *NBSM_CreatePopulation(const NBSM_Definition *definition, unsigned int initial_capacity);
 
-        RemoveHTableEntry(htable, entry);
+// Destroy a population and release memory
+void NBSM_DestroyPopulation(NBSM_Population *population);
 
-        return item;
-    }
+// Add a new instance to a population and return its index (the current state is set to the initial one)
+unsigned int NBSM_AddToPopulation(NBSM_Population *population);
 
-    return NULL;
-}
+// Remove an instance from a population, the last instance of the population is moved to the removed index
+void NBSM_RemoveFromPopulation(NBSM_Population *population, unsigned int index);
 
-#pragma endregion // Hash table
+// Update all the instances of a population and return the number of executed transitions
+// Conditions are evaluated for NBSM_POPULATION_BLOCK_SIZE instances at once using the best SIMD instruction set
+// supported by the CPU; state hooks are not called
+unsigned int NBSM_UpdatePopulation(NBSM_Population *population);
 
-#pragma region "State machine"
+// Set the value of an integer variable of an instance of a population
+void NBSM_SetPopulationInteger(NBSM_Population *population, unsigned int index, unsigned int var, int value);
 
-#pragma region "Public API"
+// Set the value of a float variable of an instance of a population
+void NBSM_SetPopulationFloat(NBSM_Population *population, unsigned int index, unsigned int var, float value);
 
-static void ChangeState(NBSM_Machine *machine, NBSM_State *state);
-static NBSM_ConditionFunc GetConditionFunction(NBSM_ConditionType type);
-static bool ConditionEQ(NBSM_Value *v1, NBSM_Value *v2);
-static bool ConditionNEQ(NBSM_Value *v1, NBSM_Value *v2);
-static bool ConditionLT(NBSM_Value *v1, NBSM_Value *v2);
-static bool ConditionLTE(NBSM_Value *v1, NBSM_Value *v2);
-static bool ConditionGT(NBSM_Value *v1, NBSM_Value *v2);
-static bool ConditionGTE(NBSM_Value *v1, NBSM_Value *v2);
-static void DestroyMachineValue(void *ptr);
-static void DestroyMachineState(void *ptr);
-static void DestroyMachineTransition(NBSM_Transition *transition);
-static void GrowPool(NBSM_MachinePool *pool, unsigned int count);
+// Set the value of a boolean variable of an instance of a population
+void NBSM_SetPopulationBoolean(NBSM_Population *population, unsigned int index, unsigned int var, bool value);
 
-#ifdef NBSM_JSON_BUILDER
+// Get the value of an integer variable of an instance of a population
+int NBSM_GetPopulationInteger(NBSM_Population *population, unsigned int index, unsigned int var);
 
-static void LoadVariablesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *var_arr);
-static void LoadStatesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *state_arr);
-static void LoadTransitionsFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *trans_arr);
-static void LoadConditionsFromJSON(NBSM_TransitionBlueprint *transition, unsigned int trans_idx, struct json_array_s *cond_arr);
-static NBSM_ConditionOperandBlueprint LoadConditionOperandFromJSON(struct json_object_s *op_obj);
-static NBSM_ValueType GetVariableTypeFromJSON(const char *type_str);
-static NBSM_ConditionType GetConditionTypeFromJSON(const char *type_str);
+// Get the value of a float variable of an instance of a population
+float NBSM_GetPopulationFloat(NBSM_Population *population, unsigned int index, unsigned int var);
 
-#endif // NBSM_JSON_BUILDER
+// Get the value of a boolean variable of an instance of a population
+bool NBSM_GetPopulationBoolean(NBSM_Population *population, unsigned int index, unsigned int var);
 
-NBSM_Machine *NBSM_Create(void)
-{
-    NBSM_Machine *machine = NBSM_Alloc(sizeof(NBSM_Machine));
+// Force the SIMD instruction set used by NBSM_UpdatePopulation, return false if the CPU does not support it
+// Not thread safe: call it before populations are updated from several threads
+bool NBSM_SetSIMDLevel(NBSM_SIMDLevel level);
 
-    machine->states = CreateHTable();
-    machine->variables = CreateHTable();
-    machine->current = NULL;
-    machine->user_data = NULL;
+// Get the SIMD instruction set used by NBSM_UpdatePopulation
+NBSM_SIMDLevel NBSM_GetSIMDLevel(void);
 
-    return machine;
-}
+#ifdef NBSM_PARALLEL
 
-NBSM_Machine *NBSM_Build(NBSM_MachineBuilder *builder)
-{
-    NBSM_Machine *machine = NBSM_Create();
+// Create a pool of worker threads used by NBSM_UpdateParallel, the calling thread counts as one of the workers
+NBSM_WorkerPool *NBSM_CreateWorkerPool(unsigned int worker_count);
 
-    for (unsigned int i = 0; i < builder->state_count; i++)
-    {
-        NBSM_StateBlueprint *sb = &builder->states[i];
+// Stop the worker threads and release memory
+void NBSM_DestroyWorkerPool(NBSM_WorkerPool *pool);
 
-        NBSM_AddState(machine, strdup(sb->name), sb->is_initial);
-    }
+// Update many instances of the same definition on a pool of worker threads
+// Instances are split into chunks of NBSM_PARALLEL_CHUNK_SIZE instances, idle workers steal chunks from busy ones
+// State hooks are called on the calling thread once all instances have been updated, unless the
+// NBSM_PARALLEL_RUN_HOOKS_ON_WORKERS flag is set
+// Instances added to a scheduler cannot be updated in parallel
+void NBSM_UpdateParallel(
+    NBSM_WorkerPool *pool, const NBSM_Definition *definition, NBSM_Instance **instances, unsigned int count, unsigned int flags);
 
-    for (unsigned int i = 0; i < builder->variable_count; i++)
-    {
-        NBSM_VariableBlueprint *vb = &builder->variables[i];
+#ifdef NBSM_POSIX
 
-        NBSM_AddVariable(machine, strdup(vb->name), vb->type);
-    }
+// Same as NBSM_LoadBuildersFromDirectory but the files are read and parsed concurrently by a pool of worker threads
+NBSM_BuilderRegistry *NBSM_LoadBuildersFromDirectoryParallel(NBSM_WorkerPool *pool, const char *path);
 
-    for (unsigned int i = 0; i < builder->transition_count; i++)
-    {
-        NBSM_TransitionBlueprint *tb = &builder->transitions[i];
-        NBSM_Transition *t = NBSM_AddTransition(machine, tb->from, tb->to);
+#endif // NBSM_POSIX
 
-        for (unsigned int j = 0; j < tb->condition_count; j++)
-        {
-            NBSM_ConditionBlueprint *cb = &tb->conditions[j];
-            NBSM_ConditionOperand right_op = { .type = cb->right_op.type };
+// Create a new machine pool that can be used from several threads at once
+NBSM_ConcurrentPool *NBSM_CreateConcurrentPool(NBSM_MachineBuilder *builder, unsigned int initial_count);
 
-            if (cb->right_op.type == NBSM_OPERAND_CONST)
-                right_op.data.constant = cb->right_op.data.constant;
-            else if (cb->right_op.type == NBSM_OPERAND_VAR)
-                right_op.data.var = NBSM_GetVariable(machine, cb->right_op.data.var_name);
+// Same as NBSM_CreateConcurrentPool but the pool and its state machines are allocated with the given allocator
+// (which must be thread safe)
+NBSM_ConcurrentPool *NBSM_CreateConcurrentPoolWithAllocator(
+    NBSM_MachineBuilder *builder, unsigned int initial_count, const NBSM_Allocator *allocator);
 
-            NBSM_AddCondition(machine, t, cb->var_name, cb->type, right_op);
-        }
-    }
+// Destroy a concurrent pool and release memory, all of its caches must be destroyed first
+void NBSM_DestroyConcurrentPool(NBSM_ConcurrentPool *pool);
 
-    return machine;
-}
+// Create a cache of state machines for the calling thread, avoids touching the pool's shared free list
+// for most acquires and recycles
+NBSM_PoolCache *NBSM_CreatePoolCache(NBSM_ConcurrentPool *pool);
 
-NBSM_MachinePool *NBSM_CreatePool(NBSM_MachineBuilder *builder, unsigned int initial_count)
-{
-    NBSM_MachinePool *pool = NBSM_Alloc(sizeof(NBSM_MachinePool));
+// Give the cached state machines back to the pool and release memory
+void NBSM_DestroyPoolCache(NBSM_PoolCache *cache);
 
-    pool->builder = builder;
-    pool->machines = NULL;
-    pool->count = 0;
-    pool->idx = 0;
-    pool->free = NULL;
+// Get a state machine from a concurrent pool, through the calling thread's cache (can be NULL)
+// If there is no free machine left in the pool, a new slab twice as large as the previous one is allocated
+NBSM_Machine *NBSM_GetFromConcurrentPool(NBSM_ConcurrentPool *pool, NBSM_PoolCache *cache);
 
-    GrowPool(pool, initial_count);
+// Recycle a state machine that was created from a concurrent pool, through the calling thread's cache (can be NULL)
+// The current state will be set back to the initial one
+void NBSM_RecycleToConcurrentPool(NBSM_ConcurrentPool *pool, NBSM_PoolCache *cache, NBSM_Machine *machine);
 
-    return pool;
-}
+#endif // NBSM_PARALLEL
 
-NBSM_Machine *NBSM_GetFromPool(NBSM_MachinePool *pool)
-{
-    if (pool->free)
-    {
-        void *free = pool->free;
+#pragma endregion // Public API
 
-        pool->free = pool->free->next;
+#pragma region "Implementation"
 
-        return free;
-    }
+#ifdef NBSM_IMPL
 
-    if (pool->idx == pool->count)
-        GrowPool(pool, pool->count * 2);
+#if !defined(NBSM_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
 
-    NBSM_Machine *machine = pool->machines[pool->idx];
+#define NBSM_SIMD_X86
 
-    pool->idx++;
+#include <immintrin.h>
 
-    return machine;
-}
+#endif
 
-void NBSM_Recycle(NBSM_MachinePool *pool, NBSM_Machine *machine)
-{
-    NBSM_Reset(machine);
+#pragma region "Allocator"
 
-    NBSM_MachinePoolFreeBlock *free = pool->free;
+// the default allocator uses the NBSM_Alloc, NBSM_Realloc and NBSM_Dealloc macros
+
+static void *DefaultAlloc(void *user_data, size_t size)
+{
+    (void)user_data;
 
-    pool->free = (void *)machine;
-    pool->free->next = free;
+    return NBSM_Alloc(size);
 }
 
-void NBSM_Reset(NBSM_Machine *machine)
+static void *DefaultRealloc(void *user_data, void *ptr, size_t size)
 {
-    machine->current = machine->initial_state;
+    (void)user_data;
+
+    return NBSM_Realloc(ptr, size);
 }
 
-void NBSM_Destroy(NBSM_Machine *machine, bool free_str)
+static void DefaultFree(void *user_data, void *ptr)
 {
-    DestroyHTable(machine->variables, true, DestroyMachineValue, free_str);
-    DestroyHTable(machine->states, true, DestroyMachineState, free_str);
+    (void)user_data;
 
-    NBSM_Dealloc(machine);
+    NBSM_Dealloc(ptr);
 }
 
-void NBSM_DestroyPool(NBSM_MachinePool *pool)
+static const NBSM_Allocator default_allocator = { DefaultAlloc, DefaultRealloc, DefaultFree, NULL };
+
+static void *Allocate(const NBSM_Allocator *allocator, size_t size)
 {
-    for (unsigned int i = 0; i < pool->count; i++)
-        NBSM_Destroy(pool->machines[i], true);
+    return allocator->alloc(allocator->user_data, size);
+}
 
-    NBSM_Dealloc(pool->machines);
-    NBSM_Dealloc(pool);
+static void *Reallocate(const NBSM_Allocator *allocator, void *ptr, size_t size)
+{
+    return allocator->realloc(allocator->user_data, ptr, size);
 }
 
-void NBSM_Update(NBSM_Machine *machine)
+static void Deallocate(const NBSM_Allocator *allocator, void *ptr)
 {
-    NBSM_Assert(machine->current);
+    allocator->free(allocator->user_data, ptr);
+}
 
-    NBSM_Transition *t = machine->current->transitions;
+#pragma endregion // Allocator
 
-    while (t)
-    {
-        if (t->conditions == NULL)
-            break;
+#pragma region "Hash table"
 
-        bool res = true;
+static unsigned long HashSDBM(const char *str)
+{
+    unsigned long hash = 0;
+    int c;
 
-        NBSM_Condition *c = t->conditions;
+    while ((c = *str++))
+    {
+        hash = c + (hash << 6) + (hash << 16) - hash;
+    }
 
-        while (c)
-        {
-            NBSM_Value *v2;
+    return hash;
+}
 
-            v2 = (c->right_op.type == NBSM_OPERAND_CONST) ? &c->right_op.data.constant : c->right_op.data.var;
+// distance between the slot of an entry and the slot its hash maps to
+static unsigned int GetProbeDistance(NBSM_HTable *htable, unsigned int hash, unsigned int slot)
+{
+    return (slot - hash) & (htable->capacity - 1);
+}
 
-            if (!c->func(c->left_op, v2))
-            {
-                res = false;
+static NBSM_HTableEntry *FindHTableEntry(NBSM_HTable *htable, const char *key)
+{
+    unsigned int hash = (unsigned int)HashSDBM(key);
+    unsigned int mask = htable->capacity - 1;
 
-                break;
-            }
+    // robin hood linear probing: the key cannot be further than the first entry that is closer to its own slot
 
-            c = c->next;
-        }
+    for (unsigned int slot = hash & mask, dist = 0;; slot = (slot + 1) & mask, dist++)
+    {
+        NBSM_HTableEntry *entry = &htable->entries[slot];
 
-        if (res)
-            break;
+        if (!entry->key || GetProbeDistance(htable, entry->hash, slot) < dist)
+            return NULL;
 
-        t = t->next;
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            return entry;
     }
+}
 
-    if (t)
-        ChangeState(machine, t->target_state);
-
-    if (machine->current->on_update)
-        machine->current->on_update(machine, machine->current->user_data);
+static bool DoesEntryExist(NBSM_HTable *htable, const char *key)
+{
+    return !!FindHTableEntry(htable, key);
 }
 
-void NBSM_ChangeState(NBSM_Machine *machine, const char *name)
+// smallest power of two capacity that can hold count entries without growing
+static unsigned int GetHTableCapacity(unsigned int count)
 {
-    NBSM_State *s = GetInHTable(machine->states, name);
+    unsigned int capacity = 1;
 
-    NBSM_Assert(s);
+    while (count >= capacity * NBSM_HTABLE_LOAD_FACTOR_THRESHOLD)
+        capacity *= 2;
 
-    ChangeState(machine, s);
+    return capacity;
 }
 
-void NBSM_AddState(NBSM_Machine *machine, const char *name, bool is_initial)
+static void InitHTable(
+    NBSM_HTable *htable, const NBSM_Allocator *allocator, NBSM_HTableEntry *entries, unsigned int capacity)
 {
-    NBSM_Assert(!DoesEntryExist(machine->states, name));
+    htable->allocator = allocator;
+    htable->entries = entries;
+    htable->capacity = capacity;
+    htable->count = 0;
 
-    NBSM_State *s = NBSM_Alloc(sizeof(NBSM_State));
+    for (unsigned int i = 0; i < capacity; i++)
+        htable->entries[i].key = NULL;
+}
 
-    s->name = name;
-    s->transitions = NULL;
-    s->user_data = NULL;
-    s->on_enter = NULL;
-    s->on_exit = NULL;
-    s->on_update = NULL;
+static NBSM_HTable *CreateHTableWithCapacity(const NBSM_Allocator *allocator, unsigned int capacity)
+{
+    NBSM_HTable *htable = Allocate(allocator, sizeof(NBSM_HTable));
+    unsigned int pow2_capacity = 1;
 
-    AddToHTable(machine->states, name, s);
+    while (pow2_capacity < capacity)
+        pow2_capacity *= 2;
 
-    if (is_initial)
-    {
-        NBSM_Assert(!machine->current);
+    InitHTable(htable, allocator, Allocate(allocator, sizeof(NBSM_HTableEntry) * pow2_capacity), pow2_capacity);
 
-        machine->current = s;
-        machine->initial_state = s;
-    }
+    return htable;
 }
 
-void NBSM_AttachDataToState(NBSM_Machine *machine, const char *name, void *user_data)
+// the key must not be in the table already
+static void InsertHTableEntry(NBSM_HTable *htable, NBSM_HTableEntry entry)
 {
-    NBSM_State *s = GetInHTable(machine->states, name);
+    unsigned int mask = htable->capacity - 1;
 
-    NBSM_Assert(s);
+    for (unsigned int slot = entry.hash & mask, dist = 0;; slot = (slot + 1) & mask, dist++)
+    {
+        NBSM_HTableEntry *current = &htable->entries[slot];
 
-    s->user_data = user_data;
-}
+        if (!current->key)
+        {
+            *current = entry;
+            htable->count++;
 
-void NBSM_OnStateEnter(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func)
-{
-    NBSM_State *s = GetInHTable(machine->states, name);
+            return;
+        }
 
-    NBSM_Assert(s);
+        unsigned int current_dist = GetProbeDistance(htable, current->hash, slot);
+
+        // take the slot of entries closer to their own slot and keep inserting the displaced entry
+        if (current_dist < dist)
+        {
+            NBSM_HTableEntry displaced = *current;
 
-    s->on_enter = hook_func;
+            *current = entry;
+            entry = displaced;
+            dist = current_dist;
+        }
+    }
 }
 
-void NBSM_OnStateExit(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func)
+static void RemoveHTableEntry(NBSM_HTable *htable, NBSM_HTableEntry *entry)
 {
-    NBSM_State *s = GetInHTable(machine->states, name);
+    unsigned int mask = htable->capacity - 1;
+    unsigned int slot = entry - htable->entries;
+    unsigned int next = (slot + 1) & mask;
 
-    NBSM_Assert(s);
+    // shift the following entries back so no tombstone is needed
+
+    while (htable->entries[next].key && GetProbeDistance(htable, htable->entries[next].hash, next) > 0)
+    {
+        htable->entries[slot] = htable->entries[next];
+        slot = next;
+        next = (next + 1) & mask;
+    }
 
-    s->on_exit = hook_func;
+    htable->entries[slot].key = NULL;
+    htable->count--;
 }
 
-void NBSM_OnStateUpdate(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func)
+// create a table that can hold count entries without growing
+static NBSM_HTable *CreateHTableForCount(const NBSM_Allocator *allocator, unsigned int count)
 {
-    NBSM_State *s = GetInHTable(machine->states, name);
-
-    NBSM_Assert(s);
-
-    s->on_update = hook_func;
+    return CreateHTableWithCapacity(allocator, GetHTableCapacity(count));
 }
 
-NBSM_Transition *NBSM_AddTransition(NBSM_Machine *machine, const char *from, const char *to)
+static void DestroyHTable(
+    NBSM_HTable *htable, bool destroy_items, HTableDestroyItemFunc destroy_item_func, bool destroy_keys)
 {
-    NBSM_State *from_s = GetInHTable(machine->states, from);
+    for (unsigned int i = 0; i < htable->capacity; i++)
+    {
+        NBSM_HTableEntry *entry = &htable->entries[i];
 
-    NBSM_Assert(from_s);
+        if (entry->key)
+        {
+            if (destroy_items)
+                destroy_item_func(htable->allocator, entry->item);
 
-    NBSM_State *to_s = GetInHTable(machine->states, to);
+            if (destroy_keys)
+                Deallocate(htable->allocator, (void *)entry->key);
+        }
+    }
 
-    NBSM_Assert(to_s);
+    Deallocate(htable->allocator, htable->entries);
+    Deallocate(htable->allocator, htable);
+}
 
-    NBSM_Transition *new_t = NBSM_Alloc(sizeof(NBSM_Transition));
+static void GrowHTable(NBSM_HTable *htable)
+{
+    unsigned int old_capacity = htable->capacity;
+    NBSM_HTableEntry *old_entries = htable->entries;
 
-    new_t->target_state = to_s;
-    new_t->conditions = NULL;
-    new_t->next = NULL;
+    htable->capacity = old_capacity * 2;
+    htable->entries = Allocate(htable->allocator, sizeof(NBSM_HTableEntry) * htable->capacity);
+    htable->count = 0;
 
-    if (!from_s->transitions)
+    for (unsigned int i = 0; i < htable->capacity; i++)
+        htable->entries[i].key = NULL;
+
+    // rehash, the hashes are cached in the entries
+
+    for (unsigned int i = 0; i < old_capacity; i++)
     {
-        from_s->transitions = new_t;
+        if (old_entries[i].key)
+            InsertHTableEntry(htable, old_entries[i]);
     }
-    else
-    {
-        NBSM_Transition *t = from_s->transitions;
 
-        while (t->next)
-            t = t->next;
+    Deallocate(htable->allocator, old_entries);
+}
 
-        t->next = new_t;
+static void AddToHTable(NBSM_HTable *htable, const char *key, void *item)
+{
+    NBSM_HTableEntry *existing_entry = FindHTableEntry(htable, key);
+
+    // keep the key already in the table: it is the one DestroyHTable frees when the table owns its keys, the key
+    // passed in stays owned by the caller
+    if (existing_entry)
+    {
+        existing_entry->item = item;
+
+        return;
     }
 
-    return new_t;
+    if (htable->count + 1 > htable->capacity * NBSM_HTABLE_LOAD_FACTOR_THRESHOLD)
+        GrowHTable(htable);
+
+    InsertHTableEntry(htable, (NBSM_HTableEntry){ key, item, (unsigned int)HashSDBM(key) });
 }
 
-void NBSM_AddCondition(
-    NBSM_Machine *machine, NBSM_Transition *transition, const char *var_name, NBSM_ConditionType type, NBSM_ConditionOperand right_op)
+static void *GetInHTable(NBSM_HTable *htable, const char *key)
 {
-    NBSM_Condition *new_c = NBSM_Alloc(sizeof(NBSM_Condition));
-    NBSM_Value *var = NBSM_GetVariable(machine, var_name);
+    NBSM_HTableEntry *entry = FindHTableEntry(htable, key);
 
-    NBSM_Assert(var);
-    NBSM_Assert(var->type == (right_op.type == NBSM_OPERAND_CONST ? right_op.data.constant.type : right_op.data.var->type));
+    return entry ? entry->item : NULL;
+}
 
-    new_c->left_op = var;
-    new_c->right_op = right_op;
-    new_c->func = GetConditionFunction(type);
-    new_c->next = NULL;
+static void *RemoveFromHTable(NBSM_HTable *htable, const char *key)
+{
+    NBSM_HTableEntry *entry = FindHTableEntry(htable, key);
 
-    if (!transition->conditions)
-    {
-        transition->conditions = new_c;
-    }
-    else
+    if (entry)
     {
-        NBSM_Condition *c = transition->conditions;
+        void *item = entry->item;
 
-        while (c->next)
-            c = c->next;
+        RemoveHTableEntry(htable, entry);
 
-        c->next = new_c;
+        return item;
     }
-}
-
-NBSM_Value *NBSM_AddVariable(NBSM_Machine *machine, const char *name, NBSM_ValueType type)
-{
-    NBSM_Assert(!DoesEntryExist(machine->variables, name));
-
-    NBSM_Value *v = NBSM_Alloc(sizeof(NBSM_Value));
-
-    v->type = type;
-
-    memset(&v->value, 0, sizeof(v->value));
-
-    AddToHTable(machine->variables, name, v);
-
-    return v;
-}
-
-NBSM_Value *NBSM_AddInteger(NBSM_Machine *machine, const char *name)
-{
-    return NBSM_AddVariable(machine, name, NBSM_INTEGER);
-}
-
-NBSM_Value *NBSM_AddFloat(NBSM_Machine *machine, const char *name)
-{
-    return NBSM_AddVariable(machine, name, NBSM_FLOAT);
-}
-
-NBSM_Value *NBSM_AddBoolean(NBSM_Machine *machine, const char *name)
-{
-    return NBSM_AddVariable(machine, name, NBSM_BOOLEAN);
-}
-
-void NBSM_SetInteger(NBSM_Value *var, int value)
-{
-    NBSM_Assert(var->type == NBSM_INTEGER);
 
-    var->value.i = value;
+    return NULL;
 }
 
-void NBSM_SetFloat(NBSM_Value *var, float value)
-{
-    NBSM_Assert(var->type == NBSM_FLOAT);
+#pragma endregion // Hash table
 
-    var->value.f = value;
-}
+#pragma region "String pool"
 
-void NBSM_SetBoolean(NBSM_Value *var, bool value)
+static NBSM_StringPool *CreateStringPool(const NBSM_Allocator *allocator)
 {
-    NBSM_Assert(var->type == NBSM_BOOLEAN);
-
-    var->value.b = value;
-}
+    NBSM_StringPool *pool = Allocate(allocator, sizeof(NBSM_StringPool));
 
-int NBSM_GetInteger(NBSM_Value *var)
-{
-    NBSM_Assert(var->type == NBSM_INTEGER);
+    pool->allocator = *allocator;
+    pool->strings = CreateHTableWithCapacity(&pool->allocator, 32);
+    pool->chunks = NULL;
 
-    return var->value.i;
+    return pool;
 }
 
-float NBSM_GetFloat(NBSM_Value *var)
+static void DestroyStringPool(NBSM_StringPool *pool)
 {
-    NBSM_Assert(var->type == NBSM_FLOAT);
+    NBSM_Allocator allocator = pool->allocator;
+    NBSM_StringChunk *chunk = pool->chunks;
 
-    return var->value.f;
-}
+    while (chunk)
+    {
+        NBSM_StringChunk *next = chunk->next;
 
-bool NBSM_GetBoolean(NBSM_Value *var)
-{
-    NBSM_Assert(var->type == NBSM_BOOLEAN);
+        Deallocate(&allocator, chunk);
 
-    return var->value.b;
-}
+        chunk = next;
+    }
 
-NBSM_Value *NBSM_GetVariable(NBSM_Machine *machine, const char *name)
-{
-    return GetInHTable(machine->variables, name);
+    DestroyHTable(pool->strings, false, NULL, false);
+    Deallocate(&allocator, pool);
 }
 
-#ifdef NBSM_JSON_BUILDER
-
-NBSM_MachineBuilder *NBSM_CreateBuilderFromJSON(const char *json)
+static char *InternString(NBSM_StringPool *pool, const char *str)
 {
-    NBSM_MachineBuilder *builder = NBSM_Alloc(sizeof(NBSM_MachineBuilder));
-
-    builder->state_count = 0;
-    builder->states = NULL;
-
-    builder->variable_count = 0;
-    builder->variables = NULL;
-
-    builder->transition_count = 0;
-    builder->transitions = NULL;
-
-    builder->free_strings = true;
+    char *interned = GetInHTable(pool->strings, str);
 
-    struct json_value_s *root = json_parse(json, strlen(json));
-
-    NBSM_Assert(root->type == json_type_object);
+    if (interned)
+        return interned;
 
-    struct json_object_s *object = (struct json_object_s*)root->payload;
-    struct json_object_element_s *node = object->start;
+    size_t size = strlen(str) + 1;
+    NBSM_StringChunk *chunk = pool->chunks;
 
-    while (node)
+    if (!chunk || chunk->used + size > chunk->size)
     {
-        if (strcmp(node->name->string, "variables") == 0)
-        {
-            NBSM_Assert(node->value->type == json_type_array);
+        size_t chunk_size = size > NBSM_STRING_CHUNK_SIZE ? size : NBSM_STRING_CHUNK_SIZE;
 
-            LoadVariablesFromJSON(builder, node->value->payload);
-        }
-        else if (strcmp(node->name->string, "states") == 0)
-        {
-            NBSM_Assert(node->value->type == json_type_array);
+        chunk = Allocate(&pool->allocator, sizeof(NBSM_StringChunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
 
-            LoadStatesFromJSON(builder, node->value->payload);
+        // keep filling the current chunk when the string is too large for a regular chunk
+        if (pool->chunks && chunk_size > NBSM_STRING_CHUNK_SIZE)
+        {
+            chunk->next = pool->chunks->next;
+            pool->chunks->next = chunk;
         }
-        else if (strcmp(node->name->string, "transitions") == 0)
+        else
         {
-            NBSM_Assert(node->value->type == json_type_array);
-
-            LoadTransitionsFromJSON(builder, node->value->payload);
+            chunk->next = pool->chunks;
+            pool->chunks = chunk;
         }
-
-        node = node->next;
     }
 
-    NBSM_Dealloc(root);
+    interned = memcpy(chunk->data + chunk->used, str, size);
+    chunk->used += size;
 
-    return builder;
+    AddToHTable(pool->strings, interned, interned);
+
+    return interned;
 }
 
-#endif // NBSM_JSON_BUILDER
+#pragma endregion // String pool
 
-void NBSM_DestroyBuilder(NBSM_MachineBuilder *builder)
-{
-    if (builder->states)
-    {
-        if (builder->free_strings)
-        {
-            for (unsigned int i = 0; i < builder->state_count; i++)
-                NBSM_Dealloc(builder->states[i].name);
-        }
+#pragma region "State machine"
 
-        NBSM_Dealloc(builder->states);
-    }
+#pragma region "Public API"
 
-    if (builder->variables)
-    {
-        if (builder->free_strings)
-        {
-            for (unsigned int i = 0; i < builder->variable_count; i++)
-                NBSM_Dealloc(builder->variables[i].name);
-        }
+static void ChangeState(NBSM_Machine *machine, NBSM_State *state);
+static bool HasDirtyDependency(NBSM_State *state);
+static void ClearDependencies(NBSM_State *state);
+static bool HasDependency(NBSM_State *state, NBSM_Value *var);
+static void AddDependency(const NBSM_Allocator *allocator, NBSM_State *state, NBSM_Value *var);
+static void PushDependency(NBSM_State *state, NBSM_Value *var);
+static void InitMachineState(NBSM_State *state, NBSM_StateId id, const char *name);
+static void *RebasePointer(const void *ptr, const char *old_base, char *new_base);
+static char *RebaseName(const char *name, const char *old_base, char *new_base, size_t size);
+static void RebaseHTable(NBSM_HTable *htable, const char *old_base, char *new_base, size_t size);
+static NBSM_Machine *CloneMachine(NBSM_Machine *machine, void *buffer, size_t size);
+static void CopyPrototypeNames(NBSM_Machine *machine);
+static NBSM_State *FindTransition(NBSM_Machine *machine);
+static NBSM_State *FindCompiledTransition(NBSM_Machine *machine);
+static NBSM_Opcode GetConditionOpcode(
+    NBSM_ConditionType type, NBSM_ValueType value_type, NBSM_ConditionOperandType operand_type);
+static inline bool ExecuteOpcode(
+    NBSM_Opcode op, const NBSM_Variant *left, const NBSM_Variant *right_const, const NBSM_Variant *right_var);
+static void DestroyMachineValue(const NBSM_Allocator *allocator, void *ptr);
+static void DestroyMachineState(const NBSM_Allocator *allocator, void *ptr);
+static void DestroyMachineTransition(const NBSM_Allocator *allocator, NBSM_Transition *transition);
+static void GrowPool(NBSM_MachinePool *pool, unsigned int count);
+static void ChangeInstanceState(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int state);
+static NBSM_DefinitionState *GetDefinitionState(NBSM_Definition *definition, const char *name);
+static bool CheckInstanceTransition(
+    const NBSM_Definition *definition, const NBSM_DefinitionTransition *transition, const NBSM_Instance *instance);
+static size_t GetBatchScratchSize(const NBSM_Definition *definition, unsigned int count);
+static void CallInstanceHook(
+    NBSM_InstanceHookFunc hook_func, NBSM_Instance *instance, void *user_data, NBSM_DeferredHooks *deferred_hooks);
+static void UpdateBatch(
+    const NBSM_Definition *definition,
+    NBSM_Instance **instances,
+    unsigned int count,
+    void *scratch,
+    NBSM_DeferredHooks *deferred_hooks);
+static bool DependsOnVariable(const NBSM_Definition *definition, const NBSM_DefinitionState *state, unsigned int var);
+static void WakeInstance(NBSM_Instance *instance);
+static void WakeOnVariableChange(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var);
+static void GrowPopulation(NBSM_Population *population, unsigned int capacity);
+static void WriteIdentifier(FILE *out, const char *str);
+static char GetIdentifierChar(char c);
+static bool CheckGeneratedIdentifiers(NBSM_MachineBuilder *builder);
+static bool AddGeneratedIdentifier(NBSM_HTable *identifiers, const char *str);
+static void WriteGeneratedState(FILE *out, const char *name, const char *state_name);
+static void WriteGeneratedValue(FILE *out, NBSM_Value value);
+static void WriteGeneratedCondition(FILE *out, NBSM_MachineBuilder *builder, NBSM_ConditionBlueprint *condition);
+
+#ifdef NBSM_PARALLEL
+
+static void *RunWorker(void *data);
+static void RunWorkerJob(NBSM_WorkerPool *pool, void (*job)(NBSM_Worker *worker));
+static void ProcessChunks(NBSM_Worker *worker);
+static bool TakeChunk(NBSM_Worker *worker, bool is_owner, unsigned int *chunk);
+
+#ifdef NBSM_POSIX
+
+static void LoadBuildersJob(NBSM_Worker *worker);
+
+#endif // NBSM_POSIX
+
+static NBSM_PoolSlot *GetPoolSlot(NBSM_ConcurrentPool *pool, uint32_t index);
+static NBSM_Machine *GetPoolSlotMachine(NBSM_PoolSlot *slot);
+static NBSM_PoolSlot *GetMachinePoolSlot(NBSM_Machine *machine);
+static NBSM_PoolSlot *PopPoolSlot(NBSM_ConcurrentPool *pool);
+static void PushPoolSlots(NBSM_ConcurrentPool *pool, NBSM_PoolSlot *first, NBSM_PoolSlot *last);
+static void PushMachinesToConcurrentPool(NBSM_ConcurrentPool *pool, NBSM_Machine **machines, unsigned int count);
+static void GrowConcurrentPool(NBSM_ConcurrentPool *pool);
+
+// size of the slot header stored before each state machine of a concurrent pool
+#define NBSM_POOL_SLOT_HEADER_SIZE \
+    ((sizeof(NBSM_PoolSlot) + NBSM_BLOCK_ALIGNMENT - 1) & ~(size_t)(NBSM_BLOCK_ALIGNMENT - 1))
+
+#endif // NBSM_PARALLEL
 
-        NBSM_Dealloc(builder->variables);
-    }
-    
-    if (builder->transitions)
-    {
-        for (unsigned int i = 0; i < builder->transition_count; i++)
-        {
-            NBSM_TransitionBlueprint *transi = &builder->transitions[i];
-            NBSM_ConditionBlueprint *conditions = transi->conditions;
+typedef struct
+{
+    NBSM_SIMDLevel level;
 
-            if (builder->free_strings)
-            {
-                NBSM_Dealloc(transi->from);
-                NBSM_Dealloc(transi->to);
-            }
+    // return the mask of the instances of a block that are in the given state
+    unsigned int (*match_state)(const unsigned int *states, unsigned int state);
 
-            if (conditions)
-            {
-                if (builder->free_strings)
-                {
-                    for (unsigned int j = 0; j < transi->condition_count; j++)
-                        NBSM_Dealloc(transi->conditions[j].var_name);
-                }
+    // return the mask of the instances of a block for which the condition is true, "right" is NULL when the
+    // right operand is a constant
+    unsigned int (*condition)(
+        NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant);
+} PopulationKernels;
 
-                NBSM_Dealloc(conditions);
-            }
-        }
+// offsets of the parts of a state machine built in a single memory block
+typedef struct
+{
+    size_t states_table;
+    size_t state_entries;
+    size_t variables_table;
+    size_t variable_entries;
+    size_t states_by_id;
+    size_t variables_by_id;
+    size_t state_array;
+    size_t values;
+    size_t default_values;
+    size_t transitions;
+    size_t conditions;
+    size_t dependencies;
+    size_t strings;
+    size_t size;
+} BuildLayout;
+
+// binary definition format, all records are made of 32 bits fields and names are offsets in the string table stored
+// at the end: header, states, variables, transitions, conditions (in the order of their transitions), string table
+
+#define NBSM_BINARY_MAGIC 0x4D53424E // "NBSM" in little endian, detects files written on a different endianness
 
-        NBSM_Dealloc(builder->transitions);
-    }
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_count;
+    uint32_t variable_count;
+    uint32_t transition_count;
+    uint32_t condition_count;
+    uint32_t string_table_size;
+} BinaryHeader;
 
-    NBSM_Dealloc(builder);
-}
+typedef struct
+{
+    uint32_t name;
+    uint32_t is_initial;
+} BinaryState;
 
-#pragma endregion // Public API
+typedef struct
+{
+    uint32_t name;
+    uint32_t type;
+    uint32_t default_value;
+} BinaryVariable;
 
-static void ChangeState(NBSM_Machine *machine, NBSM_State *state)
+typedef struct
 {
-    NBSM_State *prev_state = machine->current;
+    uint32_t from;
+    uint32_t to;
+    uint32_t condition_count;
+} BinaryTransition;
 
-    machine->current = state;
+typedef struct
+{
+    uint32_t type;
+    uint32_t var_name;
+    uint32_t operand_type;
+    uint32_t operand; // name of the variable or bits of the constant
+    uint32_t value_type; // type of the constant
+} BinaryCondition;
 
-    if (prev_state->on_exit)
-        prev_state->on_exit(machine, prev_state->user_data);
+#define NBSM_JSON_SCALAR_SIZE 64 // maximum length of numbers read by the streaming JSON loader
+#define NBSM_JSON_MAX_DEPTH 256 // maximum nesting of the unknown values skipped by the streaming JSON loader
 
-    if (machine->current->on_enter)
-        machine->current->on_enter(machine, machine->current->user_data);
-}
+// returned for the unknown types found in a JSON file
+#define NBSM_UNKNOWN_VALUE_TYPE ((NBSM_ValueType)(NBSM_BOOLEAN + 1))
+#define NBSM_UNKNOWN_CONDITION_TYPE ((NBSM_ConditionType)(NBSM_GTE + 1))
+#define NBSM_UNKNOWN_OPERAND_TYPE ((NBSM_ConditionOperandType)(NBSM_OPERAND_VAR + 1))
 
-static NBSM_ConditionFunc GetConditionFunction(NBSM_ConditionType type)
+typedef struct
 {
-    switch (type)
-    {
-    case NBSM_EQ:
-        return ConditionEQ;
+    NBSM_ReadFunc read;
+    void *user_data;
+    char buffer[NBSM_JSON_STREAM_CHUNK_SIZE];
+    size_t length;
+    size_t position;
+    bool is_eof;
+    bool has_error; // the JSON is invalid, the stream behaves as if it had ended
+    unsigned int depth; // nesting of the value being skipped
+
+    // last string or number read, only the current one is kept in memory
+    char *token;
+    size_t token_length;
+    size_t token_capacity;
+    const NBSM_Allocator *allocator;
+} JSONStream;
+
+static const PopulationKernels *GetPopulationKernels(void);
+static const PopulationKernels *FindPopulationKernels(NBSM_SIMDLevel level);
+static size_t ReserveInBlock(size_t *offset, size_t size);
+static void GetBuildLayout(NBSM_MachineBuilder *builder, BuildLayout *layout);
+static uint32_t VariantToBinary(NBSM_ValueType type, NBSM_Variant value);
+static NBSM_Variant BinaryToVariant(NBSM_ValueType type, uint32_t bits);
+static void AddBinaryString(NBSM_HTable *strings, char *string_table, uint32_t *string_table_size, const char *str);
+static uint32_t GetBinaryString(NBSM_HTable *strings, const char *str);
+static char *GetBinaryStringAt(const BinaryHeader *header, const char *string_table, uint32_t offset, bool *is_valid);
+static void ReleaseBinaryFile(void *data, size_t size);
+static unsigned int ScalarMatchState(const unsigned int *states, unsigned int state);
+static unsigned int ScalarCondition(
+    NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant);
+
+static const PopulationKernels scalar_kernels = { NBSM_SIMD_NONE, ScalarMatchState, ScalarCondition };
+
+#ifdef NBSM_SIMD_X86
+
+static unsigned int SSE2MatchState(const unsigned int *states, unsigned int state);
+static unsigned int SSE2Condition(
+    NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant);
+static unsigned int AVX2MatchState(const unsigned int *states, unsigned int state);
+static unsigned int AVX2Condition(
+    NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant);
+
+static const PopulationKernels sse2_kernels = { NBSM_SIMD_SSE2, SSE2MatchState, SSE2Condition };
+static const PopulationKernels avx2_kernels = { NBSM_SIMD_AVX2, AVX2MatchState, AVX2Condition };
+
+#endif // NBSM_SIMD_X86
+
+// kernels forced with NBSM_SetSIMDLevel, only written by it so that populations can be updated from several threads
+static const PopulationKernels *population_kernels = NULL;
 
-    case NBSM_NEQ:
-        return ConditionNEQ;
+#ifdef NBSM_JSON_BUILDER
 
-    case NBSM_LT:
-        return ConditionLT;
+static void LoadVariablesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *var_arr);
+static void LoadStatesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *state_arr);
+static void LoadTransitionsFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *trans_arr);
+static void LoadConditionsFromJSON(
+    NBSM_MachineBuilder *builder, NBSM_TransitionBlueprint *transition, unsigned int trans_idx, struct json_array_s *cond_arr);
+static NBSM_ConditionOperandBlueprint LoadConditionOperandFromJSON(NBSM_MachineBuilder *builder, struct json_object_s *op_obj);
+static NBSM_Variant LoadValueFromJSON(NBSM_ValueType type, struct json_value_s *value);
 
-    case NBSM_LTE:
-        return ConditionLTE;
+#endif // NBSM_JSON_BUILDER
 
-    case NBSM_GT:
-        return ConditionGT;
+static NBSM_MachineBuilder *CreateEmptyBuilder(const NBSM_Allocator *allocator);
+static void *GrowBlueprints(
+    const NBSM_Allocator *allocator, void *blueprints, size_t size, unsigned int count, unsigned int *capacity);
+static void StreamVariablesFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream);
+static void StreamStatesFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream);
+static void StreamTransitionsFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream);
+static void StreamConditionsFromJSON(
+    NBSM_MachineBuilder *builder, NBSM_TransitionBlueprint *transition, unsigned int trans_idx, JSONStream *stream);
+static NBSM_ConditionOperandBlueprint StreamConditionOperandFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream);
+static NBSM_Variant ScalarToVariant(JSONStream *stream, NBSM_ValueType type, const char *scalar);
+static NBSM_ValueType GetVariableTypeFromJSON(const char *type_str);
+static NBSM_ConditionType GetConditionTypeFromJSON(const char *type_str);
+static bool CheckJSONStream(JSONStream *stream, bool condition);
+static int PeekJSONChar(JSONStream *stream);
+static int ReadJSONChar(JSONStream *stream);
+static int SkipJSONWhitespace(JSONStream *stream);
+static void ExpectJSONChar(JSONStream *stream, char expected);
+static void PushJSONTokenChar(JSONStream *stream, char c);
+static char *ReadJSONString(JSONStream *stream);
+static void ReadJSONUnicodeEscape(JSONStream *stream);
+static unsigned int ReadJSONHex(JSONStream *stream);
+static char *ReadJSONNumber(JSONStream *stream);
+static void ReadJSONLiteral(JSONStream *stream, const char *literal);
+static bool ReadJSONBoolean(JSONStream *stream);
+static void ReadJSONScalar(JSONStream *stream, char *scalar);
+static void SkipJSONValue(JSONStream *stream);
+static char *NextJSONKey(JSONStream *stream, bool *is_first);
+static bool NextJSONElement(JSONStream *stream, bool *is_first);
+
+#ifdef NBSM_POSIX
+
+static size_t ReadJSONFromFd(void *user_data, char *buffer, size_t size);
+static NBSM_BuilderRegistry *ListBuilderFiles(const char *path);
+static void LoadBuilderFile(NBSM_BuilderRegistry *registry, const char *directory, unsigned int index);
+static void IndexBuilderRegistry(NBSM_BuilderRegistry *registry);
+static int CompareBuilderNames(const void *a, const void *b);
+
+#endif // NBSM_POSIX
 
-    case NBSM_GTE:
-        return ConditionGTE;
-    }
+NBSM_Machine *NBSM_Create(void)
+{
+    return NBSM_CreateWithCapacity(NBSM_MACHINE_DEFAULT_CAPACITY, NBSM_MACHINE_DEFAULT_CAPACITY);
 }
 
-static bool ConditionEQ(NBSM_Value *v1, NBSM_Value *v2)
+NBSM_Machine *NBSM_CreateWithCapacity(unsigned int state_count, unsigned int variable_count)
 {
-    NBSM_Assert(v1->type == v2->type);
-
-    if (v1->type == NBSM_INTEGER)
-        return v1->value.i == v2->value.i;
-
-    if (v1->type == NBSM_FLOAT)
-        return fabs(v1->value.f - v2->value.f) < FLT_EPSILON;
+    return NBSM_CreateWithAllocator(state_count, variable_count, &default_allocator);
+}
 
-    if (v1->type == NBSM_BOOLEAN)
-        return v1->value.b == v2->value.b;
+NBSM_Machine *NBSM_CreateWithAllocator(
+    unsigned int state_count, unsigned int variable_count, const NBSM_Allocator *allocator)
+{
+    NBSM_Machine *machine = Allocate(allocator, sizeof(NBSM_Machine));
+
+    machine->allocator = *allocator;
+    machine->states = CreateHTableForCount(&machine->allocator, state_count);
+    machine->variables = CreateHTableForCount(&machine->allocator, variable_count);
+    machine->state_capacity = state_count > 0 ? state_count : 1;
+    machine->variable_capacity = variable_count > 0 ? variable_count : 1;
+    machine->states_by_id = Allocate(allocator, sizeof(NBSM_State *) * machine->state_capacity);
+    machine->variables_by_id = Allocate(allocator, sizeof(NBSM_Value *) * machine->variable_capacity);
+    machine->variable_count = 0;
+    machine->current = NULL;
+    machine->user_data = NULL;
+    machine->force_evaluation = true;
+    machine->is_compiled = false;
+    machine->state_array = NULL;
+    machine->state_count = 0;
+    machine->transitions = NULL;
+    machine->conditions = NULL;
+    machine->block = NULL;
+    machine->block_size = 0;
+    machine->owns_block = false;
+    machine->names_offset = 0;
+    machine->prototype = NULL;
+    machine->values = NULL;
+    machine->default_values = NULL;
+    machine->pool_index = 0;
 
-    return false;
+    return machine;
 }
 
-static bool ConditionNEQ(NBSM_Value *v1, NBSM_Value *v2)
+NBSM_Machine *NBSM_Build(NBSM_MachineBuilder *builder)
 {
-    return !ConditionEQ(v1, v2);
+    return NBSM_BuildWithAllocator(builder, &default_allocator);
 }
 
-static bool ConditionLT(NBSM_Value *v1, NBSM_Value *v2)
+NBSM_Machine *NBSM_BuildWithAllocator(NBSM_MachineBuilder *builder, const NBSM_Allocator *allocator)
 {
-    NBSM_Assert(v1->type == v2->type && v1->type != NBSM_BOOLEAN);
-
-    if (v1->type == NBSM_INTEGER)
-        return v1->value.i < v2->value.i;
+    NBSM_Machine *machine = NBSM_BuildInPlace(builder, Allocate(allocator, NBSM_GetBuildSize(builder)));
 
-    if (v1->type == NBSM_FLOAT)
-        return v1->value.f < v2->value.f - FLT_EPSILON;
+    machine->allocator = *allocator;
+    machine->owns_block = true;
 
-    return false;
+    return machine;
 }
 
-static bool ConditionLTE(NBSM_Value *v1, NBSM_Value *v2)
+NBSM_Machine *NBSM_Clone(NBSM_Machine *machine)
 {
-    NBSM_Assert(v1->type == v2->type && v1->type != NBSM_BOOLEAN);
+    NBSM_Assert(machine->block);
 
-    if (v1->type == NBSM_INTEGER)
-        return v1->value.i <= v2->value.i;
+    NBSM_Machine *clone = NBSM_CloneInPlace(machine, Allocate(&machine->allocator, NBSM_GetCloneSize(machine)));
 
-    if (v1->type == NBSM_FLOAT)
-        return v1->value.f < v2->value.f - FLT_EPSILON;
+    clone->owns_block = true;
 
-    return false;
+    return clone;
 }
 
-static bool ConditionGT(NBSM_Value *v1, NBSM_Value *v2)
+size_t NBSM_GetCloneSize(NBSM_Machine *machine)
 {
-    NBSM_Assert(v1->type == v2->type && v1->type != NBSM_BOOLEAN);
-
-    if (v1->type == NBSM_INTEGER)
-        return v1->value.i > v2->value.i;
+    NBSM_Assert(machine->block);
 
-    if (v1->type == NBSM_FLOAT)
-        return v1->value.f > v2->value.f + FLT_EPSILON;
-
-    return false;
+    return machine->prototype ? machine->prototype->block_size : machine->block_size;
 }
 
-static bool ConditionGTE(NBSM_Value *v1, NBSM_Value *v2)
+NBSM_Machine *NBSM_CloneInPlace(NBSM_Machine *machine, void *buffer)
 {
-    if (v1->type == NBSM_INTEGER)
-        return v1->value.i >= v2->value.i;
+    NBSM_Machine *clone = CloneMachine(machine, buffer, machine->block_size);
 
-    if (v1->type == NBSM_FLOAT)
-        return v1->value.f > v2->value.f + FLT_EPSILON;
+    // the copy of a pooled state machine does not depend on the pool
+    if (clone->prototype)
+        CopyPrototypeNames(clone);
 
-    return false;
+    return clone;
 }
 
-static void DestroyMachineValue(void *ptr)
+size_t NBSM_GetBuildSize(NBSM_MachineBuilder *builder)
 {
-    NBSM_Dealloc(ptr);
+    BuildLayout layout;
+
+    GetBuildLayout(builder, &layout);
+
+    return layout.size;
 }
 
-static void DestroyMachineState(void *ptr)
+NBSM_Machine *NBSM_BuildInPlace(NBSM_MachineBuilder *builder, void *buffer)
 {
-    NBSM_State *state = ptr;
-    NBSM_Transition *t = state->transitions;
+    BuildLayout layout;
+    char *block = buffer;
+    NBSM_Machine *machine = buffer;
+
+    GetBuildLayout(builder, &layout);
+
+    machine->allocator = default_allocator;
+    machine->states = (NBSM_HTable *)(block + layout.states_table);
+    machine->variables = (NBSM_HTable *)(block + layout.variables_table);
+    machine->states_by_id = (NBSM_State **)(block + layout.states_by_id);
+    machine->variables_by_id = (NBSM_Value **)(block + layout.variables_by_id);
+    machine->variable_count = builder->variable_count;
+    machine->state_capacity = builder->state_count;
+    machine->variable_capacity = builder->variable_count;
+    machine->current = NULL;
+    machine->initial_state = NULL;
+    machine->user_data = NULL;
+    machine->force_evaluation = true;
+    machine->state_count = builder->state_count;
+    machine->is_compiled = true;
+    machine->state_array = (NBSM_State *)(block + layout.state_array);
+    machine->transitions = (NBSM_CompiledTransition *)(block + layout.transitions);
+    machine->conditions = (NBSM_CompiledCondition *)(block + layout.conditions);
+    machine->block = buffer;
+    machine->block_size = layout.size;
+    machine->owns_block = false;
+    machine->names_offset = layout.strings;
+    machine->prototype = NULL;
+
+    InitHTable(
+        machine->states,
+        &machine->allocator,
+        (NBSM_HTableEntry *)(block + layout.state_entries),
+        GetHTableCapacity(builder->state_count));
+    InitHTable(
+        machine->variables,
+        &machine->allocator,
+        (NBSM_HTableEntry *)(block + layout.variable_entries),
+        GetHTableCapacity(builder->variable_count));
+
+    NBSM_Value *values = (NBSM_Value *)(block + layout.values);
+    NBSM_Value *default_values = (NBSM_Value *)(block + layout.default_values);
+    char *str = block + layout.strings;
+
+    machine->values = values;
+    machine->default_values = default_values;
+    machine->pool_index = 0;
 
-    while (t)
+    for (unsigned int i = 0; i < builder->variable_count; i++)
     {
-        NBSM_Transition *next = t->next;
+        NBSM_VariableBlueprint *vb = &builder->variables[i];
+        NBSM_Value *v = &values[i];
 
-        DestroyMachineTransition(t);
+        NBSM_Assert(!DoesEntryExist(machine->variables, vb->name));
 
-        t = next;
-    }
+        v->type = vb->type;
+        v->value = vb->default_value;
+        v->dirty = false;
+        v->id = i;
+        default_values[i] = *v;
 
-    NBSM_Dealloc(ptr);
-}
+        strcpy(str, vb->name);
+        AddToHTable(machine->variables, str, v);
+        str += strlen(str) + 1;
 
-static void DestroyMachineTransition(NBSM_Transition *transition)
-{
-    NBSM_Condition *c = transition->conditions;
+        machine->variables_by_id[i] = v;
+    }
 
-    while (c)
+    for (unsigned int i = 0; i < builder->state_count; i++)
     {
-        NBSM_Condition *next = c->next;
+        NBSM_StateBlueprint *sb = &builder->states[i];
+        NBSM_State *s = &machine->state_array[i];
 
-        NBSM_Dealloc(c);
+        NBSM_Assert(!DoesEntryExist(machine->states, sb->name));
 
-        c = next;
-    }
+        strcpy(str, sb->name);
+        InitMachineState(s, i, str);
+        AddToHTable(machine->states, str, s);
+        str += strlen(str) + 1;
 
-    NBSM_Dealloc(transition);
-}
+        machine->states_by_id[i] = s;
 
-static void GrowPool(NBSM_MachinePool *pool, unsigned int count)
-{
-    pool->machines = NBSM_Realloc(pool->machines, sizeof(NBSM_Machine *) * count);
+        if (sb->is_initial)
+        {
+            NBSM_Assert(!machine->current);
 
-    for (unsigned int i = 0; i < count - pool->count; i++)
-        pool->machines[pool->count + i] = NBSM_Build(pool->builder);
+            machine->current = s;
+            machine->initial_state = s;
+        }
+    }
 
-    pool->count = count;
-}
+    // transitions are grouped by source state, the dependency_count field temporarily holds the number of
+    // conditions of the state's transitions to size its range of dependencies
 
-#ifdef NBSM_JSON_BUILDER
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+    {
+        NBSM_State *from = GetInHTable(machine->states, builder->transitions[i].from);
 
-static void LoadVariablesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *var_arr)
-{
-    builder->variable_count = var_arr->length;
-    builder->variables = NBSM_Alloc(sizeof(NBSM_VariableBlueprint) * builder->variable_count);
+        NBSM_Assert(from);
 
-    struct json_array_element_s *arr_node = var_arr->start;
+        from->transition_count++;
+        from->dependency_count += builder->transitions[i].condition_count;
+    }
 
-    int i = 0;
+    NBSM_Value **dependencies = (NBSM_Value **)(block + layout.dependencies);
+
+    for (unsigned int i = 0, first = 0; i < machine->state_count; i++)
+    {
+        NBSM_State *s = &machine->state_array[i];
+
+        s->first_transition = first;
+        s->dependencies = dependencies;
+        first += s->transition_count;
+        dependencies += s->dependency_count * 2;
+        s->transition_count = 0;
+        s->dependency_count = 0;
+    }
+
+    unsigned int condition_idx = 0;
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+    {
+        NBSM_TransitionBlueprint *tb = &builder->transitions[i];
+        NBSM_State *from = GetInHTable(machine->states, tb->from);
+        NBSM_State *to = GetInHTable(machine->states, tb->to);
+
+        NBSM_Assert(to);
+
+        NBSM_CompiledTransition *ct = &machine->transitions[from->first_transition + from->transition_count++];
+
+        ct->target_state = to->id;
+        ct->first_condition = condition_idx;
+        ct->condition_count = tb->condition_count;
+
+        if (tb->condition_count == 0)
+            from->unconditional_transition_count++;
+
+        for (unsigned int j = 0; j < tb->condition_count; j++)
+        {
+            NBSM_ConditionBlueprint *cb = &tb->conditions[j];
+            NBSM_CompiledCondition *cc = &machine->conditions[condition_idx++];
+            NBSM_Value *var = GetInHTable(machine->variables, cb->var_name);
+
+            NBSM_Assert(var);
+
+            cc->op = GetConditionOpcode(cb->type, var->type, cb->right_op.type);
+            cc->left_op = &var->value;
+
+            PushDependency(from, var);
+
+            if (cb->right_op.type == NBSM_OPERAND_CONST)
+            {
+                NBSM_Assert(cb->right_op.data.constant.type == var->type);
+
+                cc->constant = cb->right_op.data.constant.value;
+                cc->right_op = &cc->constant;
+            }
+            else
+            {
+                NBSM_Value *right_var = GetInHTable(machine->variables, cb->right_op.data.var_name);
+
+                NBSM_Assert(right_var && right_var->type == var->type);
+
+                cc->right_op = &right_var->value;
+
+                PushDependency(from, right_var);
+            }
+        }
+    }
+
+    return machine;
+}
+
+NBSM_MachinePool *NBSM_CreatePool(NBSM_MachineBuilder *builder, unsigned int initial_count)
+{
+    return NBSM_CreatePoolWithAllocator(builder, initial_count, &default_allocator);
+}
+
+NBSM_MachinePool *NBSM_CreatePoolWithAllocator(
+    NBSM_MachineBuilder *builder, unsigned int initial_count, const NBSM_Allocator *allocator)
+{
+    NBSM_MachinePool *pool = Allocate(allocator, sizeof(NBSM_MachinePool));
+
+    pool->allocator = *allocator;
+    pool->builder = builder;
+    pool->prototype = NBSM_BuildWithAllocator(builder, allocator);
+    pool->machine_size = pool->prototype->names_offset; // the names are shared with the prototype
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->machines = NULL;
+    pool->generations = NULL;
+    pool->count = 0;
+    pool->idx = 0;
+    pool->free = NULL;
+    pool->free_count = 0;
+    pool->live = NULL;
+    pool->live_count = 0;
+    pool->live_slots = NULL;
+    pool->updated = NULL;
+
+    GrowPool(pool, initial_count);
+
+    return pool;
+}
+
+NBSM_Machine *NBSM_GetFromPool(NBSM_MachinePool *pool)
+{
+    NBSM_Machine *machine;
+
+    if (pool->free_count > 0)
+    {
+        machine = pool->free[--pool->free_count];
+    }
+    else
+    {
+        if (pool->idx == pool->count)
+            GrowPool(pool, pool->count > 0 ? pool->count * 2 : 1);
+
+        machine = pool->machines[pool->idx++];
+    }
+
+    pool->live_slots[machine->pool_index] = pool->live_count;
+    pool->live[pool->live_count++] = machine;
+
+    return machine;
+}
+
+void NBSM_Recycle(NBSM_MachinePool *pool, NBSM_Machine *machine)
+{
+    NBSM_Assert(machine->pool_index < pool->count && pool->machines[machine->pool_index] == machine);
+    NBSM_Assert(!pool->updated || pool->updated == machine); // see NBSM_UpdatePool
+
+    NBSM_Reset(machine);
+
+    // invalidate the handles to the state machine
+    pool->generations[machine->pool_index]++;
+
+    // fill the hole in the live array with the last live state machine
+    unsigned int live_slot = pool->live_slots[machine->pool_index];
+
+    NBSM_Assert(live_slot < pool->live_count && pool->live[live_slot] == machine);
+
+    NBSM_Machine *last = pool->live[--pool->live_count];
+
+    pool->live[live_slot] = last;
+    pool->live_slots[last->pool_index] = live_slot;
+
+    pool->free[pool->free_count++] = machine;
+}
+
+void NBSM_UpdatePool(NBSM_MachinePool *pool)
+{
+    // backwards so the state machine moved in place of a recycled one has already been updated
+    for (unsigned int i = pool->live_count; i > 0; i--)
+    {
+        if (i - 1 < pool->live_count)
+        {
+            pool->updated = pool->live[i - 1];
+
+            NBSM_Update(pool->updated);
+        }
+    }
+
+    pool->updated = NULL;
+}
+
+NBSM_MachineHandle NBSM_GetMachineHandle(NBSM_MachinePool *pool, NBSM_Machine *machine)
+{
+    NBSM_Assert(machine->pool_index < pool->count && pool->machines[machine->pool_index] == machine);
+
+    return (NBSM_MachineHandle){ machine->pool_index, pool->generations[machine->pool_index] };
+}
+
+NBSM_Machine *NBSM_ResolveHandle(NBSM_MachinePool *pool, NBSM_MachineHandle handle)
+{
+    if (handle.index >= pool->count || pool->generations[handle.index] != handle.generation)
+        return NULL;
+
+    return pool->machines[handle.index];
+}
+
+void NBSM_Reset(NBSM_Machine *machine)
+{
+    machine->current = machine->initial_state;
+    machine->force_evaluation = true;
+
+    if (machine->default_values)
+    {
+        memcpy(machine->values, machine->default_values, sizeof(NBSM_Value) * machine->variable_count);
+    }
+    else
+    {
+        // variables of state machines not built from a machine builder default to zero
+        for (unsigned int i = 0; i < machine->variable_count; i++)
+        {
+            memset(&machine->variables_by_id[i]->value, 0, sizeof(NBSM_Variant));
+            machine->variables_by_id[i]->dirty = false;
+        }
+    }
+}
+
+void NBSM_Destroy(NBSM_Machine *machine, bool free_str)
+{
+    // the allocator is stored in the memory being released
+    NBSM_Allocator allocator = machine->allocator;
+
+    // names are stored in the block as well
+    if (machine->block)
+    {
+        if (machine->owns_block)
+            Deallocate(&allocator, machine->block);
+
+        return;
+    }
+
+    DestroyHTable(machine->variables, true, DestroyMachineValue, free_str);
+
+    Deallocate(&allocator, machine->states_by_id);
+    Deallocate(&allocator, machine->variables_by_id);
+
+    if (machine->is_compiled)
+    {
+        DestroyHTable(machine->states, false, NULL, free_str);
+
+        for (unsigned int i = 0; i < machine->state_count; i++)
+            Deallocate(&allocator, machine->state_array[i].dependencies);
+
+        Deallocate(&allocator, machine->state_array);
+        Deallocate(&allocator, machine->transitions);
+        Deallocate(&allocator, machine->conditions);
+    }
+    else
+    {
+        DestroyHTable(machine->states, true, DestroyMachineState, free_str);
+    }
+
+    Deallocate(&allocator, machine);
+}
+
+void NBSM_DestroyPool(NBSM_MachinePool *pool)
+{
+    NBSM_Allocator allocator = pool->allocator;
+
+    // the state machines are cloned in place in the slabs
+    for (unsigned int i = 0; i < pool->slab_count; i++)
+        Deallocate(&allocator, pool->slabs[i]);
+
+    NBSM_Destroy(pool->prototype, false);
+
+    Deallocate(&allocator, pool->slabs);
+    Deallocate(&allocator, pool->machines);
+    Deallocate(&allocator, pool->generations);
+    Deallocate(&allocator, pool->live);
+    Deallocate(&allocator, pool->live_slots);
+    Deallocate(&allocator, pool->free);
+    Deallocate(&allocator, pool);
+}
+
+void NBSM_Update(NBSM_Machine *machine)
+{
+    NBSM_Assert(machine->current);
+
+    NBSM_State *current = machine->current;
+
+    // nothing can have changed the outcome of the conditions since the last evaluation
+    if (!machine->force_evaluation && current->unconditional_transition_count == 0 && !HasDirtyDependency(current))
+    {
+        if (current->on_update)
+            current->on_update(machine, current->user_data);
+
+        return;
+    }
+
+    NBSM_State *target_state = machine->is_compiled ? FindCompiledTransition(machine) : FindTransition(machine);
+
+    machine->force_evaluation = false;
+
+    ClearDependencies(current);
+
+    if (target_state)
+        ChangeState(machine, target_state);
+
+    if (machine->current->on_update)
+        machine->current->on_update(machine, machine->current->user_data);
+}
+
+void NBSM_Compile(NBSM_Machine *machine)
+{
+    NBSM_Assert(!machine->is_compiled);
+
+    unsigned int transition_count = 0;
+    unsigned int condition_count = 0;
+    NBSM_State **old_states = machine->states_by_id;
+
+    for (unsigned int i = 0; i < machine->state_count; i++)
+    {
+        for (NBSM_Transition *t = old_states[i]->transitions; t; t = t->next)
+        {
+            transition_count++;
+
+            for (NBSM_Condition *c = t->conditions; c; c = c->next)
+                condition_count++;
+        }
+    }
+
+    // states are stored in the order of their ids
+
+    machine->states_by_id = Allocate(&machine->allocator, sizeof(NBSM_State *) * machine->state_count);
+    machine->state_array = Allocate(&machine->allocator, sizeof(NBSM_State) * machine->state_count);
+    machine->transitions = Allocate(&machine->allocator, sizeof(NBSM_CompiledTransition) * transition_count);
+    machine->conditions = Allocate(&machine->allocator, sizeof(NBSM_CompiledCondition) * condition_count);
+
+    unsigned int transition_idx = 0;
+    unsigned int condition_idx = 0;
+
+    for (unsigned int i = 0; i < machine->state_count; i++)
+    {
+        NBSM_State *old_s = old_states[i];
+        NBSM_State *s = &machine->state_array[i];
+
+        *s = *old_s;
+        s->transitions = NULL;
+        old_s->dependencies = NULL; // now owned by the compiled state
+        s->first_transition = transition_idx;
+        s->transition_count = 0;
+
+        for (NBSM_Transition *t = old_s->transitions; t; t = t->next)
+        {
+            NBSM_CompiledTransition *ct = &machine->transitions[transition_idx++];
+
+            ct->target_state = t->target_state->id;
+            ct->first_condition = condition_idx;
+            ct->condition_count = 0;
+
+            for (NBSM_Condition *c = t->conditions; c; c = c->next)
+            {
+                NBSM_CompiledCondition *cc = &machine->conditions[condition_idx++];
+
+                cc->op = c->op;
+                cc->left_op = &c->left_op->value;
+                cc->constant = c->right_op.data.constant.value;
+                cc->right_op = c->right_op.type == NBSM_OPERAND_CONST ? &cc->constant : &c->right_op.data.var->value;
+                ct->condition_count++;
+            }
+
+            s->transition_count++;
+        }
+
+        if (machine->current == old_s)
+            machine->current = s;
+
+        if (machine->initial_state == old_s)
+            machine->initial_state = s;
+
+        machine->states_by_id[i] = s;
+    }
+
+    // point the states table to the state array and release the linked representation
+
+    for (unsigned int i = 0; i < machine->states->capacity; i++)
+    {
+        NBSM_HTableEntry *entry = &machine->states->entries[i];
+
+        if (entry->key)
+            entry->item = &machine->state_array[((NBSM_State *)entry->item)->id];
+    }
+
+    for (unsigned int i = 0; i < machine->state_count; i++)
+        DestroyMachineState(&machine->allocator, old_states[i]);
+
+    Deallocate(&machine->allocator, old_states);
+
+    machine->is_compiled = true;
+}
+
+void NBSM_ChangeState(NBSM_Machine *machine, const char *name)
+{
+    NBSM_ChangeStateById(machine, NBSM_GetStateId(machine, name));
+}
+
+void NBSM_ChangeStateById(NBSM_Machine *machine, NBSM_StateId id)
+{
+    NBSM_Assert(id < machine->state_count);
+
+    ChangeState(machine, machine->states_by_id[id]);
+}
+
+NBSM_StateId NBSM_GetStateId(NBSM_Machine *machine, const char *name)
+{
+    NBSM_State *s = GetInHTable(machine->states, name);
+
+    NBSM_Assert(s);
+
+    return s->id;
+}
+
+NBSM_StateId NBSM_GetCurrentStateId(NBSM_Machine *machine)
+{
+    NBSM_Assert(machine->current);
+
+    return machine->current->id;
+}
+
+void NBSM_AddState(NBSM_Machine *machine, const char *name, bool is_initial)
+{
+    NBSM_Assert(!machine->is_compiled);
+    NBSM_Assert(!DoesEntryExist(machine->states, name));
+
+    NBSM_State *s = Allocate(&machine->allocator, sizeof(NBSM_State));
+
+    InitMachineState(s, machine->state_count++, name);
+
+    AddToHTable(machine->states, name, s);
+
+    if (machine->state_count > machine->state_capacity)
+    {
+        machine->state_capacity *= 2;
+        machine->states_by_id =
+            Reallocate(&machine->allocator, machine->states_by_id, sizeof(NBSM_State *) * machine->state_capacity);
+    }
+
+    machine->states_by_id[s->id] = s;
+
+    if (is_initial)
+    {
+        NBSM_Assert(!machine->current);
+
+        machine->current = s;
+        machine->initial_state = s;
+    }
+}
+
+void NBSM_AttachDataToState(NBSM_Machine *machine, const char *name, void *user_data)
+{
+    NBSM_AttachDataToStateById(machine, NBSM_GetStateId(machine, name), user_data);
+}
+
+void NBSM_AttachDataToStateById(NBSM_Machine *machine, NBSM_StateId id, void *user_data)
+{
+    NBSM_Assert(id < machine->state_count);
+
+    machine->states_by_id[id]->user_data = user_data;
+}
+
+void NBSM_OnStateEnter(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func)
+{
+    NBSM_OnStateEnterById(machine, NBSM_GetStateId(machine, name), hook_func);
+}
+
+void NBSM_OnStateEnterById(NBSM_Machine *machine, NBSM_StateId id, NBSM_StateHookFunc hook_func)
+{
+    NBSM_Assert(id < machine->state_count);
+
+    machine->states_by_id[id]->on_enter = hook_func;
+}
+
+void NBSM_OnStateExit(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func)
+{
+    NBSM_OnStateExitById(machine, NBSM_GetStateId(machine, name), hook_func);
+}
+
+void NBSM_OnStateExitById(NBSM_Machine *machine, NBSM_StateId id, NBSM_StateHookFunc hook_func)
+{
+    NBSM_Assert(id < machine->state_count);
+
+    machine->states_by_id[id]->on_exit = hook_func;
+}
+
+void NBSM_OnStateUpdate(NBSM_Machine *machine, const char *name, NBSM_StateHookFunc hook_func)
+{
+    NBSM_OnStateUpdateById(machine, NBSM_GetStateId(machine, name), hook_func);
+}
+
+void NBSM_OnStateUpdateById(NBSM_Machine *machine, NBSM_StateId id, NBSM_StateHookFunc hook_func)
+{
+    NBSM_Assert(id < machine->state_count);
+
+    machine->states_by_id[id]->on_update = hook_func;
+}
+
+NBSM_Transition *NBSM_AddTransition(NBSM_Machine *machine, const char *from, const char *to)
+{
+    NBSM_Assert(!machine->is_compiled);
+
+    NBSM_State *from_s = GetInHTable(machine->states, from);
+
+    NBSM_Assert(from_s);
+
+    NBSM_State *to_s = GetInHTable(machine->states, to);
+
+    NBSM_Assert(to_s);
+
+    NBSM_Transition *new_t = Allocate(&machine->allocator, sizeof(NBSM_Transition));
+
+    new_t->source_state = from_s;
+    new_t->target_state = to_s;
+    new_t->conditions = NULL;
+    new_t->next = NULL;
+
+    from_s->unconditional_transition_count++;
+    machine->force_evaluation = true;
+
+    if (!from_s->transitions)
+    {
+        from_s->transitions = new_t;
+    }
+    else
+    {
+        NBSM_Transition *t = from_s->transitions;
+
+        while (t->next)
+            t = t->next;
+
+        t->next = new_t;
+    }
+
+    return new_t;
+}
+
+void NBSM_AddCondition(
+    NBSM_Machine *machine, NBSM_Transition *transition, const char *var_name, NBSM_ConditionType type, NBSM_ConditionOperand right_op)
+{
+    NBSM_Assert(!machine->is_compiled);
+
+    NBSM_Condition *new_c = Allocate(&machine->allocator, sizeof(NBSM_Condition));
+    NBSM_Value *var = NBSM_GetVariable(machine, var_name);
+
+    NBSM_Assert(var);
+    NBSM_Assert(var->type == (right_op.type == NBSM_OPERAND_CONST ? right_op.data.constant.type : right_op.data.var->type));
+
+    new_c->left_op = var;
+    new_c->right_op = right_op;
+    new_c->op = GetConditionOpcode(type, var->type, right_op.type);
+    new_c->next = NULL;
+
+    AddDependency(&machine->allocator, transition->source_state, var);
+
+    if (right_op.type == NBSM_OPERAND_VAR)
+        AddDependency(&machine->allocator, transition->source_state, right_op.data.var);
+
+    machine->force_evaluation = true;
+
+    if (!transition->conditions)
+    {
+        transition->conditions = new_c;
+        transition->source_state->unconditional_transition_count--;
+    }
+    else
+    {
+        NBSM_Condition *c = transition->conditions;
+
+        while (c->next)
+            c = c->next;
+
+        c->next = new_c;
+    }
+}
+
+NBSM_Value *NBSM_AddVariable(NBSM_Machine *machine, const char *name, NBSM_ValueType type)
+{
+    NBSM_Assert(!machine->block);
+    NBSM_Assert(!DoesEntryExist(machine->variables, name));
+
+    NBSM_Value *v = Allocate(&machine->allocator, sizeof(NBSM_Value));
+
+    v->type = type;
+    v->dirty = false;
+    v->id = machine->variable_count;
+
+    memset(&v->value, 0, sizeof(v->value));
+
+    AddToHTable(machine->variables, name, v);
+
+    if (machine->variable_count == machine->variable_capacity)
+    {
+        machine->variable_capacity *= 2;
+        machine->variables_by_id =
+            Reallocate(&machine->allocator, machine->variables_by_id, sizeof(NBSM_Value *) * machine->variable_capacity);
+    }
+
+    machine->variables_by_id[machine->variable_count++] = v;
+
+    return v;
+}
+
+NBSM_Value *NBSM_AddInteger(NBSM_Machine *machine, const char *name)
+{
+    return NBSM_AddVariable(machine, name, NBSM_INTEGER);
+}
+
+NBSM_Value *NBSM_AddFloat(NBSM_Machine *machine, const char *name)
+{
+    return NBSM_AddVariable(machine, name, NBSM_FLOAT);
+}
+
+NBSM_Value *NBSM_AddBoolean(NBSM_Machine *machine, const char *name)
+{
+    return NBSM_AddVariable(machine, name, NBSM_BOOLEAN);
+}
+
+void NBSM_SetInteger(NBSM_Value *var, int value)
+{
+    NBSM_Assert(var->type == NBSM_INTEGER);
+
+    var->dirty |= var->value.i != value;
+    var->value.i = value;
+}
+
+void NBSM_SetFloat(NBSM_Value *var, float value)
+{
+    NBSM_Assert(var->type == NBSM_FLOAT);
+
+    var->dirty |= var->value.f != value;
+    var->value.f = value;
+}
+
+void NBSM_SetBoolean(NBSM_Value *var, bool value)
+{
+    NBSM_Assert(var->type == NBSM_BOOLEAN);
+
+    var->dirty |= var->value.b != value;
+    var->value.b = value;
+}
+
+int NBSM_GetInteger(NBSM_Value *var)
+{
+    NBSM_Assert(var->type == NBSM_INTEGER);
+
+    return var->value.i;
+}
+
+float NBSM_GetFloat(NBSM_Value *var)
+{
+    NBSM_Assert(var->type == NBSM_FLOAT);
+
+    return var->value.f;
+}
+
+bool NBSM_GetBoolean(NBSM_Value *var)
+{
+    NBSM_Assert(var->type == NBSM_BOOLEAN);
+
+    return var->value.b;
+}
+
+NBSM_Value *NBSM_GetVariable(NBSM_Machine *machine, const char *name)
+{
+    return GetInHTable(machine->variables, name);
+}
+
+NBSM_VarId NBSM_GetVariableId(NBSM_Machine *machine, const char *name)
+{
+    NBSM_Value *v = GetInHTable(machine->variables, name);
+
+    NBSM_Assert(v);
+
+    return v->id;
+}
+
+NBSM_Value *NBSM_GetVariableById(NBSM_Machine *machine, NBSM_VarId id)
+{
+    NBSM_Assert(id < machine->variable_count);
+
+    return machine->variables_by_id[id];
+}
+
+#ifdef NBSM_JSON_BUILDER
+
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSON(const char *json)
+{
+    return NBSM_CreateBuilderFromJSONWithAllocator(json, &default_allocator);
+}
+
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONWithAllocator(const char *json, const NBSM_Allocator *allocator)
+{
+    NBSM_MachineBuilder *builder = CreateEmptyBuilder(allocator);
+
+    struct json_value_s *root =
+        json_parse_ex(json, strlen(json), json_parse_flags_default, allocator->alloc, allocator->user_data, NULL);
+
+    NBSM_Assert(root->type == json_type_object);
+
+    struct json_object_s *object = (struct json_object_s*)root->payload;
+    struct json_object_element_s *node = object->start;
+
+    while (node)
+    {
+        if (strcmp(node->name->string, "variables") == 0)
+        {
+            NBSM_Assert(node->value->type == json_type_array);
+
+            LoadVariablesFromJSON(builder, node->value->payload);
+        }
+        else if (strcmp(node->name->string, "states") == 0)
+        {
+            NBSM_Assert(node->value->type == json_type_array);
+
+            LoadStatesFromJSON(builder, node->value->payload);
+        }
+        else if (strcmp(node->name->string, "transitions") == 0)
+        {
+            NBSM_Assert(node->value->type == json_type_array);
+
+            LoadTransitionsFromJSON(builder, node->value->payload);
+        }
+
+        node = node->next;
+    }
+
+    Deallocate(allocator, root);
+
+    return builder;
+}
+
+#endif // NBSM_JSON_BUILDER
+
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONStream(NBSM_ReadFunc read, void *user_data)
+{
+    return NBSM_CreateBuilderFromJSONStreamWithAllocator(read, user_data, &default_allocator);
+}
+
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONStreamWithAllocator(
+    NBSM_ReadFunc read, void *user_data, const NBSM_Allocator *allocator)
+{
+    NBSM_MachineBuilder *builder = CreateEmptyBuilder(allocator);
+    JSONStream stream;
+
+    stream.read = read;
+    stream.user_data = user_data;
+    stream.length = 0;
+    stream.position = 0;
+    stream.is_eof = false;
+    stream.has_error = false;
+    stream.depth = 0;
+    stream.token_capacity = 64;
+    stream.token_length = 0;
+    stream.token = Allocate(allocator, stream.token_capacity);
+    stream.allocator = allocator;
+
+    ExpectJSONChar(&stream, '{');
+
+    bool is_first = true;
+    char *key;
+
+    while ((key = NextJSONKey(&stream, &is_first)))
+    {
+        if (strcmp(key, "variables") == 0)
+            StreamVariablesFromJSON(builder, &stream);
+        else if (strcmp(key, "states") == 0)
+            StreamStatesFromJSON(builder, &stream);
+        else if (strcmp(key, "transitions") == 0)
+            StreamTransitionsFromJSON(builder, &stream);
+        else
+            SkipJSONValue(&stream);
+    }
+
+    CheckJSONStream(&stream, SkipJSONWhitespace(&stream) == EOF);
+
+    Deallocate(allocator, stream.token);
+
+    if (stream.has_error)
+    {
+        NBSM_DestroyBuilder(builder);
+
+        return NULL;
+    }
+
+    return builder;
+}
+
+#ifdef NBSM_POSIX
+
+NBSM_MachineBuilder *NBSM_CreateBuilderFromJSONFd(int fd)
+{
+    return NBSM_CreateBuilderFromJSONStream(ReadJSONFromFd, &fd);
+}
+
+#endif // NBSM_POSIX
+
+void NBSM_DestroyBuilder(NBSM_MachineBuilder *builder)
+{
+    NBSM_Allocator allocator = builder->allocator;
+
+    if (builder->mapping)
+        ReleaseBinaryFile(builder->mapping, builder->mapping_size);
+
+    // the blueprints are stored right after the builder
+    if (builder->is_packed)
+    {
+        Deallocate(&allocator, builder);
+
+        return;
+    }
+
+    if (builder->states)
+    {
+        if (builder->free_strings)
+        {
+            for (unsigned int i = 0; i < builder->state_count; i++)
+                Deallocate(&allocator, builder->states[i].name);
+        }
+
+        Deallocate(&allocator, builder->states);
+    }
+
+    if (builder->variables)
+    {
+        if (builder->free_strings)
+        {
+            for (unsigned int i = 0; i < builder->variable_count; i++)
+                Deallocate(&allocator, builder->variables[i].name);
+        }
+
+        Deallocate(&allocator, builder->variables);
+    }
+    
+    if (builder->transitions)
+    {
+        for (unsigned int i = 0; i < builder->transition_count; i++)
+        {
+            NBSM_TransitionBlueprint *transi = &builder->transitions[i];
+            NBSM_ConditionBlueprint *conditions = transi->conditions;
+
+            if (builder->free_strings)
+            {
+                Deallocate(&allocator, transi->from);
+                Deallocate(&allocator, transi->to);
+            }
+
+            if (conditions)
+            {
+                if (builder->free_strings)
+                {
+                    for (unsigned int j = 0; j < transi->condition_count; j++)
+                    {
+                        Deallocate(&allocator, transi->conditions[j].var_name);
+
+                        if (transi->conditions[j].right_op.type == NBSM_OPERAND_VAR)
+                            Deallocate(&allocator, transi->conditions[j].right_op.data.var_name);
+                    }
+                }
+
+                Deallocate(&allocator, conditions);
+            }
+        }
+
+        Deallocate(&allocator, builder->transitions);
+    }
+
+    if (builder->string_pool)
+        DestroyStringPool(builder->string_pool);
+
+    Deallocate(&allocator, builder);
+}
+
+#ifdef NBSM_POSIX
+
+NBSM_BuilderRegistry *NBSM_LoadBuildersFromDirectory(const char *path)
+{
+    NBSM_BuilderRegistry *registry = ListBuilderFiles(path);
+
+    if (!registry)
+        return NULL;
+
+    for (unsigned int i = 0; i < registry->count; i++)
+        LoadBuilderFile(registry, path, i);
+
+    IndexBuilderRegistry(registry);
+
+    return registry;
+}
+
+#endif // NBSM_POSIX
+
+NBSM_MachineBuilder *NBSM_GetBuilder(NBSM_BuilderRegistry *registry, const char *name)
+{
+    return GetInHTable(registry->builders_by_name, name);
+}
+
+void NBSM_DestroyBuilderRegistry(NBSM_BuilderRegistry *registry)
+{
+    for (unsigned int i = 0; i < registry->count; i++)
+    {
+        NBSM_DestroyBuilder(registry->builders[i]);
+        NBSM_Dealloc(registry->names[i]);
+    }
+
+    DestroyHTable(registry->builders_by_name, false, NULL, false);
+    NBSM_Dealloc(registry->names);
+    NBSM_Dealloc(registry->builders);
+    NBSM_Dealloc(registry);
+}
+
+bool NBSM_WriteBinary(NBSM_MachineBuilder *builder, FILE *out)
+{
+    // every name is stored once in the string table
+
+    size_t max_string_size = 0;
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+        max_string_size += strlen(builder->states[i].name) + 1;
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+        max_string_size += strlen(builder->variables[i].name) + 1;
+
+    char *string_table = NBSM_Alloc(max_string_size > 0 ? max_string_size : 1);
+    NBSM_HTable *strings = CreateHTableForCount(&default_allocator, builder->state_count + builder->variable_count);
+    BinaryHeader header = {
+        NBSM_BINARY_MAGIC,
+        NBSM_BINARY_VERSION,
+        builder->state_count,
+        builder->variable_count,
+        builder->transition_count,
+        0,
+        0
+    };
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+        AddBinaryString(strings, string_table, &header.string_table_size, builder->states[i].name);
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+        AddBinaryString(strings, string_table, &header.string_table_size, builder->variables[i].name);
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+        header.condition_count += builder->transitions[i].condition_count;
+
+    bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+    {
+        NBSM_StateBlueprint *sb = &builder->states[i];
+        BinaryState state = { GetBinaryString(strings, sb->name), sb->is_initial };
+
+        success = success && fwrite(&state, sizeof(state), 1, out) == 1;
+    }
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+    {
+        NBSM_VariableBlueprint *vb = &builder->variables[i];
+        BinaryVariable var = { GetBinaryString(strings, vb->name), vb->type, VariantToBinary(vb->type, vb->default_value) };
+
+        success = success && fwrite(&var, sizeof(var), 1, out) == 1;
+    }
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+    {
+        NBSM_TransitionBlueprint *tb = &builder->transitions[i];
+        BinaryTransition transition = {
+            GetBinaryString(strings, tb->from), GetBinaryString(strings, tb->to), tb->condition_count };
+
+        success = success && fwrite(&transition, sizeof(transition), 1, out) == 1;
+    }
+
+    // conditions are stored in the order of their transitions
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+    {
+        for (unsigned int j = 0; j < builder->transitions[i].condition_count; j++)
+        {
+            NBSM_ConditionBlueprint *cb = &builder->transitions[i].conditions[j];
+            BinaryCondition condition = { cb->type, GetBinaryString(strings, cb->var_name), cb->right_op.type, 0, 0 };
+
+            if (cb->right_op.type == NBSM_OPERAND_CONST)
+            {
+                condition.value_type = cb->right_op.data.constant.type;
+                condition.operand = VariantToBinary(cb->right_op.data.constant.type, cb->right_op.data.constant.value);
+            }
+            else
+            {
+                condition.operand = GetBinaryString(strings, cb->right_op.data.var_name);
+            }
+
+            success = success && fwrite(&condition, sizeof(condition), 1, out) == 1;
+        }
+    }
+
+    success = success && fwrite(string_table, 1, header.string_table_size, out) == header.string_table_size;
+
+    DestroyHTable(strings, false, NULL, false);
+    NBSM_Dealloc(string_table);
+
+    return success;
+}
+
+NBSM_MachineBuilder *NBSM_CreateBuilderFromBinary(const void *data, size_t size)
+{
+    const BinaryHeader *header = data;
+
+    NBSM_Assert((uintptr_t)data % sizeof(uint32_t) == 0);
+
+    if (size < sizeof(BinaryHeader) || header->magic != NBSM_BINARY_MAGIC || header->version != NBSM_BINARY_VERSION)
+        return NULL;
+
+    const BinaryState *states = (const BinaryState *)(header + 1);
+    const BinaryVariable *variables = (const BinaryVariable *)(states + header->state_count);
+    const BinaryTransition *transitions = (const BinaryTransition *)(variables + header->variable_count);
+    const BinaryCondition *conditions = (const BinaryCondition *)(transitions + header->transition_count);
+    const char *string_table = (const char *)(conditions + header->condition_count);
+
+    // 64 bits so corrupted counts cannot overflow
+    uint64_t expected_size = sizeof(BinaryHeader) +
+        (uint64_t)header->state_count * sizeof(BinaryState) +
+        (uint64_t)header->variable_count * sizeof(BinaryVariable) +
+        (uint64_t)header->transition_count * sizeof(BinaryTransition) +
+        (uint64_t)header->condition_count * sizeof(BinaryCondition) +
+        header->string_table_size;
+
+    // the last string must be terminated for all of them to be
+    if (expected_size != size || (header->string_table_size > 0 && string_table[header->string_table_size - 1] != 0))
+        return NULL;
+
+    // the blueprints are stored right after the builder
+
+    size_t offset = 0;
+    size_t states_offset, variables_offset, transitions_offset, conditions_offset;
+
+    ReserveInBlock(&offset, sizeof(NBSM_MachineBuilder));
+
+    states_offset = ReserveInBlock(&offset, sizeof(NBSM_StateBlueprint) * header->state_count);
+    variables_offset = ReserveInBlock(&offset, sizeof(NBSM_VariableBlueprint) * header->variable_count);
+    transitions_offset = ReserveInBlock(&offset, sizeof(NBSM_TransitionBlueprint) * header->transition_count);
+    conditions_offset = ReserveInBlock(&offset, sizeof(NBSM_ConditionBlueprint) * header->condition_count);
+
+    char *block = NBSM_Alloc(offset);
+    NBSM_MachineBuilder *builder = (NBSM_MachineBuilder *)block;
+    bool is_valid = true;
+
+    builder->states = (NBSM_StateBlueprint *)(block + states_offset);
+    builder->state_count = header->state_count;
+    builder->variables = (NBSM_VariableBlueprint *)(block + variables_offset);
+    builder->variable_count = header->variable_count;
+    builder->transitions = (NBSM_TransitionBlueprint *)(block + transitions_offset);
+    builder->transition_count = header->transition_count;
+    builder->free_strings = false;
+    builder->allocator = default_allocator;
+    builder->string_pool = NULL;
+    builder->is_packed = true;
+    builder->mapping = NULL;
+    builder->mapping_size = 0;
+
+    for (unsigned int i = 0; i < header->state_count; i++)
+    {
+        NBSM_StateBlueprint *sb = &builder->states[i];
+
+        sb->name = GetBinaryStringAt(header, string_table, states[i].name, &is_valid);
+        sb->is_initial = states[i].is_initial;
+    }
+
+    for (unsigned int i = 0; i < header->variable_count; i++)
+    {
+        NBSM_VariableBlueprint *vb = &builder->variables[i];
+
+        vb->name = GetBinaryStringAt(header, string_table, variables[i].name, &is_valid);
+        vb->type = variables[i].type;
+        vb->default_value = BinaryToVariant(variables[i].type, variables[i].default_value);
+        is_valid = is_valid && variables[i].type <= NBSM_BOOLEAN;
+    }
+
+    NBSM_ConditionBlueprint *cb = (NBSM_ConditionBlueprint *)(block + conditions_offset);
+    const BinaryCondition *condition = conditions;
+    uint64_t condition_count = 0;
+
+    for (unsigned int i = 0; i < header->transition_count; i++)
+    {
+        NBSM_TransitionBlueprint *tb = &builder->transitions[i];
+
+        condition_count += transitions[i].condition_count;
+
+        if (condition_count > header->condition_count)
+        {
+            is_valid = false;
+            break;
+        }
+
+        tb->from = GetBinaryStringAt(header, string_table, transitions[i].from, &is_valid);
+        tb->to = GetBinaryStringAt(header, string_table, transitions[i].to, &is_valid);
+        tb->conditions = cb;
+        tb->condition_count = transitions[i].condition_count;
+
+        for (unsigned int j = 0; j < tb->condition_count; j++, cb++, condition++)
+        {
+            cb->transition_idx = i;
+            cb->type = condition->type;
+            cb->var_name = GetBinaryStringAt(header, string_table, condition->var_name, &is_valid);
+            cb->right_op.type = condition->operand_type;
+            is_valid = is_valid && condition->type <= NBSM_GTE && condition->operand_type <= NBSM_OPERAND_VAR;
+
+            if (condition->operand_type == NBSM_OPERAND_CONST)
+            {
+                cb->right_op.data.constant.type = condition->value_type;
+                cb->right_op.data.constant.value = BinaryToVariant(condition->value_type, condition->operand);
+                cb->right_op.data.constant.dirty = false;
+                is_valid = is_valid && condition->value_type <= NBSM_BOOLEAN;
+            }
+            else
+            {
+                cb->right_op.data.var_name = GetBinaryStringAt(header, string_table, condition->operand, &is_valid);
+            }
+        }
+    }
+
+    if (!is_valid || condition_count != header->condition_count)
+    {
+        NBSM_Dealloc(block);
+
+        return NULL;
+    }
+
+    return builder;
+}
+
+NBSM_MachineBuilder *NBSM_LoadBinaryFile(const char *path)
+{
+#ifdef NBSM_POSIX
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // the mapping stays valid once the file is closed
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return NULL;
+
+#else
+
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+
+    long file_size = ftell(f);
+    size_t size = file_size > 0 ? (size_t)file_size : 0;
+    void *data = NBSM_Alloc(size > 0 ? size : 1);
+
+    fseek(f, 0, SEEK_SET);
+
+    bool is_read = fread(data, 1, size, f) == size;
+
+    fclose(f);
+
+    if (!is_read)
+    {
+        NBSM_Dealloc(data);
+
+        return NULL;
+    }
+
+#endif // NBSM_POSIX
+
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromBinary(data, size);
+
+    if (!builder)
+    {
+        ReleaseBinaryFile(data, size);
+
+        return NULL;
+    }
+
+    builder->mapping = data;
+    builder->mapping_size = size;
+
+    return builder;
+}
+
+bool NBSM_GenerateC(NBSM_MachineBuilder *builder, const char *name, FILE *out)
+{
+    if (builder->state_count == 0 || !CheckGeneratedIdentifiers(builder))
+        return false;
+
+    unsigned int initial_state = 0;
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+    {
+        if (builder->states[i].is_initial)
+            initial_state = i;
+    }
+
+    fprintf(out, "// Generated by nbsm from the \"%s\" state machine, do not edit\n\n", name);
+    fprintf(out, "#include <stdbool.h>\n#include <math.h>\n#include <float.h>\n\n");
+
+    // states
+
+    fprintf(out, "typedef enum\n{\n");
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+    {
+        fprintf(out, "    ");
+        WriteGeneratedState(out, name, builder->states[i].name);
+        fprintf(out, ",\n");
+    }
+
+    fprintf(out, "    %s_STATE_COUNT\n} %s_State;\n\n", name, name);
+
+    // variables
+
+    fprintf(out, "typedef struct\n{\n    %s_State state;\n", name);
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+    {
+        static const char *types[] = { "int", "float", "bool" };
+
+        fprintf(out, "    %s ", types[builder->variables[i].type]);
+        WriteIdentifier(out, builder->variables[i].name);
+        fprintf(out, ";\n");
+    }
+
+    fprintf(out, "} %s;\n\n", name);
+
+    // init
+
+    fprintf(out, "static inline void %s_Init(%s *m)\n{\n    m->state = ", name, name);
+    WriteGeneratedState(out, name, builder->states[initial_state].name);
+    fprintf(out, ";\n");
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+    {
+        NBSM_VariableBlueprint *vb = &builder->variables[i];
+
+        fprintf(out, "    m->");
+        WriteIdentifier(out, vb->name);
+        fprintf(out, " = ");
+        WriteGeneratedValue(out, (NBSM_Value){ vb->type, vb->default_value, false, 0 });
+        fprintf(out, ";\n");
+    }
+
+    fprintf(out, "}\n\n");
+
+    // state names
+
+    fprintf(out, "static inline const char *%s_GetStateName(%s_State state)\n{\n", name, name);
+    fprintf(out, "    static const char *names[] = {\n");
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+    {
+        fprintf(out, "        \"");
+
+        for (const char *c = builder->states[i].name; *c; c++)
+        {
+            if (*c == '"' || *c == '\\')
+                fputc('\\', out);
+
+            fputc(*c, out);
+        }
+
+        fprintf(out, "\",\n");
+    }
+
+    fprintf(out, "    };\n\n    return names[state];\n}\n\n");
+
+    // update, the transitions of each state are checked in the order they have in the builder
+
+    fprintf(out, "// Execute the first transition of the current state whose conditions are all true\n");
+    fprintf(out, "// Return true if a transition has been executed\n");
+    fprintf(out, "static inline bool %s_Update(%s *m)\n{\n    switch (m->state)\n    {\n", name, name);
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+    {
+        NBSM_StateBlueprint *sb = &builder->states[i];
+
+        fprintf(out, "    case ");
+        WriteGeneratedState(out, name, sb->name);
+        fprintf(out, ":\n");
+
+        for (unsigned int j = 0; j < builder->transition_count; j++)
+        {
+            NBSM_TransitionBlueprint *tb = &builder->transitions[j];
+
+            if (strcmp(tb->from, sb->name) != 0)
+                continue;
+
+            if (tb->condition_count == 0)
+            {
+                // the following transitions of the state can never be executed
+                fprintf(out, "        m->state = ");
+                WriteGeneratedState(out, name, tb->to);
+                fprintf(out, ";\n        return true;\n\n");
+
+                break;
+            }
+
+            fprintf(out, "        if (");
+
+            for (unsigned int k = 0; k < tb->condition_count; k++)
+            {
+                if (k > 0)
+                    fprintf(out, " && ");
+
+                WriteGeneratedCondition(out, builder, &tb->conditions[k]);
+            }
+
+            fprintf(out, ")\n        {\n            m->state = ");
+            WriteGeneratedState(out, name, tb->to);
+            fprintf(out, ";\n            return true;\n        }\n\n");
+        }
+
+        fprintf(out, "        return false;\n\n");
+    }
+
+    fprintf(out, "    default:\n        return false;\n    }\n}\n");
+
+    return true;
+}
+
+NBSM_Definition *NBSM_CreateDefinition(NBSM_MachineBuilder *builder)
+{
+    NBSM_Definition *definition = NBSM_Alloc(sizeof(NBSM_Definition));
+    unsigned int condition_count = 0;
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+        condition_count += builder->transitions[i].condition_count;
+
+    definition->state_count = builder->state_count;
+    definition->states = NBSM_Alloc(sizeof(NBSM_DefinitionState) * builder->state_count);
+    definition->variable_count = builder->variable_count;
+    definition->variables = NBSM_Alloc(sizeof(NBSM_DefinitionVariable) * builder->variable_count);
+    definition->default_values = NBSM_Alloc(sizeof(NBSM_Variant) * builder->variable_count);
+    definition->transition_count = builder->transition_count;
+    definition->transitions = NBSM_Alloc(sizeof(NBSM_DefinitionTransition) * builder->transition_count);
+    definition->condition_count = condition_count;
+    definition->conditions = NBSM_Alloc(sizeof(NBSM_DefinitionCondition) * condition_count);
+    definition->state_lookup = CreateHTableForCount(&default_allocator, builder->state_count);
+    definition->variable_lookup = CreateHTableForCount(&default_allocator, builder->variable_count);
+
+    size_t names_size = 0;
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+        names_size += strlen(builder->states[i].name) + 1;
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+        names_size += strlen(builder->variables[i].name) + 1;
+
+    definition->names = NBSM_Alloc(names_size > 0 ? names_size : 1);
+
+    char *str = definition->names;
+    bool has_initial_state = false;
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+    {
+        NBSM_StateBlueprint *sb = &builder->states[i];
+        NBSM_DefinitionState *s = &definition->states[i];
+
+        NBSM_Assert(!DoesEntryExist(definition->state_lookup, sb->name));
+
+        s->name = strcpy(str, sb->name);
+        str += strlen(str) + 1;
+        s->first_transition = 0;
+        s->transition_count = 0;
+        s->on_enter = NULL;
+        s->on_exit = NULL;
+        s->on_update = NULL;
+        s->user_data = NULL;
+        s->first_dependency = 0;
+        s->dependency_count = 0;
+        s->can_sleep = true;
+
+        AddToHTable(definition->state_lookup, s->name, s);
+
+        if (sb->is_initial)
+        {
+            NBSM_Assert(!has_initial_state);
+
+            definition->initial_state = i;
+            has_initial_state = true;
+        }
+    }
+
+    NBSM_Assert(has_initial_state);
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+    {
+        NBSM_VariableBlueprint *vb = &builder->variables[i];
+        NBSM_DefinitionVariable *v = &definition->variables[i];
+
+        NBSM_Assert(!DoesEntryExist(definition->variable_lookup, vb->name));
+
+        v->name = strcpy(str, vb->name);
+        str += strlen(str) + 1;
+        v->type = vb->type;
+        definition->default_values[i] = vb->default_value;
+
+        AddToHTable(definition->variable_lookup, v->name, v);
+    }
+
+    // transitions are grouped by source state so each state owns a contiguous range of transitions,
+    // the transitions of a given state keep the order they have in the builder
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+        GetDefinitionState(definition, builder->transitions[i].from)->transition_count++;
+
+    for (unsigned int i = 0, first = 0; i < definition->state_count; i++)
+    {
+        definition->states[i].first_transition = first;
+        first += definition->states[i].transition_count;
+        definition->states[i].transition_count = 0;
+    }
+
+    unsigned int condition_idx = 0;
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+    {
+        NBSM_TransitionBlueprint *tb = &builder->transitions[i];
+        NBSM_DefinitionState *from = GetDefinitionState(definition, tb->from);
+        NBSM_DefinitionTransition *t = &definition->transitions[from->first_transition + from->transition_count++];
+
+        t->target_state = GetDefinitionState(definition, tb->to) - definition->states;
+        t->first_condition = condition_idx;
+        t->condition_count = tb->condition_count;
+
+        for (unsigned int j = 0; j < tb->condition_count; j++)
+        {
+            NBSM_ConditionBlueprint *cb = &tb->conditions[j];
+            NBSM_DefinitionCondition *c = &definition->conditions[condition_idx++];
+
+            c->left_var = NBSM_GetVariableIndex(definition, cb->var_name);
+            c->value_type = definition->variables[c->left_var].type;
+            c->op = GetConditionOpcode(cb->type, c->value_type, cb->right_op.type);
+            c->type = cb->type;
+            c->right_type = cb->right_op.type;
+            c->right_op.var = 0;
+
+            if (cb->right_op.type == NBSM_OPERAND_CONST)
+            {
+                NBSM_Assert(cb->right_op.data.constant.type == c->value_type);
+
+                c->right_op.constant = cb->right_op.data.constant.value;
+            }
+            else if (cb->right_op.type == NBSM_OPERAND_VAR)
+            {
+                c->right_op.var = NBSM_GetVariableIndex(definition, cb->right_op.data.var_name);
+
+                NBSM_Assert(definition->variables[c->right_op.var].type == c->value_type);
+            }
+        }
+    }
+
+    // list the variables each state depends on, a condition uses at most two variables
+
+    definition->dependencies = NBSM_Alloc(sizeof(unsigned int) * (condition_count * 2 + 1));
+
+    for (unsigned int i = 0, dependency_idx = 0; i < definition->state_count; i++)
+    {
+        NBSM_DefinitionState *s = &definition->states[i];
+
+        s->first_dependency = dependency_idx;
+
+        for (unsigned int j = 0; j < s->transition_count; j++)
+        {
+            NBSM_DefinitionTransition *t = &definition->transitions[s->first_transition + j];
+
+            if (t->condition_count == 0)
+                s->can_sleep = false;
+
+            for (unsigned int k = 0; k < t->condition_count; k++)
+            {
+                NBSM_DefinitionCondition *c = &definition->conditions[t->first_condition + k];
+
+                if (!DependsOnVariable(definition, s, c->left_var))
+                    definition->dependencies[s->first_dependency + s->dependency_count++] = c->left_var;
+
+                if (c->right_type == NBSM_OPERAND_VAR && !DependsOnVariable(definition, s, c->right_op.var))
+                    definition->dependencies[s->first_dependency + s->dependency_count++] = c->right_op.var;
+            }
+        }
+
+        dependency_idx += s->dependency_count;
+    }
+
+    return definition;
+}
+
+void NBSM_DestroyDefinition(NBSM_Definition *definition)
+{
+    DestroyHTable(definition->state_lookup, false, NULL, false);
+    DestroyHTable(definition->variable_lookup, false, NULL, false);
+
+    NBSM_Dealloc(definition->names);
+    NBSM_Dealloc(definition->states);
+    NBSM_Dealloc(definition->variables);
+    NBSM_Dealloc(definition->default_values);
+    NBSM_Dealloc(definition->transitions);
+    NBSM_Dealloc(definition->conditions);
+    NBSM_Dealloc(definition->dependencies);
+    NBSM_Dealloc(definition);
+}
+
+NBSM_Instance *NBSM_CreateInstance(const NBSM_Definition *definition)
+{
+    NBSM_Instance *instance = NBSM_Alloc(sizeof(NBSM_Instance) + sizeof(NBSM_Variant) * definition->variable_count);
+
+    instance->current = definition->initial_state;
+    instance->user_data = NULL;
+    instance->scheduler = NULL;
+    instance->scheduler_slot = 0;
+    instance->sleep_state = NBSM_AWAKE;
+
+    memcpy(instance->variables, definition->default_values, sizeof(NBSM_Variant) * definition->variable_count);
+
+    return instance;
+}
+
+void NBSM_DestroyInstance(NBSM_Instance *instance)
+{
+    NBSM_Assert(!instance->scheduler);
+
+    NBSM_Dealloc(instance);
+}
+
+void NBSM_ResetInstance(const NBSM_Definition *definition, NBSM_Instance *instance)
+{
+    instance->current = definition->initial_state;
+
+    memcpy(instance->variables, definition->default_values, sizeof(NBSM_Variant) * definition->variable_count);
+
+    if (instance->scheduler)
+        WakeInstance(instance);
+}
+
+void NBSM_UpdateInstance(const NBSM_Definition *definition, NBSM_Instance *instance)
+{
+    NBSM_DefinitionState *s = &definition->states[instance->current];
+    NBSM_DefinitionTransition *t = &definition->transitions[s->first_transition];
+    NBSM_DefinitionTransition *t_end = t + s->transition_count;
+
+    for (; t < t_end; t++)
+    {
+        if (CheckInstanceTransition(definition, t, instance))
+            break;
+    }
+
+    if (t < t_end)
+        ChangeInstanceState(definition, instance, t->target_state);
+
+    s = &definition->states[instance->current];
+
+    if (s->on_update)
+        s->on_update(instance, s->user_data);
+}
+
+void NBSM_UpdateBatch(const NBSM_Definition *definition, NBSM_Instance **instances, unsigned int count)
+{
+    if (count == 0)
+        return;
+
+    void *scratch = NBSM_Alloc(GetBatchScratchSize(definition, count));
+
+    UpdateBatch(definition, instances, count, scratch, NULL);
+
+    NBSM_Dealloc(scratch);
+}
+
+void NBSM_ChangeInstanceState(const NBSM_Definition *definition, NBSM_Instance *instance, const char *name)
+{
+    ChangeInstanceState(definition, instance, NBSM_GetDefinitionStateId(definition, name));
+}
+
+void NBSM_ChangeInstanceStateById(const NBSM_Definition *definition, NBSM_Instance *instance, NBSM_StateId id)
+{
+    NBSM_Assert(id < definition->state_count);
+
+    ChangeInstanceState(definition, instance, id);
+}
+
+NBSM_StateId NBSM_GetDefinitionStateId(const NBSM_Definition *definition, const char *name)
+{
+    NBSM_DefinitionState *s = GetInHTable(definition->state_lookup, name);
+
+    NBSM_Assert(s);
+
+    return s - definition->states;
+}
+
+const char *NBSM_GetInstanceState(const NBSM_Definition *definition, NBSM_Instance *instance)
+{
+    return definition->states[instance->current].name;
+}
+
+void NBSM_AttachDataToDefinitionState(NBSM_Definition *definition, const char *name, void *user_data)
+{
+    GetDefinitionState(definition, name)->user_data = user_data;
+}
+
+void NBSM_OnDefinitionStateEnter(NBSM_Definition *definition, const char *name, NBSM_InstanceHookFunc hook_func)
+{
+    GetDefinitionState(definition, name)->on_enter = hook_func;
+}
+
+void NBSM_OnDefinitionStateExit(NBSM_Definition *definition, const char *name, NBSM_InstanceHookFunc hook_func)
+{
+    GetDefinitionState(definition, name)->on_exit = hook_func;
+}
+
+void NBSM_OnDefinitionStateUpdate(NBSM_Definition *definition, const char *name, NBSM_InstanceHookFunc hook_func)
+{
+    GetDefinitionState(definition, name)->on_update = hook_func;
+}
+
+unsigned int NBSM_GetVariableIndex(const NBSM_Definition *definition, const char *name)
+{
+    NBSM_DefinitionVariable *v = GetInHTable(definition->variable_lookup, name);
+
+    NBSM_Assert(v);
+
+    return v - definition->variables;
+}
+
+void NBSM_SetInstanceInteger(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var, int value)
+{
+    NBSM_Assert(definition->variables[var].type == NBSM_INTEGER);
+
+    if (instance->scheduler && instance->variables[var].i != value)
+        WakeOnVariableChange(definition, instance, var);
+
+    instance->variables[var].i = value;
+}
+
+void NBSM_SetInstanceFloat(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var, float value)
+{
+    NBSM_Assert(definition->variables[var].type == NBSM_FLOAT);
+
+    if (instance->scheduler && instance->variables[var].f != value)
+        WakeOnVariableChange(definition, instance, var);
+
+    instance->variables[var].f = value;
+}
+
+void NBSM_SetInstanceBoolean(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var, bool value)
+{
+    NBSM_Assert(definition->variables[var].type == NBSM_BOOLEAN);
+
+    if (instance->scheduler && instance->variables[var].b != value)
+        WakeOnVariableChange(definition, instance, var);
+
+    instance->variables[var].b = value;
+}
+
+int NBSM_GetInstanceInteger(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var)
+{
+    NBSM_Assert(definition->variables[var].type == NBSM_INTEGER);
+
+    return instance->variables[var].i;
+}
+
+float NBSM_GetInstanceFloat(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var)
+{
+    NBSM_Assert(definition->variables[var].type == NBSM_FLOAT);
+
+    return instance->variables[var].f;
+}
+
+bool NBSM_GetInstanceBoolean(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var)
+{
+    NBSM_Assert(definition->variables[var].type == NBSM_BOOLEAN);
+
+    return instance->variables[var].b;
+}
+
+NBSM_Registry *NBSM_CreateRegistry(NBSM_DefinitionLoadFunc on_load, void *user_data)
+{
+    NBSM_Registry *registry = NBSM_Alloc(sizeof(NBSM_Registry));
+
+    registry->entries = NULL;
+    registry->count = 0;
+    registry->capacity = 0;
+    registry->ids_by_name = CreateHTableWithCapacity(&default_allocator, 32);
+    registry->names = CreateStringPool(&default_allocator);
+    registry->on_load = on_load;
+    registry->user_data = user_data;
+
+    return registry;
+}
+
+void NBSM_DestroyRegistry(NBSM_Registry *registry)
+{
+    for (unsigned int i = 0; i < registry->count; i++)
+        NBSM_Assert(registry->entries[i].ref_count == 0);
+
+    DestroyHTable(registry->ids_by_name, false, NULL, false);
+    DestroyStringPool(registry->names);
+    NBSM_Dealloc(registry->entries);
+    NBSM_Dealloc(registry);
+}
+
+NBSM_DefinitionId NBSM_RegisterDefinition(NBSM_Registry *registry, const char *name, NBSM_MachineBuilder *builder)
+{
+    NBSM_Assert(!DoesEntryExist(registry->ids_by_name, name));
+    NBSM_Assert(registry->count < NBSM_INVALID_DEFINITION_ID);
+
+    if (registry->count == registry->capacity)
+    {
+        registry->capacity = registry->capacity > 0 ? registry->capacity * 2 : 16;
+        registry->entries = NBSM_Realloc(registry->entries, sizeof(NBSM_RegistryEntry) * registry->capacity);
+    }
+
+    NBSM_DefinitionId id = registry->count++;
+    NBSM_RegistryEntry *entry = &registry->entries[id];
+
+    entry->name = InternString(registry->names, name);
+    entry->builder = builder;
+    entry->definition = NULL;
+    entry->ref_count = 0;
+    entry->free_instances = NULL;
+    entry->free_count = 0;
+    entry->free_capacity = 0;
+
+    AddToHTable(registry->ids_by_name, entry->name, (void *)(uintptr_t)(id + 1));
+
+    return id;
+}
+
+void NBSM_RegisterBuilders(NBSM_Registry *registry, NBSM_BuilderRegistry *builders)
+{
+    for (unsigned int i = 0; i < builders->count; i++)
+        NBSM_RegisterDefinition(registry, builders->names[i], builders->builders[i]);
+}
+
+NBSM_DefinitionId NBSM_GetDefinitionId(NBSM_Registry *registry, const char *name)
+{
+    uintptr_t id = (uintptr_t)GetInHTable(registry->ids_by_name, name);
+
+    return id > 0 ? (NBSM_DefinitionId)(id - 1) : NBSM_INVALID_DEFINITION_ID;
+}
+
+NBSM_Definition *NBSM_GetRegistryDefinition(NBSM_Registry *registry, NBSM_DefinitionId id)
+{
+    NBSM_Assert(id < registry->count);
+
+    return registry->entries[id].definition;
+}
+
+NBSM_Definition *NBSM_RetainDefinition(NBSM_Registry *registry, NBSM_DefinitionId id)
+{
+    NBSM_Assert(id < registry->count);
+
+    NBSM_RegistryEntry *entry = &registry->entries[id];
+
+    if (!entry->definition)
+    {
+        entry->definition = NBSM_CreateDefinition(entry->builder);
+
+        if (registry->on_load)
+            registry->on_load(registry, id, entry->definition, registry->user_data);
+    }
+
+    entry->ref_count++;
+
+    return entry->definition;
+}
+
+void NBSM_ReleaseDefinition(NBSM_Registry *registry, NBSM_DefinitionId id)
+{
+    NBSM_Assert(id < registry->count);
+
+    NBSM_RegistryEntry *entry = &registry->entries[id];
+
+    NBSM_Assert(entry->ref_count > 0);
+
+    if (--entry->ref_count > 0)
+        return;
+
+    // unload the definition along with its released instances
+
+    for (unsigned int i = 0; i < entry->free_count; i++)
+        NBSM_DestroyInstance(entry->free_instances[i]);
+
+    NBSM_Dealloc(entry->free_instances);
+    NBSM_DestroyDefinition(entry->definition);
+
+    entry->definition = NULL;
+    entry->free_instances = NULL;
+    entry->free_count = 0;
+    entry->free_capacity = 0;
+}
+
+NBSM_Instance *NBSM_CreateRegistryInstance(NBSM_Registry *registry, NBSM_DefinitionId id)
+{
+    NBSM_Definition *definition = NBSM_RetainDefinition(registry, id);
+    NBSM_RegistryEntry *entry = &registry->entries[id];
+
+    if (entry->free_count == 0)
+        return NBSM_CreateInstance(definition);
+
+    NBSM_Instance *instance = entry->free_instances[--entry->free_count];
+
+    NBSM_ResetInstance(definition, instance);
+    instance->user_data = NULL;
+
+    return instance;
+}
+
+void NBSM_ReleaseRegistryInstance(NBSM_Registry *registry, NBSM_DefinitionId id, NBSM_Instance *instance)
+{
+    NBSM_Assert(id < registry->count);
+    NBSM_Assert(!instance->scheduler);
+
+    NBSM_RegistryEntry *entry = &registry->entries[id];
+
+    if (entry->free_count == entry->free_capacity)
+    {
+        entry->free_capacity = entry->free_capacity > 0 ? entry->free_capacity * 2 : 16;
+        entry->free_instances = NBSM_Realloc(entry->free_instances, sizeof(NBSM_Instance *) * entry->free_capacity);
+    }
+
+    entry->free_instances[entry->free_count++] = instance;
+
+    NBSM_ReleaseDefinition(registry, id);
+}
+
+NBSM_Scheduler *NBSM_CreateScheduler(const NBSM_Definition *definition)
+{
+    NBSM_Scheduler *scheduler = NBSM_Alloc(sizeof(NBSM_Scheduler));
+
+    scheduler->definition = definition;
+    scheduler->active = NULL;
+    scheduler->active_count = 0;
+    scheduler->active_capacity = 0;
+    scheduler->instance_count = 0;
+    scheduler->is_updating = false;
+
+    return scheduler;
+}
+
+void NBSM_DestroyScheduler(NBSM_Scheduler *scheduler)
+{
+    NBSM_Assert(scheduler->instance_count == 0);
+
+    NBSM_Dealloc(scheduler->active);
+    NBSM_Dealloc(scheduler);
+}
+
+void NBSM_AddToScheduler(NBSM_Scheduler *scheduler, NBSM_Instance *instance)
+{
+    NBSM_Assert(!instance->scheduler);
+
+    instance->scheduler = scheduler;
+    instance->sleep_state = NBSM_ASLEEP;
+    scheduler->instance_count++;
+
+    WakeInstance(instance);
+}
+
+void NBSM_RemoveFromScheduler(NBSM_Scheduler *scheduler, NBSM_Instance *instance)
+{
+    NBSM_Assert(instance->scheduler == scheduler);
+    NBSM_Assert(!scheduler->is_updating);
+
+    if (instance->sleep_state != NBSM_ASLEEP)
+    {
+        NBSM_Instance *last = scheduler->active[--scheduler->active_count];
+
+        scheduler->active[instance->scheduler_slot] = last;
+        last->scheduler_slot = instance->scheduler_slot;
+    }
+
+    instance->scheduler = NULL;
+    instance->sleep_state = NBSM_AWAKE;
+    scheduler->instance_count--;
+}
+
+unsigned int NBSM_UpdateScheduler(NBSM_Scheduler *scheduler)
+{
+    NBSM_Assert(!scheduler->is_updating);
+
+    const NBSM_Definition *definition = scheduler->definition;
+    unsigned int count = scheduler->active_count;
+
+    scheduler->is_updating = true;
+
+    // instances woken up by a state hook are appended to the active array and updated on the next call
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        NBSM_Instance *instance = scheduler->active[i];
+        NBSM_DefinitionState *s = &definition->states[instance->current];
+        NBSM_DefinitionTransition *t = &definition->transitions[s->first_transition];
+        NBSM_DefinitionTransition *t_end = t + s->transition_count;
+
+        for (; t < t_end; t++)
+        {
+            if (CheckInstanceTransition(definition, t, instance))
+                break;
+        }
+
+        if (t < t_end)
+            ChangeInstanceState(definition, instance, t->target_state);
+        else if (s->can_sleep)
+            instance->sleep_state = NBSM_DROWSY; // the hooks below can still wake it up
+
+        s = &definition->states[instance->current];
+
+        if (s->on_update)
+            s->on_update(instance, s->user_data);
+    }
+
+    // remove the instances that are going to sleep from the active array
+
+    unsigned int active_count = 0;
+
+    for (unsigned int i = 0; i < scheduler->active_count; i++)
+    {
+        NBSM_Instance *instance = scheduler->active[i];
+
+        if (instance->sleep_state == NBSM_DROWSY)
+        {
+            instance->sleep_state = NBSM_ASLEEP;
+        }
+        else
+        {
+            instance->scheduler_slot = active_count;
+            scheduler->active[active_count++] = instance;
+        }
+    }
+
+    scheduler->active_count = active_count;
+    scheduler->is_updating = false;
+
+    return count;
+}
+
+NBSM_Population *NBSM_CreatePopulation(const NBSM_Definition *definition, unsigned int initial_capacity)
+{
+    NBSM_Population *population = NBSM_Alloc(sizeof(NBSM_Population));
+
+    population->definition = definition;
+    population->count = 0;
+    population->capacity = 0;
+    population->states = NULL;
+    population->columns = NULL;
+
+    GrowPopulation(population, initial_capacity);
+
+    return population;
+}
+
+void NBSM_DestroyPopulation(NBSM_Population *population)
+{
+    NBSM_Dealloc(population->states);
+    NBSM_Dealloc(population->columns);
+    NBSM_Dealloc(population);
+}
+
+unsigned int NBSM_AddToPopulation(NBSM_Population *population)
+{
+    if (population->count == population->capacity)
+        GrowPopulation(population, population->capacity * 2);
+
+    unsigned int index = population->count++;
+
+    population->states[index] = population->definition->initial_state;
+
+    for (unsigned int i = 0; i < population->definition->variable_count; i++)
+    {
+        NBSM_Variant value = population->definition->default_values[i];
+
+        // the kernels compare booleans as 0 or 1 integers
+        if (population->definition->variables[i].type == NBSM_BOOLEAN)
+            value.i = value.b ? 1 : 0;
+
+        population->columns[i * population->capacity + index] = value;
+    }
+
+    return index;
+}
+
+void NBSM_RemoveFromPopulation(NBSM_Population *population, unsigned int index)
+{
+    NBSM_Assert(index < population->count);
+
+    unsigned int last = --population->count;
+
+    population->states[index] = population->states[last];
+
+    for (unsigned int i = 0; i < population->definition->variable_count; i++)
+    {
+        NBSM_Variant *column = population->columns + i * population->capacity;
+
+        column[index] = column[last];
+    }
+}
+
+unsigned int NBSM_UpdatePopulation(NBSM_Population *population)
+{
+    const NBSM_Definition *definition = population->definition;
+    const PopulationKernels *kernels = GetPopulationKernels();
+    unsigned int executed_count = 0;
+
+    for (unsigned int base = 0; base < population->count; base += NBSM_POPULATION_BLOCK_SIZE)
+    {
+        unsigned int *states = population->states + base;
+        unsigned int remaining = population->count - base;
+
+        // instances that have not executed a transition yet, one bit per instance of the block
+        unsigned int pending = remaining >= NBSM_POPULATION_BLOCK_SIZE ?
+            (1u << NBSM_POPULATION_BLOCK_SIZE) - 1 : (1u << remaining) - 1;
+
+        for (unsigned int i = 0; i < definition->state_count && pending; i++)
+        {
+            unsigned int in_state = pending & kernels->match_state(states, i);
+
+            if (!in_state)
+                continue;
+
+            NBSM_DefinitionState *s = &definition->states[i];
+            NBSM_DefinitionTransition *t = &definition->transitions[s->first_transition];
+            NBSM_DefinitionTransition *t_end = t + s->transition_count;
+
+            for (; t < t_end && in_state; t++)
+            {
+                NBSM_DefinitionCondition *c = &definition->conditions[t->first_condition];
+                NBSM_DefinitionCondition *c_end = c + t->condition_count;
+                unsigned int taken = in_state;
+
+                for (; c < c_end && taken; c++)
+                {
+                    const NBSM_Variant *left = population->columns + c->left_var * population->capacity + base;
+                    const NBSM_Variant *right = NULL;
+                    NBSM_Variant constant = c->right_op.constant;
+
+                    if (c->right_type == NBSM_OPERAND_VAR)
+                        right = population->columns + c->right_op.var * population->capacity + base;
+                    else if (c->value_type == NBSM_BOOLEAN)
+                        constant.i = c->right_op.constant.b ? 1 : 0;
+
+                    taken &= kernels->condition(c->type, c->value_type, left, right, constant);
+                }
+
+                in_state &= ~taken;
+                pending &= ~taken;
+
+                for (unsigned int j = 0; taken; j++, taken >>= 1)
+                {
+                    if (taken & 1)
+                    {
+                        states[j] = t->target_state;
+                        executed_count++;
+                    }
+                }
+            }
+        }
+    }
+
+    return executed_count;
+}
+
+void NBSM_SetPopulationInteger(NBSM_Population *population, unsigned int index, unsigned int var, int value)
+{
+    NBSM_Assert(population->definition->variables[var].type == NBSM_INTEGER);
+
+    population->columns[var * population->capacity + index].i = value;
+}
+
+void NBSM_SetPopulationFloat(NBSM_Population *population, unsigned int index, unsigned int var, float value)
+{
+    NBSM_Assert(population->definition->variables[var].type == NBSM_FLOAT);
+
+    population->columns[var * population->capacity + index].f = value;
+}
+
+void NBSM_SetPopulationBoolean(NBSM_Population *population, unsigned int index, unsigned int var, bool value)
+{
+    NBSM_Assert(population->definition->variables[var].type == NBSM_BOOLEAN);
+
+    population->columns[var * population->capacity + index].i = value ? 1 : 0;
+}
+
+int NBSM_GetPopulationInteger(NBSM_Population *population, unsigned int index, unsigned int var)
+{
+    NBSM_Assert(population->definition->variables[var].type == NBSM_INTEGER);
+
+    return population->columns[var * population->capacity + index].i;
+}
+
+float NBSM_GetPopulationFloat(NBSM_Population *population, unsigned int index, unsigned int var)
+{
+    NBSM_Assert(population->definition->variables[var].type == NBSM_FLOAT);
+
+    return population->columns[var * population->capacity + index].f;
+}
+
+bool NBSM_GetPopulationBoolean(NBSM_Population *population, unsigned int index, unsigned int var)
+{
+    NBSM_Assert(population->definition->variables[var].type == NBSM_BOOLEAN);
+
+    return population->columns[var * population->capacity + index].i != 0;
+}
+
+bool NBSM_SetSIMDLevel(NBSM_SIMDLevel level)
+{
+    const PopulationKernels *kernels = FindPopulationKernels(level);
+
+    if (!kernels)
+        return false;
+
+    population_kernels = kernels;
+
+    return true;
+}
+
+NBSM_SIMDLevel NBSM_GetSIMDLevel(void)
+{
+    return GetPopulationKernels()->level;
+}
+
+#ifdef NBSM_PARALLEL
+
+NBSM_WorkerPool *NBSM_CreateWorkerPool(unsigned int worker_count)
+{
+    NBSM_Assert(worker_count > 0);
+
+    NBSM_WorkerPool *pool = NBSM_Alloc(sizeof(NBSM_WorkerPool));
+
+    pool->worker_count = worker_count;
+    pool->workers = NBSM_Alloc(sizeof(NBSM_Worker) * worker_count);
+    pool->threads = NBSM_Alloc(sizeof(pthread_t) * worker_count);
+    pool->job_id = 0;
+    pool->running_count = 0;
+    pool->quit = false;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (unsigned int i = 0; i < worker_count; i++)
+    {
+        NBSM_Worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        worker->range = 0;
+        worker->deferred_hooks = (NBSM_DeferredHooks){ NULL, 0, 0 };
+        worker->scratch = NULL;
+        worker->scratch_size = 0;
+
+        // the first worker is the calling thread
+        if (i > 0)
+            NBSM_Assert(pthread_create(&pool->threads[i], NULL, RunWorker, worker) == 0);
+    }
+
+    return pool;
+}
+
+void NBSM_DestroyWorkerPool(NBSM_WorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (unsigned int i = 1; i < pool->worker_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (unsigned int i = 0; i < pool->worker_count; i++)
+    {
+        NBSM_Dealloc(pool->workers[i].deferred_hooks.hooks);
+        NBSM_Dealloc(pool->workers[i].scratch);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_cond_destroy(&pool->done_cond);
+
+    NBSM_Dealloc(pool->workers);
+    NBSM_Dealloc(pool->threads);
+    NBSM_Dealloc(pool);
+}
+
+void NBSM_UpdateParallel(
+    NBSM_WorkerPool *pool, const NBSM_Definition *definition, NBSM_Instance **instances, unsigned int count, unsigned int flags)
+{
+    if (count == 0)
+        return;
+
+    uint64_t chunk_count = (count + NBSM_PARALLEL_CHUNK_SIZE - 1) / NBSM_PARALLEL_CHUNK_SIZE;
+
+    // split the chunks evenly between the workers
+
+    for (unsigned int i = 0; i < pool->worker_count; i++)
+    {
+        uint64_t begin = chunk_count * i / pool->worker_count;
+        uint64_t end = chunk_count * (i + 1) / pool->worker_count;
+
+        __atomic_store_n(&pool->workers[i].range, (begin << 32) | end, __ATOMIC_RELAXED);
+    }
+
+    pool->definition = definition;
+    pool->instances = instances;
+    pool->count = count;
+    pool->flags = flags;
+
+    RunWorkerJob(pool, ProcessChunks);
+
+    // run the deferred hooks in the order of the chunks of each worker
+
+    for (unsigned int i = 0; i < pool->worker_count; i++)
+    {
+        NBSM_DeferredHooks *deferred_hooks = &pool->workers[i].deferred_hooks;
+
+        for (unsigned int j = 0; j < deferred_hooks->count; j++)
+        {
+            NBSM_DeferredHook *hook = &deferred_hooks->hooks[j];
+
+            hook->func(hook->instance, hook->user_data);
+        }
+
+        deferred_hooks->count = 0;
+    }
+}
+
+#ifdef NBSM_POSIX
+
+NBSM_BuilderRegistry *NBSM_LoadBuildersFromDirectoryParallel(NBSM_WorkerPool *pool, const char *path)
+{
+    NBSM_BuilderRegistry *registry = ListBuilderFiles(path);
+
+    if (!registry)
+        return NULL;
+
+    pool->registry = registry;
+    pool->directory = path;
+    pool->next_file = 0;
+
+    RunWorkerJob(pool, LoadBuildersJob);
+    IndexBuilderRegistry(registry);
+
+    return registry;
+}
+
+#endif // NBSM_POSIX
+
+NBSM_ConcurrentPool *NBSM_CreateConcurrentPool(NBSM_MachineBuilder *builder, unsigned int initial_count)
+{
+    return NBSM_CreateConcurrentPoolWithAllocator(builder, initial_count, &default_allocator);
+}
+
+NBSM_ConcurrentPool *NBSM_CreateConcurrentPoolWithAllocator(
+    NBSM_MachineBuilder *builder, unsigned int initial_count, const NBSM_Allocator *allocator)
+{
+    NBSM_ConcurrentPool *pool = Allocate(allocator, sizeof(NBSM_ConcurrentPool));
+
+    pool->allocator = *allocator;
+    pool->prototype = NBSM_BuildWithAllocator(builder, allocator);
+    pool->slot_size = NBSM_POOL_SLOT_HEADER_SIZE + pool->prototype->names_offset; // the names are shared with the prototype
+    pool->slab_count = 0;
+    pool->base_slab_capacity = 1;
+    pool->is_growing = false;
+    pool->free_head = 0;
+
+    while (pool->base_slab_capacity < initial_count)
+        pool->base_slab_capacity *= 2;
+
+    GrowConcurrentPool(pool);
+
+    return pool;
+}
+
+void NBSM_DestroyConcurrentPool(NBSM_ConcurrentPool *pool)
+{
+    NBSM_Allocator allocator = pool->allocator;
+
+    for (unsigned int i = 0; i < pool->slab_count; i++)
+        Deallocate(&allocator, pool->slabs[i]);
+
+    NBSM_Destroy(pool->prototype, false);
+    Deallocate(&allocator, pool);
+}
+
+NBSM_PoolCache *NBSM_CreatePoolCache(NBSM_ConcurrentPool *pool)
+{
+    NBSM_PoolCache *cache = Allocate(&pool->allocator, sizeof(NBSM_PoolCache));
+
+    cache->pool = pool;
+    cache->count = 0;
+
+    return cache;
+}
+
+void NBSM_DestroyPoolCache(NBSM_PoolCache *cache)
+{
+    NBSM_ConcurrentPool *pool = cache->pool;
+
+    PushMachinesToConcurrentPool(pool, cache->machines, cache->count);
+    Deallocate(&pool->allocator, cache);
+}
+
+NBSM_Machine *NBSM_GetFromConcurrentPool(NBSM_ConcurrentPool *pool, NBSM_PoolCache *cache)
+{
+    if (cache)
+    {
+        NBSM_Assert(cache->pool == pool);
+
+        // refill half of the cache when it is empty so the next acquires do not touch the shared free list
+
+        if (cache->count == 0)
+        {
+            while (cache->count < NBSM_POOL_CACHE_SIZE / 2)
+            {
+                NBSM_PoolSlot *slot = PopPoolSlot(pool);
+
+                if (!slot)
+                    break;
+
+                cache->machines[cache->count++] = GetPoolSlotMachine(slot);
+            }
+        }
+
+        if (cache->count > 0)
+            return cache->machines[--cache->count];
+    }
+
+    for (;;)
+    {
+        NBSM_PoolSlot *slot = PopPoolSlot(pool);
+
+        if (slot)
+            return GetPoolSlotMachine(slot);
+
+        // another thread may be growing the pool already, in which case its slots will show up in the free list
+        GrowConcurrentPool(pool);
+    }
+}
+
+void NBSM_RecycleToConcurrentPool(NBSM_ConcurrentPool *pool, NBSM_PoolCache *cache, NBSM_Machine *machine)
+{
+    NBSM_Reset(machine);
+
+    if (!cache)
+    {
+        PushMachinesToConcurrentPool(pool, &machine, 1);
+
+        return;
+    }
+
+    NBSM_Assert(cache->pool == pool);
+
+    if (cache->count == NBSM_POOL_CACHE_SIZE)
+    {
+        // give back the upper half of the cache in a single push
+        cache->count = NBSM_POOL_CACHE_SIZE / 2;
+
+        PushMachinesToConcurrentPool(pool, cache->machines + cache->count, NBSM_POOL_CACHE_SIZE - cache->count);
+    }
+
+    cache->machines[cache->count++] = machine;
+}
+
+#endif // NBSM_PARALLEL
+
+#pragma endregion // Public API
+
+static void ChangeState(NBSM_Machine *machine, NBSM_State *state)
+{
+    NBSM_State *prev_state = machine->current;
+
+    machine->current = state;
+
+    if (prev_state->on_exit)
+        prev_state->on_exit(machine, prev_state->user_data);
+
+    if (machine->current->on_enter)
+        machine->current->on_enter(machine, machine->current->user_data);
+
+    machine->force_evaluation = true;
+}
+
+static bool HasDirtyDependency(NBSM_State *state)
+{
+    for (unsigned int i = 0; i < state->dependency_count; i++)
+    {
+        if (state->dependencies[i]->dirty)
+            return true;
+    }
+
+    return false;
+}
+
+static void ClearDependencies(NBSM_State *state)
+{
+    for (unsigned int i = 0; i < state->dependency_count; i++)
+        state->dependencies[i]->dirty = false;
+}
+
+static bool HasDependency(NBSM_State *state, NBSM_Value *var)
+{
+    for (unsigned int i = 0; i < state->dependency_count; i++)
+    {
+        if (state->dependencies[i] == var)
+            return true;
+    }
+
+    return false;
+}
+
+static void AddDependency(const NBSM_Allocator *allocator, NBSM_State *state, NBSM_Value *var)
+{
+    if (HasDependency(state, var))
+        return;
+
+    state->dependencies =
+        Reallocate(allocator, state->dependencies, sizeof(NBSM_Value *) * (state->dependency_count + 1));
+    state->dependencies[state->dependency_count++] = var;
+}
+
+// add a dependency to a state whose dependency array is already large enough
+static void PushDependency(NBSM_State *state, NBSM_Value *var)
+{
+    if (!HasDependency(state, var))
+        state->dependencies[state->dependency_count++] = var;
+}
+
+static void InitMachineState(NBSM_State *state, NBSM_StateId id, const char *name)
+{
+    state->id = id;
+    state->name = name;
+    state->transitions = NULL;
+    state->user_data = NULL;
+    state->on_enter = NULL;
+    state->on_exit = NULL;
+    state->on_update = NULL;
+    state->dependencies = NULL;
+    state->dependency_count = 0;
+    state->unconditional_transition_count = 0;
+    state->first_transition = 0;
+    state->transition_count = 0;
+}
+
+// move a pointer from a state machine's block to the same offset in another block
+static void *RebasePointer(const void *ptr, const char *old_base, char *new_base)
+{
+    return ptr ? new_base + ((const char *)ptr - old_base) : NULL;
+}
+
+// Names are only moved if they were copied with the first size bytes of the block
+static char *RebaseName(const char *name, const char *old_base, char *new_base, size_t size)
+{
+    uintptr_t offset = (uintptr_t)name - (uintptr_t)old_base;
+
+    return offset < size ? new_base + offset : (char *)name;
+}
+
+static void RebaseHTable(NBSM_HTable *htable, const char *old_base, char *new_base, size_t size)
+{
+    htable->entries = RebasePointer(htable->entries, old_base, new_base);
+    htable->allocator = RebasePointer(htable->allocator, old_base, new_base);
+
+    for (unsigned int i = 0; i < htable->capacity; i++)
+    {
+        NBSM_HTableEntry *entry = &htable->entries[i];
+
+        if (entry->key)
+        {
+            entry->key = RebaseName(entry->key, old_base, new_base, size);
+            entry->item = RebasePointer(entry->item, old_base, new_base);
+        }
+    }
+}
+
+static NBSM_Machine *CloneMachine(NBSM_Machine *machine, void *buffer, size_t size)
+{
+    NBSM_Assert(machine->block && size <= machine->block_size);
+
+    // all pointers of a state machine built from a machine builder point inside its block, so the first size bytes
+    // of the block are copied as is and the pointers are moved to the new block; names left out of the copy are
+    // shared with the original
+
+    NBSM_Machine *clone = memcpy(buffer, machine->block, size);
+    const char *old_base = machine->block;
+    char *new_base = buffer;
+
+    clone->states = RebasePointer(clone->states, old_base, new_base);
+    clone->variables = RebasePointer(clone->variables, old_base, new_base);
+    clone->states_by_id = RebasePointer(clone->states_by_id, old_base, new_base);
+    clone->variables_by_id = RebasePointer(clone->variables_by_id, old_base, new_base);
+    clone->current = RebasePointer(clone->current, old_base, new_base);
+    clone->initial_state = RebasePointer(clone->initial_state, old_base, new_base);
+    clone->state_array = RebasePointer(clone->state_array, old_base, new_base);
+    clone->transitions = RebasePointer(clone->transitions, old_base, new_base);
+    clone->conditions = RebasePointer(clone->conditions, old_base, new_base);
+    clone->values = RebasePointer(clone->values, old_base, new_base);
+    clone->default_values = RebasePointer(clone->default_values, old_base, new_base);
+    clone->block = buffer;
+    clone->block_size = size;
+    clone->owns_block = false;
+
+    if (size < machine->block_size)
+        clone->prototype = machine;
+
+    RebaseHTable(clone->states, old_base, new_base, size);
+    RebaseHTable(clone->variables, old_base, new_base, size);
+
+    for (unsigned int i = 0; i < clone->state_count; i++)
+    {
+        NBSM_State *s = &clone->state_array[i];
+
+        clone->states_by_id[i] = RebasePointer(clone->states_by_id[i], old_base, new_base);
+        s->name = RebaseName(s->name, old_base, new_base, size);
+        s->dependencies = RebasePointer(s->dependencies, old_base, new_base);
+
+        for (unsigned int j = 0; j < s->dependency_count; j++)
+            s->dependencies[j] = RebasePointer(s->dependencies[j], old_base, new_base);
+
+        for (unsigned int j = 0; j < s->transition_count; j++)
+        {
+            NBSM_CompiledTransition *t = &clone->transitions[s->first_transition + j];
+
+            for (unsigned int k = 0; k < t->condition_count; k++)
+            {
+                NBSM_CompiledCondition *c = &clone->conditions[t->first_condition + k];
+
+                c->left_op = RebasePointer(c->left_op, old_base, new_base);
+                c->right_op = RebasePointer(c->right_op, old_base, new_base);
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < clone->variable_count; i++)
+        clone->variables_by_id[i] = RebasePointer(clone->variables_by_id[i], old_base, new_base);
+
+    return clone;
+}
+
+// Copy the names shared with the prototype at the end of the block of a state machine, the block must be large
+// enough to hold them
+static void CopyPrototypeNames(NBSM_Machine *machine)
+{
+    const NBSM_Machine *prototype = machine->prototype;
+    const char *old_base = prototype->block;
+    char *new_base = machine->block;
+    NBSM_HTable *tables[] = { machine->states, machine->variables };
+
+    memcpy(new_base + prototype->names_offset, old_base + prototype->names_offset,
+        prototype->block_size - prototype->names_offset);
+
+    for (unsigned int i = 0; i < machine->state_count; i++)
+        machine->state_array[i].name = RebaseName(machine->state_array[i].name, old_base, new_base, prototype->block_size);
+
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        for (unsigned int j = 0; j < tables[i]->capacity; j++)
+        {
+            NBSM_HTableEntry *entry = &tables[i]->entries[j];
+
+            if (entry->key)
+                entry->key = RebaseName(entry->key, old_base, new_base, prototype->block_size);
+        }
+    }
+
+    machine->block_size = prototype->block_size;
+    machine->prototype = NULL;
+}
+
+static size_t ReserveInBlock(size_t *offset, size_t size)
+{
+    size_t start = *offset;
+
+    *offset += (size + NBSM_BLOCK_ALIGNMENT - 1) & ~(size_t)(NBSM_BLOCK_ALIGNMENT - 1);
+
+    return start;
+}
+
+static void GetBuildLayout(NBSM_MachineBuilder *builder, BuildLayout *layout)
+{
+    unsigned int condition_count = 0;
+    size_t string_size = 0;
+    size_t offset = 0;
+
+    for (unsigned int i = 0; i < builder->transition_count; i++)
+        condition_count += builder->transitions[i].condition_count;
+
+    for (unsigned int i = 0; i < builder->state_count; i++)
+        string_size += strlen(builder->states[i].name) + 1;
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+        string_size += strlen(builder->variables[i].name) + 1;
+
+    ReserveInBlock(&offset, sizeof(NBSM_Machine));
+
+    layout->states_table = ReserveInBlock(&offset, sizeof(NBSM_HTable));
+    layout->state_entries = ReserveInBlock(&offset, sizeof(NBSM_HTableEntry) * GetHTableCapacity(builder->state_count));
+    layout->variables_table = ReserveInBlock(&offset, sizeof(NBSM_HTable));
+    layout->variable_entries = ReserveInBlock(&offset, sizeof(NBSM_HTableEntry) * GetHTableCapacity(builder->variable_count));
+    layout->states_by_id = ReserveInBlock(&offset, sizeof(NBSM_State *) * builder->state_count);
+    layout->variables_by_id = ReserveInBlock(&offset, sizeof(NBSM_Value *) * builder->variable_count);
+    layout->state_array = ReserveInBlock(&offset, sizeof(NBSM_State) * builder->state_count);
+    layout->values = ReserveInBlock(&offset, sizeof(NBSM_Value) * builder->variable_count);
+    layout->default_values = ReserveInBlock(&offset, sizeof(NBSM_Value) * builder->variable_count);
+    layout->transitions = ReserveInBlock(&offset, sizeof(NBSM_CompiledTransition) * builder->transition_count);
+    layout->conditions = ReserveInBlock(&offset, sizeof(NBSM_CompiledCondition) * condition_count);
+
+    // a condition depends on at most two variables
+    layout->dependencies = ReserveInBlock(&offset, sizeof(NBSM_Value *) * condition_count * 2);
+    layout->strings = ReserveInBlock(&offset, string_size);
+    layout->size = offset;
+}
+
+static uint32_t VariantToBinary(NBSM_ValueType type, NBSM_Variant value)
+{
+    uint32_t bits = 0;
+
+    if (type == NBSM_INTEGER)
+        bits = (uint32_t)value.i;
+    else if (type == NBSM_FLOAT)
+        memcpy(&bits, &value.f, sizeof(bits));
+    else
+        bits = value.b;
+
+    return bits;
+}
+
+static NBSM_Variant BinaryToVariant(NBSM_ValueType type, uint32_t bits)
+{
+    NBSM_Variant value = { 0 };
+
+    if (type == NBSM_INTEGER)
+        value.i = (int)bits;
+    else if (type == NBSM_FLOAT)
+        memcpy(&value.f, &bits, sizeof(bits));
+    else
+        value.b = bits != 0;
+
+    return value;
+}
+
+static void AddBinaryString(NBSM_HTable *strings, char *string_table, uint32_t *string_table_size, const char *str)
+{
+    if (DoesEntryExist(strings, str))
+        return;
+
+    size_t size = strlen(str) + 1;
+
+    // offsets are stored + 1 since NULL means not found
+    AddToHTable(strings, str, (void *)(uintptr_t)(*string_table_size + 1));
+    memcpy(string_table + *string_table_size, str, size);
+
+    *string_table_size += size;
+}
+
+static uint32_t GetBinaryString(NBSM_HTable *strings, const char *str)
+{
+    uintptr_t offset = (uintptr_t)GetInHTable(strings, str);
+
+    // transitions and conditions must refer to existing states and variables
+    NBSM_Assert(offset > 0);
+
+    return (uint32_t)(offset - 1);
+}
+
+static char *GetBinaryStringAt(const BinaryHeader *header, const char *string_table, uint32_t offset, bool *is_valid)
+{
+    if (offset >= header->string_table_size)
+    {
+        *is_valid = false;
+
+        return NULL;
+    }
+
+    return (char *)string_table + offset;
+}
+
+static void ReleaseBinaryFile(void *data, size_t size)
+{
+#ifdef NBSM_POSIX
+    munmap(data, size);
+#else
+    (void)size;
+
+    NBSM_Dealloc(data);
+#endif
+}
+
+
+static NBSM_State *FindTransition(NBSM_Machine *machine)
+{
+    NBSM_Transition *t = machine->current->transitions;
+
+    while (t)
+    {
+        if (t->conditions == NULL)
+            break;
+
+        bool res = true;
+
+        NBSM_Condition *c = t->conditions;
+
+        while (c)
+        {
+            const NBSM_Variant *right =
+                c->right_op.type == NBSM_OPERAND_CONST ? &c->right_op.data.constant.value : &c->right_op.data.var->value;
+
+            if (!ExecuteOpcode(c->op, &c->left_op->value, right, right))
+            {
+                res = false;
+
+                break;
+            }
+
+            c = c->next;
+        }
+
+        if (res)
+            break;
+
+        t = t->next;
+    }
+
+    return t ? t->target_state : NULL;
+}
+
+static NBSM_State *FindCompiledTransition(NBSM_Machine *machine)
+{
+    NBSM_CompiledTransition *t = &machine->transitions[machine->current->first_transition];
+    NBSM_CompiledTransition *t_end = t + machine->current->transition_count;
+
+    for (; t < t_end; t++)
+    {
+        NBSM_CompiledCondition *c = &machine->conditions[t->first_condition];
+        NBSM_CompiledCondition *c_end = c + t->condition_count;
+
+        for (; c < c_end; c++)
+        {
+            // the right operand has been resolved at compile time
+            if (!ExecuteOpcode(c->op, c->left_op, c->right_op, c->right_op))
+                break;
+        }
+
+        // all conditions are true (or there is no condition)
+        if (c == c_end)
+            return &machine->state_array[t->target_state];
+    }
+
+    return NULL;
+}
+
+static NBSM_Opcode GetConditionOpcode(
+    NBSM_ConditionType type, NBSM_ValueType value_type, NBSM_ConditionOperandType operand_type)
+{
+    // first opcode of each comparison (in NBSM_ConditionType order) for each value type, -1 when not supported
+    static const int opcodes[3][6] = {
+        { NBSM_OP_EQ_INT_CONST, NBSM_OP_NEQ_INT_CONST, NBSM_OP_LT_INT_CONST,
+          NBSM_OP_LTE_INT_CONST, NBSM_OP_GT_INT_CONST, NBSM_OP_GTE_INT_CONST },
+        { NBSM_OP_EQ_FLOAT_CONST, NBSM_OP_NEQ_FLOAT_CONST, NBSM_OP_LT_FLOAT_CONST,
+          NBSM_OP_LTE_FLOAT_CONST, NBSM_OP_GT_FLOAT_CONST, NBSM_OP_GTE_FLOAT_CONST },
+        { NBSM_OP_EQ_BOOL_CONST, NBSM_OP_NEQ_BOOL_CONST, -1, -1, -1, -1 }
+    };
+
+    int op = opcodes[value_type][type];
+
+    NBSM_Assert(op >= 0); // booleans can only be compared for equality
+
+    // the variable operand version of an opcode always follows the constant operand one
+    return (NBSM_Opcode)(op + (operand_type == NBSM_OPERAND_VAR));
+}
+
+// right_var is only read by the variable operand opcodes and right_const by the constant operand ones
+static inline bool ExecuteOpcode(
+    NBSM_Opcode op, const NBSM_Variant *left, const NBSM_Variant *right_const, const NBSM_Variant *right_var)
+{
+    switch (op)
+    {
+    case NBSM_OP_EQ_INT_CONST:
+        return left->i == right_const->i;
+
+    case NBSM_OP_EQ_INT_VAR:
+        return left->i == right_var->i;
+
+    case NBSM_OP_NEQ_INT_CONST:
+        return left->i != right_const->i;
+
+    case NBSM_OP_NEQ_INT_VAR:
+        return left->i != right_var->i;
+
+    case NBSM_OP_LT_INT_CONST:
+        return left->i < right_const->i;
+
+    case NBSM_OP_LT_INT_VAR:
+        return left->i < right_var->i;
+
+    case NBSM_OP_LTE_INT_CONST:
+        return left->i <= right_const->i;
+
+    case NBSM_OP_LTE_INT_VAR:
+        return left->i <= right_var->i;
+
+    case NBSM_OP_GT_INT_CONST:
+        return left->i > right_const->i;
+
+    case NBSM_OP_GT_INT_VAR:
+        return left->i > right_var->i;
+
+    case NBSM_OP_GTE_INT_CONST:
+        return left->i >= right_const->i;
+
+    case NBSM_OP_GTE_INT_VAR:
+        return left->i >= right_var->i;
+
+    case NBSM_OP_EQ_FLOAT_CONST:
+        return fabsf(left->f - right_const->f) < FLT_EPSILON;
+
+    case NBSM_OP_EQ_FLOAT_VAR:
+        return fabsf(left->f - right_var->f) < FLT_EPSILON;
+
+    case NBSM_OP_NEQ_FLOAT_CONST:
+        return !(fabsf(left->f - right_const->f) < FLT_EPSILON);
+
+    case NBSM_OP_NEQ_FLOAT_VAR:
+        return !(fabsf(left->f - right_var->f) < FLT_EPSILON);
+
+    case NBSM_OP_LT_FLOAT_CONST:
+        return left->f < right_const->f - FLT_EPSILON;
+
+    case NBSM_OP_LT_FLOAT_VAR:
+        return left->f < right_var->f - FLT_EPSILON;
+
+    case NBSM_OP_LTE_FLOAT_CONST:
+        return left->f < right_const->f - FLT_EPSILON;
+
+    case NBSM_OP_LTE_FLOAT_VAR:
+        return left->f < right_var->f - FLT_EPSILON;
+
+    case NBSM_OP_GT_FLOAT_CONST:
+        return left->f > right_const->f + FLT_EPSILON;
+
+    case NBSM_OP_GT_FLOAT_VAR:
+        return left->f > right_var->f + FLT_EPSILON;
+
+    case NBSM_OP_GTE_FLOAT_CONST:
+        return left->f > right_const->f + FLT_EPSILON;
+
+    case NBSM_OP_GTE_FLOAT_VAR:
+        return left->f > right_var->f + FLT_EPSILON;
+
+    case NBSM_OP_EQ_BOOL_CONST:
+        return left->b == right_const->b;
+
+    case NBSM_OP_EQ_BOOL_VAR:
+        return left->b == right_var->b;
+
+    case NBSM_OP_NEQ_BOOL_CONST:
+        return left->b != right_const->b;
+
+    case NBSM_OP_NEQ_BOOL_VAR:
+        return left->b != right_var->b;
+    }
+
+    return false;
+}
+
+static void DestroyMachineValue(const NBSM_Allocator *allocator, void *ptr)
+{
+    Deallocate(allocator, ptr);
+}
+
+static void DestroyMachineState(const NBSM_Allocator *allocator, void *ptr)
+{
+    NBSM_State *state = ptr;
+    NBSM_Transition *t = state->transitions;
+
+    while (t)
+    {
+        NBSM_Transition *next = t->next;
+
+        DestroyMachineTransition(allocator, t);
+
+        t = next;
+    }
+
+    Deallocate(allocator, state->dependencies);
+    Deallocate(allocator, ptr);
+}
+
+static void DestroyMachineTransition(const NBSM_Allocator *allocator, NBSM_Transition *transition)
+{
+    NBSM_Condition *c = transition->conditions;
+
+    while (c)
+    {
+        NBSM_Condition *next = c->next;
+
+        Deallocate(allocator, c);
+
+        c = next;
+    }
+
+    Deallocate(allocator, transition);
+}
+
+static void GrowPool(NBSM_MachinePool *pool, unsigned int count)
+{
+    if (count <= pool->count)
+        return;
+
+    unsigned int new_count = count - pool->count;
+    char *slab = Allocate(&pool->allocator, pool->machine_size * new_count);
+
+    pool->slabs = Reallocate(&pool->allocator, pool->slabs, sizeof(void *) * (pool->slab_count + 1));
+    pool->slabs[pool->slab_count++] = slab;
+    pool->machines = Reallocate(&pool->allocator, pool->machines, sizeof(NBSM_Machine *) * count);
+    pool->generations = Reallocate(&pool->allocator, pool->generations, sizeof(uint32_t) * count);
+    pool->free = Reallocate(&pool->allocator, pool->free, sizeof(NBSM_Machine *) * count);
+    pool->live = Reallocate(&pool->allocator, pool->live, sizeof(NBSM_Machine *) * count);
+    pool->live_slots = Reallocate(&pool->allocator, pool->live_slots, sizeof(unsigned int) * count);
+
+    for (unsigned int i = 0; i < new_count; i++)
+    {
+        NBSM_Machine *machine = CloneMachine(pool->prototype, slab + pool->machine_size * i, pool->machine_size);
+
+        machine->pool_index = pool->count + i;
+        pool->machines[machine->pool_index] = machine;
+        pool->generations[machine->pool_index] = 1; // NBSM_NULL_HANDLE has generation 0
+    }
+
+    pool->count = count;
+}
+
+static void ChangeInstanceState(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int state)
+{
+    NBSM_DefinitionState *prev_state = &definition->states[instance->current];
+    NBSM_DefinitionState *new_state = &definition->states[state];
+
+    instance->current = state;
+
+    if (prev_state->on_exit)
+        prev_state->on_exit(instance, prev_state->user_data);
+
+    if (new_state->on_enter)
+        new_state->on_enter(instance, new_state->user_data);
+
+    if (instance->scheduler)
+        WakeInstance(instance);
+}
+
+static NBSM_DefinitionState *GetDefinitionState(NBSM_Definition *definition, const char *name)
+{
+    NBSM_DefinitionState *s = GetInHTable(definition->state_lookup, name);
+
+    NBSM_Assert(s);
+
+    return s;
+}
+
+static bool CheckInstanceTransition(
+    const NBSM_Definition *definition, const NBSM_DefinitionTransition *transition, const NBSM_Instance *instance)
+{
+    NBSM_DefinitionCondition *c = &definition->conditions[transition->first_condition];
+    NBSM_DefinitionCondition *c_end = c + transition->condition_count;
+
+    for (; c < c_end; c++)
+    {
+        const NBSM_Variant *left = &instance->variables[c->left_var];
+        const NBSM_Variant *right_var = &instance->variables[c->right_op.var];
+
+        if (!ExecuteOpcode(c->op, left, &c->right_op.constant, right_var))
+            return false;
+    }
+
+    // all conditions are true (or there is no condition)
+    return true;
+}
+
+static size_t GetBatchScratchSize(const NBSM_Definition *definition, unsigned int count)
+{
+    return sizeof(NBSM_Instance *) * count * 2 + sizeof(unsigned int) * (definition->state_count + 1 + count);
+}
+
+static void CallInstanceHook(
+    NBSM_InstanceHookFunc hook_func, NBSM_Instance *instance, void *user_data, NBSM_DeferredHooks *deferred_hooks)
+{
+    if (!deferred_hooks)
+    {
+        hook_func(instance, user_data);
+
+        return;
+    }
+
+    if (deferred_hooks->count == deferred_hooks->capacity)
+    {
+        deferred_hooks->capacity = deferred_hooks->capacity ? deferred_hooks->capacity * 2 : 64;
+        deferred_hooks->hooks = NBSM_Realloc(deferred_hooks->hooks, sizeof(NBSM_DeferredHook) * deferred_hooks->capacity);
+    }
+
+    deferred_hooks->hooks[deferred_hooks->count++] = (NBSM_DeferredHook){ hook_func, instance, user_data };
+}
+
+static void UpdateBatch(
+    const NBSM_Definition *definition,
+    NBSM_Instance **instances,
+    unsigned int count,
+    void *scratch,
+    NBSM_DeferredHooks *deferred_hooks)
+{
+    unsigned int state_count = definition->state_count;
+
+    // scratch memory: instances sorted by state, instances that changed state, bucket offsets and previous states
+    NBSM_Instance **sorted = scratch;
+    NBSM_Instance **moved = sorted + count;
+    unsigned int *offsets = (unsigned int *)(moved + count);
+    unsigned int *prev_states = offsets + state_count + 1;
+    unsigned int moved_count = 0;
+
+    // counting sort of the instances by current state
+
+    memset(offsets, 0, sizeof(unsigned int) * (state_count + 1));
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        // batch updates change states without waking the instances, scheduled ones would keep a stale sleep state
+        NBSM_Assert(!instances[i]->scheduler);
+
+        offsets[instances[i]->current + 1]++;
+    }
+
+    for (unsigned int i = 0; i < state_count; i++)
+        offsets[i + 1] += offsets[i];
+
+    for (unsigned int i = 0; i < count; i++)
+        sorted[offsets[instances[i]->current]++] = instances[i];
+
+    // offsets[i] is now the end of the bucket of the state i
+
+    for (unsigned int i = 0, begin = 0; i < state_count; begin = offsets[i], i++)
+    {
+        NBSM_DefinitionState *s = &definition->states[i];
+        NBSM_DefinitionTransition *t = &definition->transitions[s->first_transition];
+        NBSM_DefinitionTransition *t_end = t + s->transition_count;
+        unsigned int pending_end = offsets[i];
+
+        for (; t < t_end && pending_end > begin; t++)
+        {
+            unsigned int write_idx = begin;
+
+            for (unsigned int j = begin; j < pending_end; j++)
+            {
+                NBSM_Instance *instance = sorted[j];
+
+                if (CheckInstanceTransition(definition, t, instance))
+                {
+                    // the instance is not evaluated again during this update, it is safe to move it now
+                    instance->current = t->target_state;
+                    prev_states[moved_count] = i;
+                    moved[moved_count++] = instance;
+                }
+                else
+                {
+                    sorted[write_idx++] = instance;
+                }
+            }
+
+            pending_end = write_idx;
+        }
+    }
+
+    for (unsigned int i = 0; i < moved_count; i++)
+    {
+        NBSM_Instance *instance = moved[i];
+        NBSM_DefinitionState *prev_state = &definition->states[prev_states[i]];
+        NBSM_DefinitionState *new_state = &definition->states[instance->current];
+
+        if (prev_state->on_exit)
+            CallInstanceHook(prev_state->on_exit, instance, prev_state->user_data, deferred_hooks);
+
+        if (new_state->on_enter)
+            CallInstanceHook(new_state->on_enter, instance, new_state->user_data, deferred_hooks);
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        NBSM_DefinitionState *s = &definition->states[instances[i]->current];
+
+        if (s->on_update)
+            CallInstanceHook(s->on_update, instances[i], s->user_data, deferred_hooks);
+    }
+}
+
+static bool DependsOnVariable(const NBSM_Definition *definition, const NBSM_DefinitionState *state, unsigned int var)
+{
+    const unsigned int *dependencies = definition->dependencies + state->first_dependency;
+
+    for (unsigned int i = 0; i < state->dependency_count; i++)
+    {
+        if (dependencies[i] == var)
+            return true;
+    }
+
+    return false;
+}
+
+static void WakeInstance(NBSM_Instance *instance)
+{
+    if (instance->sleep_state == NBSM_ASLEEP)
+    {
+        NBSM_Scheduler *scheduler = instance->scheduler;
+
+        if (scheduler->active_count == scheduler->active_capacity)
+        {
+            scheduler->active_capacity = scheduler->active_capacity ? scheduler->active_capacity * 2 : 64;
+            scheduler->active = NBSM_Realloc(scheduler->active, sizeof(NBSM_Instance *) * scheduler->active_capacity);
+        }
+
+        instance->scheduler_slot = scheduler->active_count;
+        scheduler->active[scheduler->active_count++] = instance;
+    }
+
+    instance->sleep_state = NBSM_AWAKE;
+}
+
+static void WakeOnVariableChange(const NBSM_Definition *definition, NBSM_Instance *instance, unsigned int var)
+{
+    if (instance->sleep_state != NBSM_AWAKE && DependsOnVariable(definition, &definition->states[instance->current], var))
+        WakeInstance(instance);
+}
+
+static void GrowPopulation(NBSM_Population *population, unsigned int capacity)
+{
+    // round up the capacity so that the last block of the population can always be loaded entirely
+    capacity = (capacity + NBSM_POPULATION_BLOCK_SIZE - 1) / NBSM_POPULATION_BLOCK_SIZE * NBSM_POPULATION_BLOCK_SIZE;
+
+    if (capacity == 0)
+        capacity = NBSM_POPULATION_BLOCK_SIZE;
+
+    unsigned int variable_count = population->definition->variable_count;
+    NBSM_Variant *columns = NBSM_Alloc(sizeof(NBSM_Variant) * variable_count * capacity);
+
+    population->states = NBSM_Realloc(population->states, sizeof(unsigned int) * capacity);
+
+    memset(population->states + population->capacity, 0, sizeof(unsigned int) * (capacity - population->capacity));
+    memset(columns, 0, sizeof(NBSM_Variant) * variable_count * capacity);
+
+    for (unsigned int i = 0; i < variable_count && population->columns; i++)
+    {
+        memcpy(columns + i * capacity, population->columns + i * population->capacity, sizeof(NBSM_Variant) * population->count);
+    }
+
+    NBSM_Dealloc(population->columns);
+
+    population->columns = columns;
+    population->capacity = capacity;
+}
+
+static const PopulationKernels *GetPopulationKernels(void)
+{
+    if (population_kernels)
+        return population_kernels;
+
+    // the best kernels are looked up on each call rather than cached in a global shared by the threads
+    const PopulationKernels *best = FindPopulationKernels(NBSM_SIMD_AVX2);
+
+    if (!best)
+        best = FindPopulationKernels(NBSM_SIMD_SSE2);
+
+    return best ? best : &scalar_kernels;
+}
+
+static const PopulationKernels *FindPopulationKernels(NBSM_SIMDLevel level)
+{
+    switch (level)
+    {
+    case NBSM_SIMD_NONE:
+        return &scalar_kernels;
+
+#ifdef NBSM_SIMD_X86
+    case NBSM_SIMD_SSE2:
+        return &sse2_kernels;
+
+    case NBSM_SIMD_AVX2:
+        return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif // NBSM_SIMD_X86
+
+    default:
+        return NULL;
+    }
+}
+
+static unsigned int ScalarMatchState(const unsigned int *states, unsigned int state)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < NBSM_POPULATION_BLOCK_SIZE; i++)
+        mask |= (unsigned int)(states[i] == state) << i;
+
+    return mask;
+}
+
+static unsigned int ScalarCondition(
+    NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < NBSM_POPULATION_BLOCK_SIZE; i++)
+    {
+        NBSM_Variant l = left[i];
+        NBSM_Variant r = right ? right[i] : constant;
+        bool res = false;
+
+        // same semantic as the ConditionXXX functions, booleans are compared as integers
+        if (value_type == NBSM_FLOAT)
+        {
+            switch (type)
+            {
+            case NBSM_EQ: res = fabsf(l.f - r.f) < FLT_EPSILON; break;
+            case NBSM_NEQ: res = !(fabsf(l.f - r.f) < FLT_EPSILON); break;
+            case NBSM_LT:
+            case NBSM_LTE: res = l.f < r.f - FLT_EPSILON; break;
+            case NBSM_GT:
+            case NBSM_GTE: res = l.f > r.f + FLT_EPSILON; break;
+            }
+        }
+        else
+        {
+            switch (type)
+            {
+            case NBSM_EQ: res = l.i == r.i; break;
+            case NBSM_NEQ: res = l.i != r.i; break;
+            case NBSM_LT: res = l.i < r.i; break;
+            case NBSM_LTE: res = l.i <= r.i; break;
+            case NBSM_GT: res = l.i > r.i; break;
+            case NBSM_GTE: res = l.i >= r.i; break;
+            }
+        }
+
+        mask |= (unsigned int)res << i;
+    }
+
+    return mask;
+}
+
+#ifdef NBSM_SIMD_X86
+
+static unsigned int SSE2MatchState(const unsigned int *states, unsigned int state)
+{
+    __m128i s = _mm_set1_epi32(state);
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)states), s);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(states + 4)), s);
+
+    return _mm_movemask_ps(_mm_castsi128_ps(lo)) | (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+}
+
+static unsigned int SSE2Compare(NBSM_ConditionType type, NBSM_ValueType value_type, __m128i l, __m128i r)
+{
+    if (value_type == NBSM_FLOAT)
+    {
+        __m128 lf = _mm_castsi128_ps(l);
+        __m128 rf = _mm_castsi128_ps(r);
+        __m128 eps = _mm_set1_ps(FLT_EPSILON);
+
+        switch (type)
+        {
+        case NBSM_EQ:
+        case NBSM_NEQ:
+        {
+            __m128 diff = _mm_andnot_ps(_mm_set1_ps(-0.f), _mm_sub_ps(lf, rf));
+            unsigned int eq = _mm_movemask_ps(_mm_cmplt_ps(diff, eps));
+
+            return type == NBSM_EQ ? eq : ~eq & 0xF;
+        }
+
+        case NBSM_LT:
+        case NBSM_LTE:
+            return _mm_movemask_ps(_mm_cmplt_ps(lf, _mm_sub_ps(rf, eps)));
+
+        case NBSM_GT:
+        case NBSM_GTE:
+            return _mm_movemask_ps(_mm_cmpgt_ps(lf, _mm_add_ps(rf, eps)));
+        }
+
+        return 0;
+    }
+
+    switch (type)
+    {
+    case NBSM_EQ: return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(l, r)));
+    case NBSM_NEQ: return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(l, r))) & 0xF;
+    case NBSM_LT: return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(l, r)));
+    case NBSM_LTE: return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(l, r))) & 0xF;
+    case NBSM_GT: return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(l, r)));
+    case NBSM_GTE: return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(l, r))) & 0xF;
+    }
+
+    return 0;
+}
+
+static unsigned int SSE2Condition(
+    NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant)
+{
+    __m128i c = _mm_set1_epi32(constant.i);
+    __m128i l_lo = _mm_loadu_si128((const __m128i *)left);
+    __m128i l_hi = _mm_loadu_si128((const __m128i *)(left + 4));
+    __m128i r_lo = right ? _mm_loadu_si128((const __m128i *)right) : c;
+    __m128i r_hi = right ? _mm_loadu_si128((const __m128i *)(right + 4)) : c;
+
+    return SSE2Compare(type, value_type, l_lo, r_lo) | (SSE2Compare(type, value_type, l_hi, r_hi) << 4);
+}
+
+__attribute__((target("avx2")))
+static unsigned int AVX2MatchState(const unsigned int *states, unsigned int state)
+{
+    __m256i s = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)states), _mm256_set1_epi32(state));
+
+    return _mm256_movemask_ps(_mm256_castsi256_ps(s));
+}
+
+__attribute__((target("avx2")))
+static unsigned int AVX2Condition(
+    NBSM_ConditionType type, NBSM_ValueType value_type, const NBSM_Variant *left, const NBSM_Variant *right, NBSM_Variant constant)
+{
+    __m256i l = _mm256_loadu_si256((const __m256i *)left);
+    __m256i r = right ? _mm256_loadu_si256((const __m256i *)right) : _mm256_set1_epi32(constant.i);
+
+    if (value_type == NBSM_FLOAT)
+    {
+        __m256 lf = _mm256_castsi256_ps(l);
+        __m256 rf = _mm256_castsi256_ps(r);
+        __m256 eps = _mm256_set1_ps(FLT_EPSILON);
+
+        switch (type)
+        {
+        case NBSM_EQ:
+        case NBSM_NEQ:
+        {
+            __m256 diff = _mm256_andnot_ps(_mm256_set1_ps(-0.f), _mm256_sub_ps(lf, rf));
+            unsigned int eq = _mm256_movemask_ps(_mm256_cmp_ps(diff, eps, _CMP_LT_OQ));
+
+            return type == NBSM_EQ ? eq : ~eq & 0xFF;
+        }
+
+        case NBSM_LT:
+        case NBSM_LTE:
+            return _mm256_movemask_ps(_mm256_cmp_ps(lf, _mm256_sub_ps(rf, eps), _CMP_LT_OQ));
+
+        case NBSM_GT:
+        case NBSM_GTE:
+            return _mm256_movemask_ps(_mm256_cmp_ps(lf, _mm256_add_ps(rf, eps), _CMP_GT_OQ));
+        }
+
+        return 0;
+    }
+
+    switch (type)
+    {
+    case NBSM_EQ: return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(l, r)));
+    case NBSM_NEQ: return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(l, r))) & 0xFF;
+    case NBSM_LT: return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(r, l)));
+    case NBSM_LTE: return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(l, r))) & 0xFF;
+    case NBSM_GT: return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(l, r)));
+    case NBSM_GTE: return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(r, l))) & 0xFF;
+    }
+
+    return 0;
+}
+
+#endif // NBSM_SIMD_X86
+
+static void WriteIdentifier(FILE *out, const char *str)
+{
+    if (*str >= '0' && *str <= '9')
+        fputc('_', out);
+
+    for (; *str; str++)
+        fputc(GetIdentifierChar(*str), out);
+}
+
+static char GetIdentifierChar(char c)
+{
+    bool is_valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+
+    return is_valid ? c : '_';
+}
+
+// Identifiers are written as is except for invalid characters, so check that no two names end up with the same one
+static bool CheckGeneratedIdentifiers(NBSM_MachineBuilder *builder)
+{
+    // state identifiers share their prefix with the other generated symbols
+    static const char *reserved_states[] = { "STATE_COUNT", "State", "Init", "GetStateName", "Update" };
+
+    // variable identifiers are struct fields
+    static const char *reserved_variables[] = {
+        "state", "auto", "bool", "break", "case", "char", "const", "continue", "default", "do", "double", "else",
+        "enum", "extern", "false", "float", "for", "goto", "if", "inline", "int", "long", "register", "restrict",
+        "return", "short", "signed", "sizeof", "static", "struct", "switch", "true", "typedef", "union", "unsigned",
+        "void", "volatile", "while", "_Bool" };
+
+    unsigned int reserved_state_count = sizeof(reserved_states) / sizeof(reserved_states[0]);
+    unsigned int reserved_variable_count = sizeof(reserved_variables) / sizeof(reserved_variables[0]);
+    NBSM_HTable *states = CreateHTableForCount(&default_allocator, builder->state_count + reserved_state_count);
+    NBSM_HTable *variables = CreateHTableForCount(&default_allocator, builder->variable_count + reserved_variable_count);
+    bool is_valid = true;
+
+    for (unsigned int i = 0; i < reserved_state_count; i++)
+        AddGeneratedIdentifier(states, reserved_states[i]);
+
+    for (unsigned int i = 0; i < reserved_variable_count; i++)
+        AddGeneratedIdentifier(variables, reserved_variables[i]);
+
+    for (unsigned int i = 0; i < builder->state_count && is_valid; i++)
+        is_valid = AddGeneratedIdentifier(states, builder->states[i].name);
+
+    for (unsigned int i = 0; i < builder->variable_count && is_valid; i++)
+        is_valid = AddGeneratedIdentifier(variables, builder->variables[i].name);
+
+    DestroyHTable(states, false, NULL, true);
+    DestroyHTable(variables, false, NULL, true);
+
+    return is_valid;
+}
+
+static bool AddGeneratedIdentifier(NBSM_HTable *identifiers, const char *str)
+{
+    size_t length = strlen(str);
+    char *identifier = NBSM_Alloc(length + 2);
+    char *c = identifier;
+
+    // same transformation as WriteIdentifier
+    if (*str >= '0' && *str <= '9')
+        *c++ = '_';
+
+    for (; *str; str++)
+        *c++ = GetIdentifierChar(*str);
+
+    *c = '\0';
+
+    if (DoesEntryExist(identifiers, identifier))
+    {
+        NBSM_Dealloc(identifier);
+
+        return false;
+    }
+
+    AddToHTable(identifiers, identifier, identifier);
+
+    return true;
+}
+
+static void WriteGeneratedState(FILE *out, const char *name, const char *state_name)
+{
+    fprintf(out, "%s_", name);
+    WriteIdentifier(out, state_name);
+}
+
+static void WriteGeneratedValue(FILE *out, NBSM_Value value)
+{
+    if (value.type == NBSM_INTEGER)
+    {
+        fprintf(out, "%d", value.value.i);
+    }
+    else if (value.type == NBSM_FLOAT && isnan(value.value.f))
+    {
+        fprintf(out, "NAN");
+    }
+    else if (value.type == NBSM_FLOAT && isinf(value.value.f))
+    {
+        fprintf(out, value.value.f > 0 ? "INFINITY" : "-INFINITY");
+    }
+    else if (value.type == NBSM_FLOAT)
+    {
+        char str[64];
+
+        snprintf(str, sizeof(str), "%.9g", value.value.f);
+
+        // make sure it is written as a float literal
+        fprintf(out, strpbrk(str, ".e") ? "%sf" : "%s.f", str);
+    }
+    else
+    {
+        fprintf(out, value.value.b ? "true" : "false");
+    }
+}
+
+static void WriteGeneratedCondition(FILE *out, NBSM_MachineBuilder *builder, NBSM_ConditionBlueprint *condition)
+{
+    static const char *operators[] = { "==", "!=", "<", "<=", ">", ">=" };
+    const char *op = operators[condition->type];
+    const char *prefix = "";
+    const char *suffix = "";
+    NBSM_ValueType type = NBSM_INTEGER;
+
+    for (unsigned int i = 0; i < builder->variable_count; i++)
+    {
+        if (strcmp(builder->variables[i].name, condition->var_name) == 0)
+            type = builder->variables[i].type;
+    }
+
+    // same semantics as the conditions evaluated by NBSM_Update
+    if (type == NBSM_FLOAT)
+    {
+        switch (condition->type)
+        {
+        case NBSM_EQ:
+            prefix = "fabsf(";
+            op = "-";
+            suffix = ") < FLT_EPSILON";
+            break;
+
+        case NBSM_NEQ:
+            prefix = "!(fabsf(";
+            op = "-";
+            suffix = ") < FLT_EPSILON)";
+            break;
+
+        case NBSM_LT:
+        case NBSM_LTE:
+            op = "<";
+            suffix = " - FLT_EPSILON";
+            break;
+
+        case NBSM_GT:
+        case NBSM_GTE:
+            op = ">";
+            suffix = " + FLT_EPSILON";
+            break;
+        }
+    }
+
+    fprintf(out, "(%sm->", prefix);
+    WriteIdentifier(out, condition->var_name);
+    fprintf(out, " %s ", op);
+
+    if (condition->right_op.type == NBSM_OPERAND_CONST)
+    {
+        WriteGeneratedValue(out, condition->right_op.data.constant);
+    }
+    else
+    {
+        fprintf(out, "m->");
+        WriteIdentifier(out, condition->right_op.data.var_name);
+    }
+
+    fprintf(out, "%s)", suffix);
+}
+
+#ifdef NBSM_PARALLEL
+
+static void *RunWorker(void *data)
+{
+    NBSM_Worker *worker = data;
+    NBSM_WorkerPool *pool = worker->pool;
+    unsigned int job_id = 0;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->mutex);
+
+        while (pool->job_id == job_id && !pool->quit)
+            pthread_cond_wait(&pool->job_cond, &pool->mutex);
+
+        job_id = pool->job_id;
+
+        bool quit = pool->quit;
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (quit)
+            break;
+
+        pool->job(worker);
+
+        pthread_mutex_lock(&pool->mutex);
+
+        if (--pool->running_count == 0)
+            pthread_cond_signal(&pool->done_cond);
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+static void RunWorkerJob(NBSM_WorkerPool *pool, void (*job)(NBSM_Worker *worker))
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    pool->job = job;
+    pool->running_count = pool->worker_count - 1;
+    pool->job_id++;
+
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    job(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (pool->running_count > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#ifdef NBSM_POSIX
+
+static void LoadBuildersJob(NBSM_Worker *worker)
+{
+    NBSM_WorkerPool *pool = worker->pool;
+    NBSM_BuilderRegistry *registry = pool->registry;
+    unsigned int index;
+
+    // files differ in size, so they are handed out one at a time
+    while ((index = __atomic_fetch_add(&pool->next_file, 1, __ATOMIC_RELAXED)) < registry->count)
+        LoadBuilderFile(registry, pool->directory, index);
+}
+
+#endif // NBSM_POSIX
+
+static void ProcessChunks(NBSM_Worker *worker)
+{
+    NBSM_WorkerPool *pool = worker->pool;
+    size_t scratch_size = GetBatchScratchSize(pool->definition, NBSM_PARALLEL_CHUNK_SIZE);
+    NBSM_DeferredHooks *deferred_hooks = (pool->flags & NBSM_PARALLEL_RUN_HOOKS_ON_WORKERS) ? NULL : &worker->deferred_hooks;
+    unsigned int chunk;
+
+    if (worker->scratch_size < scratch_size)
+    {
+        worker->scratch = NBSM_Realloc(worker->scratch, scratch_size);
+        worker->scratch_size = scratch_size;
+    }
+
+    // process our own chunks first, then steal from the other workers until there is nothing left
+
+    for (unsigned int i = 0; i < pool->worker_count; i++)
+    {
+        NBSM_Worker *victim = &pool->workers[(worker->index + i) % pool->worker_count];
+
+        while (TakeChunk(victim, victim == worker, &chunk))
+        {
+            unsigned int first = chunk * NBSM_PARALLEL_CHUNK_SIZE;
+            unsigned int count = pool->count - first < NBSM_PARALLEL_CHUNK_SIZE ? pool->count - first : NBSM_PARALLEL_CHUNK_SIZE;
+
+            UpdateBatch(pool->definition, pool->instances + first, count, worker->scratch, deferred_hooks);
+        }
+    }
+}
+
+static bool TakeChunk(NBSM_Worker *worker, bool is_owner, unsigned int *chunk)
+{
+    uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+
+    while (true)
+    {
+        uint64_t begin = range >> 32;
+        uint64_t end = range & 0xFFFFFFFF;
+
+        if (begin >= end)
+            return false;
+
+        uint64_t new_range = is_owner ? ((begin + 1) << 32) | end : (begin << 32) | (end - 1);
+
+        if (__atomic_compare_exchange_n(&worker->range, &range, new_range, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *chunk = is_owner ? begin : end - 1;
+
+            return true;
+        }
+    }
+}
+
+static NBSM_PoolSlot *GetPoolSlot(NBSM_ConcurrentPool *pool, uint32_t index)
+{
+    // slab k starts at index base * (2^k - 1)
+    uint32_t q = index / pool->base_slab_capacity + 1;
+    unsigned int slab = 31 - __builtin_clz(q);
+    uint32_t first = pool->base_slab_capacity * ((1u << slab) - 1);
+    char *slab_ptr = __atomic_load_n(&pool->slabs[slab], __ATOMIC_ACQUIRE);
+
+    return (NBSM_PoolSlot *)(slab_ptr + pool->slot_size * (index - first));
+}
+
+static NBSM_Machine *GetPoolSlotMachine(NBSM_PoolSlot *slot)
+{
+    return (NBSM_Machine *)((char *)slot + NBSM_POOL_SLOT_HEADER_SIZE);
+}
+
+static NBSM_PoolSlot *GetMachinePoolSlot(NBSM_Machine *machine)
+{
+    return (NBSM_PoolSlot *)((char *)machine - NBSM_POOL_SLOT_HEADER_SIZE);
+}
+
+static NBSM_PoolSlot *PopPoolSlot(NBSM_ConcurrentPool *pool)
+{
+    uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+
+    for (;;)
+    {
+        uint32_t index = (uint32_t)head;
+
+        if (index == 0)
+            return NULL;
+
+        // the slot may be popped and pushed back by another thread meanwhile, in which case "next" is stale
+        // but the tag has changed and the exchange fails
+        NBSM_PoolSlot *slot = GetPoolSlot(pool, index - 1);
+        uint32_t next = __atomic_load_n(&slot->next, __ATOMIC_RELAXED);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+
+        if (__atomic_compare_exchange_n(&pool->free_head, &head, new_head, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return slot;
+    }
+}
+
+// push a chain of slots linked through their "next" field, from first to last
+static void PushPoolSlots(NBSM_ConcurrentPool *pool, NBSM_PoolSlot *first, NBSM_PoolSlot *last)
+{
+    uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+
+    do
+    {
+        __atomic_store_n(&last->next, (uint32_t)head, __ATOMIC_RELAXED);
+
+        new_head = (((head >> 32) + 1) << 32) | (first->index + 1);
+    } while (!__atomic_compare_exchange_n(&pool->free_head, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void PushMachinesToConcurrentPool(NBSM_ConcurrentPool *pool, NBSM_Machine **machines, unsigned int count)
+{
+    if (count == 0)
+        return;
+
+    for (unsigned int i = 0; i + 1 < count; i++)
+    {
+        uint32_t next = GetMachinePoolSlot(machines[i + 1])->index + 1;
+
+        __atomic_store_n(&GetMachinePoolSlot(machines[i])->next, next, __ATOMIC_RELAXED);
+    }
+
+    PushPoolSlots(pool, GetMachinePoolSlot(machines[0]), GetMachinePoolSlot(machines[count - 1]));
+}
+
+// allocate a new slab and push its slots to the free list, does nothing if another thread is already growing the pool
+static void GrowConcurrentPool(NBSM_ConcurrentPool *pool)
+{
+    bool is_growing = false;
+
+    if (!__atomic_compare_exchange_n(&pool->is_growing, &is_growing, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    unsigned int slab = pool->slab_count;
+
+    NBSM_Assert(slab < NBSM_CONCURRENT_POOL_MAX_SLABS);
+
+    uint32_t first = pool->base_slab_capacity * ((1u << slab) - 1);
+    uint64_t capacity = (uint64_t)pool->base_slab_capacity << slab;
+
+    NBSM_Assert(first + capacity < UINT32_MAX);
+
+    char *slab_ptr = Allocate(&pool->allocator, pool->slot_size * capacity);
+
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        NBSM_PoolSlot *slot = (NBSM_PoolSlot *)(slab_ptr + pool->slot_size * i);
+
+        slot->index = first + i;
+        slot->next = first + i + 2;
+
+        CloneMachine(pool->prototype, GetPoolSlotMachine(slot), pool->prototype->names_offset);
+    }
+
+    // the slab must be visible before any of its slots can be popped
+    __atomic_store_n(&pool->slabs[slab], slab_ptr, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->slab_count, slab + 1, __ATOMIC_RELEASE);
+
+    PushPoolSlots(pool, (NBSM_PoolSlot *)slab_ptr, (NBSM_PoolSlot *)(slab_ptr + pool->slot_size * (capacity - 1)));
+
+    __atomic_store_n(&pool->is_growing, false, __ATOMIC_RELEASE);
+}
+
+#endif // NBSM_PARALLEL
+
+#ifdef NBSM_JSON_BUILDER
+
+static void LoadVariablesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *var_arr)
+{
+    builder->variable_count = var_arr->length;
+    builder->variables = Allocate(&builder->allocator, sizeof(NBSM_VariableBlueprint) * builder->variable_count);
+
+    struct json_array_element_s *arr_node = var_arr->start;
+
+    int i = 0;
+
+    while (arr_node)
+    {
+        NBSM_Assert(arr_node->value->type == json_type_object);
+
+        struct json_object_s *var_obj = arr_node->value->payload;
+        struct json_object_element_s *var_node = var_obj->start;
+        NBSM_VariableBlueprint *var = &builder->variables[i];
+        struct json_value_s *default_value = NULL;
+
+        memset(&var->default_value, 0, sizeof(var->default_value));
+
+        while (var_node)
+        {
+            if (strcmp(var_node->name->string, "name") == 0)
+            {
+                NBSM_Assert(var_node->value->type == json_type_string);
+
+                var->name = InternString(builder->string_pool, ((struct json_string_s *)var_node->value->payload)->string);
+            }
+            else if (strcmp(var_node->name->string, "type") == 0)
+            {
+                NBSM_Assert(var_node->value->type == json_type_string);
+
+                var->type = GetVariableTypeFromJSON(((struct json_string_s *)var_node->value->payload)->string);
+
+                NBSM_Assert(var->type != NBSM_UNKNOWN_VALUE_TYPE);
+            }
+            else if (strcmp(var_node->name->string, "default") == 0)
+            {
+                // the type may come after the default value
+                default_value = var_node->value;
+            }
+
+            var_node = var_node->next;
+        }
+
+        if (default_value)
+            var->default_value = LoadValueFromJSON(var->type, default_value);
+
+        arr_node = arr_node->next;
+        i++;
+    }
+}
+
+static void LoadStatesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *state_arr)
+{
+    builder->state_count = state_arr->length;
+    builder->states = Allocate(&builder->allocator, sizeof(NBSM_StateBlueprint) * builder->state_count);
+
+    struct json_array_element_s *arr_node = state_arr->start;
+
+    int i = 0;
+
+    while (arr_node)
+    {
+        NBSM_Assert(arr_node->value->type == json_type_object);
+
+        struct json_object_s *state_obj = arr_node->value->payload;
+        struct json_object_element_s *state_node = state_obj->start;
+        NBSM_StateBlueprint *state = &builder->states[i];
+
+        while (state_node)
+        {
+            if (strcmp(state_node->name->string, "name") == 0)
+            {
+                NBSM_Assert(state_node->value->type == json_type_string);
+
+                state->name = InternString(builder->string_pool, ((struct json_string_s *)state_node->value->payload)->string);
+            }
+            else if (strcmp(state_node->name->string, "is_initial") == 0)
+            {
+                NBSM_Assert(state_node->value->type == json_type_true || state_node->value->type == json_type_false);
+
+                state->is_initial = state_node->value->type == json_type_true;
+            }
+
+            state_node = state_node->next;
+        }
+
+        arr_node = arr_node->next;
+        i++;
+    }
+}
+
+static void LoadTransitionsFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *trans_arr)
+{
+    builder->transition_count = trans_arr->length;
+    builder->transitions = Allocate(&builder->allocator, sizeof(NBSM_TransitionBlueprint) * builder->transition_count);
+
+    struct json_array_element_s *arr_node = trans_arr->start;
+
+    int i = 0;
+
+    while (arr_node)
+    {
+        NBSM_Assert(arr_node->value->type == json_type_object);
+
+        struct json_object_s *trans_obj = arr_node->value->payload;
+        struct json_object_element_s *trans_node = trans_obj->start;
+        NBSM_TransitionBlueprint *transition = &builder->transitions[i];
+
+        transition->condition_count = 0;
+        transition->conditions = NULL;
+
+        while (trans_node)
+        {
+            if (strcmp(trans_node->name->string, "source") == 0)
+            {
+                NBSM_Assert(trans_node->value->type == json_type_string);
+
+                transition->from = InternString(builder->string_pool, ((struct json_string_s *)trans_node->value->payload)->string);
+            }
+            else if (strcmp(trans_node->name->string, "target") == 0)
+            {
+                NBSM_Assert(trans_node->value->type == json_type_string);
+
+                transition->to = InternString(builder->string_pool, ((struct json_string_s *)trans_node->value->payload)->string);
+            }
+            else if (strcmp(trans_node->name->string, "conditions") == 0)
+            {
+                NBSM_Assert(trans_node->value->type == json_type_array);
+
+                LoadConditionsFromJSON(builder, transition, i, trans_node->value->payload);
+            }
+
+            trans_node = trans_node->next;
+        }
+
+        arr_node = arr_node->next;
+        i++;
+    }
+}
+
+static void LoadConditionsFromJSON(
+    NBSM_MachineBuilder *builder, NBSM_TransitionBlueprint *transition, unsigned int trans_idx, struct json_array_s *cond_arr)
+{
+    transition->condition_count = cond_arr->length;
+    transition->conditions = Allocate(&builder->allocator, sizeof(NBSM_ConditionBlueprint) * transition->condition_count);
+
+    struct json_array_element_s *arr_node = cond_arr->start;
+    int i = 0;
 
     while (arr_node)
     {
-        NBSM_Assert(arr_node->value->type == json_type_object);
+        NBSM_Assert(arr_node->value->type == json_type_object);
+
+        struct json_object_s *cond_obj = arr_node->value->payload;
+        struct json_object_element_s *cond_node = cond_obj->start;
+        NBSM_ConditionBlueprint *cond = &transition->conditions[i];
+
+        cond->transition_idx = trans_idx;
+
+        while (cond_node)
+        {
+            if (strcmp(cond_node->name->string, "type") == 0)
+            {
+                NBSM_Assert(cond_node->value->type == json_type_string);
+
+                cond->type = GetConditionTypeFromJSON(((struct json_string_s *)cond_node->value->payload)->string);
+
+                NBSM_Assert(cond->type != NBSM_UNKNOWN_CONDITION_TYPE);
+            }
+            else if (strcmp(cond_node->name->string, "left_op") == 0)
+            {
+                NBSM_Assert(cond_node->value->type == json_type_string);
+
+                cond->var_name = InternString(builder->string_pool, ((struct json_string_s *)cond_node->value->payload)->string);
+            }
+            else if (strcmp(cond_node->name->string, "right_op") == 0)
+            {
+                NBSM_Assert(cond_node->value->type == json_type_object);
+
+                cond->right_op = LoadConditionOperandFromJSON(builder, cond_node->value->payload);
+            }
+
+            cond_node = cond_node->next;
+        }
+
+        arr_node = arr_node->next;
+        i++;
+    }
+}
+
+static NBSM_ConditionOperandBlueprint LoadConditionOperandFromJSON(NBSM_MachineBuilder *builder, struct json_object_s *op_obj)
+{
+    struct json_object_element_s *op_node = op_obj->start;
+    NBSM_ConditionOperandBlueprint op = { .type = -1 };
+
+    while (op_node)
+    {
+        if (strcmp(op_node->name->string, "type") == 0)
+        {
+            NBSM_Assert(op_node->value->type == json_type_string);
+
+            const char *op_type_str = ((struct json_string_s *)op_node->value->payload)->string;
+
+            if (strcmp(op_type_str, "const") == 0)
+                op.type = NBSM_OPERAND_CONST;
+            else if (strcmp(op_type_str, "var") == 0)
+                op.type = NBSM_OPERAND_VAR;
+
+            NBSM_Assert(op.type >= 0);
+        }
+        else if (strcmp(op_node->name->string, "const") == 0)
+        {
+            NBSM_Assert(op_node->value->type == json_type_object);
+            NBSM_Assert(op.type == NBSM_OPERAND_CONST);
+
+            struct json_object_element_s *const_node = ((struct json_object_s *)op_node->value->payload)->start;
+
+            while (const_node)
+            {
+                if (strcmp(const_node->name->string, "type") == 0)
+                {
+                    NBSM_Assert(const_node->value->type == json_type_string);
+
+                    op.data.constant.type =
+                        GetVariableTypeFromJSON(((struct json_string_s *)const_node->value->payload)->string);
+                }
+                else if (strcmp(const_node->name->string, "value") == 0)
+                {
+                    op.data.constant.value = LoadValueFromJSON(op.data.constant.type, const_node->value);
+                }
+
+                const_node = const_node->next;
+            }
+        }
+        else if (strcmp(op_node->name->string, "var") == 0)
+        {
+            NBSM_Assert(op_node->value->type == json_type_string);
+            NBSM_Assert(op.type == NBSM_OPERAND_VAR);
+
+            op.data.var_name = InternString(builder->string_pool, ((struct json_string_s *)op_node->value->payload)->string);
+        }
+
+        op_node = op_node->next;
+    }
+
+    return op;
+}
+
+static NBSM_Variant LoadValueFromJSON(NBSM_ValueType type, struct json_value_s *value)
+{
+    NBSM_Variant v = { 0 };
+
+    if (value->type == json_type_number)
+    {
+        const char *val_str = ((struct json_number_s *)value->payload)->number;
+
+        if (type == NBSM_INTEGER)
+            v.i = atoi(val_str);
+        else if (type == NBSM_FLOAT)
+            v.f = atof(val_str);
+        else
+            NBSM_Assert(false);
+    }
+    else
+    {
+        NBSM_Assert(type == NBSM_BOOLEAN && (value->type == json_type_true || value->type == json_type_false));
 
-        struct json_object_s *var_obj = arr_node->value->payload;
-        struct json_object_element_s *var_node = var_obj->start;
-        NBSM_VariableBlueprint *var = &builder->variables[i];
+        v.b = value->type == json_type_true;
+    }
 
-        while (var_node)
+    return v;
+}
+
+#endif // NBSM_JSON_BUILDER
+
+static NBSM_MachineBuilder *CreateEmptyBuilder(const NBSM_Allocator *allocator)
+{
+    NBSM_MachineBuilder *builder = Allocate(allocator, sizeof(NBSM_MachineBuilder));
+
+    builder->state_count = 0;
+    builder->states = NULL;
+
+    builder->variable_count = 0;
+    builder->variables = NULL;
+
+    builder->transition_count = 0;
+    builder->transitions = NULL;
+
+    builder->free_strings = false;
+    builder->allocator = *allocator;
+    builder->string_pool = CreateStringPool(allocator);
+    builder->is_packed = false;
+    builder->mapping = NULL;
+    builder->mapping_size = 0;
+
+    return builder;
+}
+
+// The capacity must start at the current number of blueprints: a key can appear more than once in a document, in which
+// case the blueprints of each occurrence are appended to the same array
+static void *GrowBlueprints(
+    const NBSM_Allocator *allocator, void *blueprints, size_t size, unsigned int count, unsigned int *capacity)
+{
+    if (count < *capacity)
+        return blueprints;
+
+    *capacity = *capacity > 0 ? *capacity * 2 : 8;
+
+    if (!blueprints)
+        return Allocate(allocator, size * *capacity);
+
+    return Reallocate(allocator, blueprints, size * *capacity);
+}
+
+static void StreamVariablesFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream)
+{
+    unsigned int capacity = builder->variable_count;
+    bool is_first = true;
+
+    ExpectJSONChar(stream, '[');
+
+    while (NextJSONElement(stream, &is_first))
+    {
+        builder->variables = GrowBlueprints(
+            &builder->allocator, builder->variables, sizeof(NBSM_VariableBlueprint), builder->variable_count, &capacity);
+
+        NBSM_VariableBlueprint *var = &builder->variables[builder->variable_count++];
+        char default_value[NBSM_JSON_SCALAR_SIZE] = { 0 }; // the type may come after the default value
+        bool is_first_key = true;
+        char *key;
+
+        var->name = NULL;
+        var->type = NBSM_INTEGER;
+        memset(&var->default_value, 0, sizeof(var->default_value));
+
+        ExpectJSONChar(stream, '{');
+
+        while ((key = NextJSONKey(stream, &is_first_key)))
         {
-            if (strcmp(var_node->name->string, "name") == 0)
+            if (strcmp(key, "name") == 0)
             {
-                NBSM_Assert(var_node->value->type == json_type_string);
+                var->name = InternString(builder->string_pool, ReadJSONString(stream));
+            }
+            else if (strcmp(key, "type") == 0)
+            {
+                var->type = GetVariableTypeFromJSON(ReadJSONString(stream));
+
+                CheckJSONStream(stream, var->type <= NBSM_BOOLEAN);
+            }
+            else if (strcmp(key, "default") == 0)
+            {
+                ReadJSONScalar(stream, default_value);
+            }
+            else
+            {
+                SkipJSONValue(stream);
+            }
+        }
+
+        CheckJSONStream(stream, var->name != NULL);
+
+        if (default_value[0])
+            var->default_value = ScalarToVariant(stream, var->type, default_value);
+    }
+}
+
+static void StreamStatesFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream)
+{
+    unsigned int capacity = builder->state_count;
+    bool is_first = true;
+
+    ExpectJSONChar(stream, '[');
+
+    while (NextJSONElement(stream, &is_first))
+    {
+        builder->states = GrowBlueprints(
+            &builder->allocator, builder->states, sizeof(NBSM_StateBlueprint), builder->state_count, &capacity);
+
+        NBSM_StateBlueprint *state = &builder->states[builder->state_count++];
+        bool is_first_key = true;
+        char *key;
+
+        state->name = NULL;
+        state->is_initial = false;
+
+        ExpectJSONChar(stream, '{');
+
+        while ((key = NextJSONKey(stream, &is_first_key)))
+        {
+            if (strcmp(key, "name") == 0)
+                state->name = InternString(builder->string_pool, ReadJSONString(stream));
+            else if (strcmp(key, "is_initial") == 0)
+                state->is_initial = ReadJSONBoolean(stream);
+            else
+                SkipJSONValue(stream);
+        }
+
+        CheckJSONStream(stream, state->name != NULL);
+    }
+}
+
+static void StreamTransitionsFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream)
+{
+    unsigned int capacity = builder->transition_count;
+    bool is_first = true;
+
+    ExpectJSONChar(stream, '[');
+
+    while (NextJSONElement(stream, &is_first))
+    {
+        builder->transitions = GrowBlueprints(
+            &builder->allocator, builder->transitions, sizeof(NBSM_TransitionBlueprint), builder->transition_count, &capacity);
+
+        unsigned int i = builder->transition_count++;
+        NBSM_TransitionBlueprint *transition = &builder->transitions[i];
+        bool is_first_key = true;
+        char *key;
+
+        transition->from = NULL;
+        transition->to = NULL;
+        transition->condition_count = 0;
+        transition->conditions = NULL;
+
+        ExpectJSONChar(stream, '{');
+
+        while ((key = NextJSONKey(stream, &is_first_key)))
+        {
+            if (strcmp(key, "source") == 0)
+                transition->from = InternString(builder->string_pool, ReadJSONString(stream));
+            else if (strcmp(key, "target") == 0)
+                transition->to = InternString(builder->string_pool, ReadJSONString(stream));
+            else if (strcmp(key, "conditions") == 0)
+                StreamConditionsFromJSON(builder, transition, i, stream);
+            else
+                SkipJSONValue(stream);
+        }
+
+        CheckJSONStream(stream, transition->from && transition->to);
+    }
+}
+
+static void StreamConditionsFromJSON(
+    NBSM_MachineBuilder *builder, NBSM_TransitionBlueprint *transition, unsigned int trans_idx, JSONStream *stream)
+{
+    unsigned int capacity = transition->condition_count;
+    bool is_first = true;
+
+    ExpectJSONChar(stream, '[');
+
+    while (NextJSONElement(stream, &is_first))
+    {
+        transition->conditions = GrowBlueprints(
+            &builder->allocator, transition->conditions, sizeof(NBSM_ConditionBlueprint), transition->condition_count, &capacity);
+
+        NBSM_ConditionBlueprint *cond = &transition->conditions[transition->condition_count++];
+        bool is_first_key = true;
+        char *key;
+
+        bool has_right_op = false;
+
+        cond->transition_idx = trans_idx;
+        cond->type = NBSM_UNKNOWN_CONDITION_TYPE;
+        cond->var_name = NULL;
+        cond->right_op.type = NBSM_OPERAND_CONST;
+        cond->right_op.data.var_name = NULL;
+
+        ExpectJSONChar(stream, '{');
+
+        while ((key = NextJSONKey(stream, &is_first_key)))
+        {
+            if (strcmp(key, "type") == 0)
+            {
+                cond->type = GetConditionTypeFromJSON(ReadJSONString(stream));
+            }
+            else if (strcmp(key, "left_op") == 0)
+            {
+                cond->var_name = InternString(builder->string_pool, ReadJSONString(stream));
+            }
+            else if (strcmp(key, "right_op") == 0)
+            {
+                cond->right_op = StreamConditionOperandFromJSON(builder, stream);
+                has_right_op = true;
+            }
+            else
+            {
+                SkipJSONValue(stream);
+            }
+        }
+
+        CheckJSONStream(stream, cond->type <= NBSM_GTE && cond->var_name != NULL && has_right_op);
+    }
+}
+
+static NBSM_ConditionOperandBlueprint StreamConditionOperandFromJSON(NBSM_MachineBuilder *builder, JSONStream *stream)
+{
+    NBSM_ConditionOperandBlueprint op = { .type = NBSM_UNKNOWN_OPERAND_TYPE };
+    bool has_constant = false;
+    bool is_first = true;
+    char *key;
+
+    ExpectJSONChar(stream, '{');
+
+    while ((key = NextJSONKey(stream, &is_first)))
+    {
+        if (strcmp(key, "type") == 0)
+        {
+            const char *op_type_str = ReadJSONString(stream);
+
+            if (strcmp(op_type_str, "const") == 0)
+                op.type = NBSM_OPERAND_CONST;
+            else if (strcmp(op_type_str, "var") == 0)
+                op.type = NBSM_OPERAND_VAR;
+
+            CheckJSONStream(stream, op.type != NBSM_UNKNOWN_OPERAND_TYPE);
+        }
+        else if (strcmp(key, "const") == 0)
+        {
+            CheckJSONStream(stream, op.type == NBSM_OPERAND_CONST);
+
+            char value[NBSM_JSON_SCALAR_SIZE] = { 0 }; // the type may come after the value
+            bool is_first_const_key = true;
+            char *const_key;
+
+            op.data.constant.type = NBSM_UNKNOWN_VALUE_TYPE;
+            op.data.constant.dirty = false;
+            has_constant = true;
+
+            ExpectJSONChar(stream, '{');
+
+            while ((const_key = NextJSONKey(stream, &is_first_const_key)))
+            {
+                if (strcmp(const_key, "type") == 0)
+                    op.data.constant.type = GetVariableTypeFromJSON(ReadJSONString(stream));
+                else if (strcmp(const_key, "value") == 0)
+                    ReadJSONScalar(stream, value);
+                else
+                    SkipJSONValue(stream);
+            }
+
+            if (CheckJSONStream(stream, op.data.constant.type <= NBSM_BOOLEAN && value[0]))
+                op.data.constant.value = ScalarToVariant(stream, op.data.constant.type, value);
+        }
+        else if (strcmp(key, "var") == 0)
+        {
+            CheckJSONStream(stream, op.type == NBSM_OPERAND_VAR);
+
+            op.data.var_name = InternString(builder->string_pool, ReadJSONString(stream));
+        }
+        else
+        {
+            SkipJSONValue(stream);
+        }
+    }
+
+    if (op.type == NBSM_OPERAND_CONST)
+        CheckJSONStream(stream, has_constant);
+    else
+        CheckJSONStream(stream, op.type == NBSM_OPERAND_VAR && op.data.var_name != NULL);
+
+    return op;
+}
+
+static NBSM_Variant ScalarToVariant(JSONStream *stream, NBSM_ValueType type, const char *scalar)
+{
+    NBSM_Variant v = { 0 };
+
+    if (type == NBSM_BOOLEAN)
+    {
+        CheckJSONStream(stream, strcmp(scalar, "true") == 0 || strcmp(scalar, "false") == 0);
+
+        v.b = strcmp(scalar, "true") == 0;
+    }
+    else
+    {
+        CheckJSONStream(stream, strcmp(scalar, "true") != 0 && strcmp(scalar, "false") != 0);
+
+        if (type == NBSM_INTEGER)
+            v.i = atoi(scalar);
+        else
+            v.f = atof(scalar);
+    }
+
+    return v;
+}
+
+static NBSM_ValueType GetVariableTypeFromJSON(const char *type_str)
+{
+    if (strcmp(type_str, "int") == 0)
+        return NBSM_INTEGER;
+
+    if (strcmp(type_str, "float") == 0)
+        return NBSM_FLOAT;
+
+    if (strcmp(type_str, "bool") == 0)
+        return NBSM_BOOLEAN;
+
+    return NBSM_UNKNOWN_VALUE_TYPE;
+}
+
+static NBSM_ConditionType GetConditionTypeFromJSON(const char *type_str)
+{
+    if (strcmp(type_str, "eq") == 0)
+        return NBSM_EQ;
+
+    if (strcmp(type_str, "neq") == 0)
+        return NBSM_NEQ;
+
+    if (strcmp(type_str, "lt") == 0)
+        return NBSM_LT;
+
+    if (strcmp(type_str, "lte") == 0)
+        return NBSM_LTE;
+
+    if (strcmp(type_str, "gt") == 0)
+        return NBSM_GT;
+
+    if (strcmp(type_str, "gte") == 0)
+        return NBSM_GTE;
+
+    return NBSM_UNKNOWN_CONDITION_TYPE;
+}
+
+// Flag the stream as invalid if the condition does not hold, returns the condition
+static bool CheckJSONStream(JSONStream *stream, bool condition)
+{
+    if (!condition)
+        stream->has_error = true;
+
+    return condition;
+}
+
+static int PeekJSONChar(JSONStream *stream)
+{
+    if (stream->has_error)
+        return EOF;
+
+    if (stream->position == stream->length)
+    {
+        if (stream->is_eof)
+            return EOF;
+
+        stream->length = stream->read(stream->user_data, stream->buffer, sizeof(stream->buffer));
+        stream->position = 0;
+
+        if (stream->length == 0)
+        {
+            stream->is_eof = true;
+
+            return EOF;
+        }
+    }
+
+    return (unsigned char)stream->buffer[stream->position];
+}
+
+static int ReadJSONChar(JSONStream *stream)
+{
+    int c = PeekJSONChar(stream);
+
+    if (c != EOF)
+        stream->position++;
+
+    return c;
+}
 
-                var->name = strdup(((struct json_string_s *)var_node->value->payload)->string);
-            }
-            else if (strcmp(var_node->name->string, "type") == 0)
-            {
-                NBSM_Assert(var_node->value->type == json_type_string);
+static int SkipJSONWhitespace(JSONStream *stream)
+{
+    int c = PeekJSONChar(stream);
 
-                var->type = GetVariableTypeFromJSON(((struct json_string_s *)var_node->value->payload)->string);
+    while (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    {
+        stream->position++;
+        c = PeekJSONChar(stream);
+    }
 
-                NBSM_Assert(var->type >= 0);
-            }
+    return c;
+}
 
-            var_node = var_node->next;
-        }
+static void ExpectJSONChar(JSONStream *stream, char expected)
+{
+    if (CheckJSONStream(stream, SkipJSONWhitespace(stream) == expected))
+        stream->position++;
+}
 
-        arr_node = arr_node->next;
-        i++;
+static void PushJSONTokenChar(JSONStream *stream, char c)
+{
+    // keep room for the terminating null character
+    if (stream->token_length + 1 == stream->token_capacity)
+    {
+        stream->token_capacity *= 2;
+        stream->token = Reallocate(stream->allocator, stream->token, stream->token_capacity);
     }
+
+    stream->token[stream->token_length++] = c;
 }
 
-static void LoadStatesFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *state_arr)
+static char *ReadJSONString(JSONStream *stream)
 {
-    builder->state_count = state_arr->length;
-    builder->states = NBSM_Alloc(sizeof(NBSM_StateBlueprint) * builder->state_count);
+    ExpectJSONChar(stream, '"');
 
-    struct json_array_element_s *arr_node = state_arr->start;
+    stream->token_length = 0;
 
-    int i = 0;
+    int c;
 
-    while (arr_node)
+    while ((c = ReadJSONChar(stream)) != '"')
     {
-        NBSM_Assert(arr_node->value->type == json_type_object);
-
-        struct json_object_s *state_obj = arr_node->value->payload;
-        struct json_object_element_s *state_node = state_obj->start;
-        NBSM_StateBlueprint *state = &builder->states[i];
+        if (!CheckJSONStream(stream, c != EOF))
+            break;
 
-        while (state_node)
+        if (c == '\\')
         {
-            if (strcmp(state_node->name->string, "name") == 0)
-            {
-                NBSM_Assert(state_node->value->type == json_type_string);
+            c = ReadJSONChar(stream);
 
-                state->name = strdup(((struct json_string_s *)state_node->value->payload)->string);
-            }
-            else if (strcmp(state_node->name->string, "is_initial") == 0)
+            switch (c)
             {
-                NBSM_Assert(state_node->value->type == json_type_true || state_node->value->type == json_type_false);
-
-                state->is_initial = state_node->value->type == json_type_true;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': ReadJSONUnicodeEscape(stream); continue;
+            default: CheckJSONStream(stream, c == '"' || c == '\\' || c == '/');
             }
-
-            state_node = state_node->next;
         }
 
-        arr_node = arr_node->next;
-        i++;
+        PushJSONTokenChar(stream, c);
     }
+
+    stream->token[stream->token_length] = 0;
+
+    return stream->token;
 }
 
-static void LoadTransitionsFromJSON(NBSM_MachineBuilder *builder, struct json_array_s *trans_arr)
+static void ReadJSONUnicodeEscape(JSONStream *stream)
 {
-    builder->transition_count = trans_arr->length;
-    builder->transitions = NBSM_Alloc(sizeof(NBSM_TransitionBlueprint) * builder->transition_count);
+    unsigned int code_point = ReadJSONHex(stream);
 
-    struct json_array_element_s *arr_node = trans_arr->start;
+    // surrogate pair
+    if (code_point >= 0xD800 && code_point <= 0xDBFF)
+    {
+        CheckJSONStream(stream, ReadJSONChar(stream) == '\\' && ReadJSONChar(stream) == 'u');
 
-    int i = 0;
+        unsigned int low = ReadJSONHex(stream);
 
-    while (arr_node)
-    {
-        NBSM_Assert(arr_node->value->type == json_type_object);
+        if (!CheckJSONStream(stream, low >= 0xDC00 && low <= 0xDFFF))
+            return;
 
-        struct json_object_s *trans_obj = arr_node->value->payload;
-        struct json_object_element_s *trans_node = trans_obj->start;
-        NBSM_TransitionBlueprint *transition = &builder->transitions[i];
+        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+    }
 
-        transition->condition_count = 0;
-        transition->conditions = NULL;
+    // UTF-8 encoding
+    if (code_point < 0x80)
+    {
+        PushJSONTokenChar(stream, code_point);
+    }
+    else if (code_point < 0x800)
+    {
+        PushJSONTokenChar(stream, 0xC0 | (code_point >> 6));
+        PushJSONTokenChar(stream, 0x80 | (code_point & 0x3F));
+    }
+    else if (code_point < 0x10000)
+    {
+        PushJSONTokenChar(stream, 0xE0 | (code_point >> 12));
+        PushJSONTokenChar(stream, 0x80 | ((code_point >> 6) & 0x3F));
+        PushJSONTokenChar(stream, 0x80 | (code_point & 0x3F));
+    }
+    else
+    {
+        PushJSONTokenChar(stream, 0xF0 | (code_point >> 18));
+        PushJSONTokenChar(stream, 0x80 | ((code_point >> 12) & 0x3F));
+        PushJSONTokenChar(stream, 0x80 | ((code_point >> 6) & 0x3F));
+        PushJSONTokenChar(stream, 0x80 | (code_point & 0x3F));
+    }
+}
 
-        while (trans_node)
-        {
-            if (strcmp(trans_node->name->string, "source") == 0)
-            {
-                NBSM_Assert(trans_node->value->type == json_type_string);
+static unsigned int ReadJSONHex(JSONStream *stream)
+{
+    unsigned int value = 0;
 
-                transition->from = strdup(((struct json_string_s *)trans_node->value->payload)->string);
-            }
-            else if (strcmp(trans_node->name->string, "target") == 0)
-            {
-                NBSM_Assert(trans_node->value->type == json_type_string);
+    for (int i = 0; i < 4; i++)
+    {
+        int c = ReadJSONChar(stream);
+
+        if (c >= '0' && c <= '9')
+            value = (value << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            value = (value << 4) | (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            value = (value << 4) | (c - 'A' + 10);
+        else
+            CheckJSONStream(stream, false);
+    }
 
-                transition->to = strdup(((struct json_string_s *)trans_node->value->payload)->string);
-            }
-            else if (strcmp(trans_node->name->string, "conditions") == 0)
-            {
-                NBSM_Assert(trans_node->value->type == json_type_array);
+    return value;
+}
 
-                LoadConditionsFromJSON(transition, i, trans_node->value->payload);
-            }
+static char *ReadJSONNumber(JSONStream *stream)
+{
+    int c = SkipJSONWhitespace(stream);
 
-            trans_node = trans_node->next;
-        }
+    stream->token_length = 0;
 
-        arr_node = arr_node->next;
-        i++;
+    while (c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' || (c >= '0' && c <= '9'))
+    {
+        PushJSONTokenChar(stream, c);
+
+        stream->position++;
+        c = PeekJSONChar(stream);
     }
+
+    CheckJSONStream(stream, stream->token_length > 0);
+
+    stream->token[stream->token_length] = 0;
+
+    return stream->token;
 }
 
-static void LoadConditionsFromJSON(NBSM_TransitionBlueprint *transition, unsigned int trans_idx, struct json_array_s *cond_arr)
+static void ReadJSONLiteral(JSONStream *stream, const char *literal)
 {
-    transition->condition_count = cond_arr->length;
-    transition->conditions = NBSM_Alloc(sizeof(NBSM_ConditionBlueprint) * transition->condition_count);
+    SkipJSONWhitespace(stream);
 
-    struct json_array_element_s *arr_node = cond_arr->start;
-    int i = 0;
+    for (const char *c = literal; *c; c++)
+        CheckJSONStream(stream, ReadJSONChar(stream) == *c);
+}
 
-    while (arr_node)
+static bool ReadJSONBoolean(JSONStream *stream)
+{
+    if (SkipJSONWhitespace(stream) == 't')
     {
-        NBSM_Assert(arr_node->value->type == json_type_object);
+        ReadJSONLiteral(stream, "true");
 
-        struct json_object_s *cond_obj = arr_node->value->payload;
-        struct json_object_element_s *cond_node = cond_obj->start;
-        NBSM_ConditionBlueprint *cond = &transition->conditions[i];
+        return true;
+    }
 
-        cond->transition_idx = trans_idx;
+    ReadJSONLiteral(stream, "false");
 
-        while (cond_node)
-        {
-            if (strcmp(cond_node->name->string, "type") == 0)
-            {
-                NBSM_Assert(cond_node->value->type == json_type_string);
+    return false;
+}
 
-                cond->type = GetConditionTypeFromJSON(((struct json_string_s *)cond_node->value->payload)->string);
+// Read a number or a boolean as text, it is converted once the type of the value is known
+static void ReadJSONScalar(JSONStream *stream, char *scalar)
+{
+    int c = SkipJSONWhitespace(stream);
 
-                NBSM_Assert(cond->type >= 0);
-            }
-            else if (strcmp(cond_node->name->string, "left_op") == 0)
-            {
-                NBSM_Assert(cond_node->value->type == json_type_string);
+    if (c == 't' || c == 'f')
+    {
+        strcpy(scalar, ReadJSONBoolean(stream) ? "true" : "false");
+    }
+    else
+    {
+        ReadJSONNumber(stream);
 
-                cond->var_name = strdup(((struct json_string_s *)cond_node->value->payload)->string);
-            }
-            else if (strcmp(cond_node->name->string, "right_op") == 0)
-            {
-                NBSM_Assert(cond_node->value->type == json_type_object);
+        if (CheckJSONStream(stream, stream->token_length < NBSM_JSON_SCALAR_SIZE))
+            memcpy(scalar, stream->token, stream->token_length + 1);
+    }
+}
 
-                cond->right_op = LoadConditionOperandFromJSON(cond_node->value->payload);
-            }
+static void SkipJSONValue(JSONStream *stream)
+{
+    int c = SkipJSONWhitespace(stream);
+    bool is_first = true;
 
-            cond_node = cond_node->next;
+    if (c == '{' || c == '[')
+    {
+        // bound the recursion so that deeply nested values cannot overflow the stack
+        if (!CheckJSONStream(stream, stream->depth < NBSM_JSON_MAX_DEPTH))
+            return;
+
+        stream->position++;
+        stream->depth++;
+
+        if (c == '{')
+        {
+            while (NextJSONKey(stream, &is_first))
+                SkipJSONValue(stream);
+        }
+        else
+        {
+            while (NextJSONElement(stream, &is_first))
+                SkipJSONValue(stream);
         }
 
-        arr_node = arr_node->next;
-        i++;
+        stream->depth--;
+    }
+    else if (c == '"')
+    {
+        ReadJSONString(stream);
+    }
+    else if (c == 't' || c == 'f')
+    {
+        ReadJSONBoolean(stream);
+    }
+    else if (c == 'n')
+    {
+        ReadJSONLiteral(stream, "null");
+    }
+    else
+    {
+        ReadJSONNumber(stream);
     }
 }
 
-static NBSM_ConditionOperandBlueprint LoadConditionOperandFromJSON(struct json_object_s *op_obj)
+// Returns the key of the next member of the current object (its value is read next) or NULL at the end of the object
+static char *NextJSONKey(JSONStream *stream, bool *is_first)
 {
-    struct json_object_element_s *op_node = op_obj->start;
-    NBSM_ConditionOperandBlueprint op = { .type = -1 };
+    if (SkipJSONWhitespace(stream) == '}')
+    {
+        stream->position++;
 
-    while (op_node)
+        return NULL;
+    }
+
+    if (!*is_first)
+        ExpectJSONChar(stream, ',');
+
+    *is_first = false;
+
+    char *key = ReadJSONString(stream);
+
+    ExpectJSONChar(stream, ':');
+
+    return stream->has_error ? NULL : key;
+}
+
+// Returns false at the end of the current array, the next element is read otherwise
+static bool NextJSONElement(JSONStream *stream, bool *is_first)
+{
+    if (SkipJSONWhitespace(stream) == ']')
     {
-        if (strcmp(op_node->name->string, "type") == 0)
-        {
-            NBSM_Assert(op_node->value->type == json_type_string);
+        stream->position++;
 
-            const char *op_type_str = ((struct json_string_s *)op_node->value->payload)->string;
+        return false;
+    }
 
-            if (strcmp(op_type_str, "const") == 0)
-                op.type = NBSM_OPERAND_CONST;
-            else if (strcmp(op_type_str, "var") == 0)
-                op.type = NBSM_OPERAND_VAR;
+    if (!*is_first)
+        ExpectJSONChar(stream, ',');
 
-            NBSM_Assert(op.type >= 0);
-        }
-        else if (strcmp(op_node->name->string, "const") == 0)
-        {
-            NBSM_Assert(op_node->value->type == json_type_object);
-            NBSM_Assert(op.type == NBSM_OPERAND_CONST);
+    *is_first = false;
 
-            struct json_object_element_s *const_node = ((struct json_object_s *)op_node->value->payload)->start;
+    return !stream->has_error;
+}
 
-            while (const_node)
-            {
-                if (strcmp(const_node->name->string, "type") == 0)
-                {
-                    NBSM_Assert(const_node->value->type == json_type_string);
+#ifdef NBSM_POSIX
 
-                    op.data.constant.type =
-                        GetVariableTypeFromJSON(((struct json_string_s *)const_node->value->payload)->string);
-                }
-                else if (strcmp(const_node->name->string, "value") == 0)
-                {
-                    if (const_node->value->type == json_type_number)
-                    {
-                        NBSM_Assert(op.data.constant.type == NBSM_INTEGER || op.data.constant.type == NBSM_FLOAT);
+static size_t ReadJSONFromFd(void *user_data, char *buffer, size_t size)
+{
+    ssize_t length;
 
-                        const char *val_str = ((struct json_number_s *)const_node->value->payload)->number;
+    do
+    {
+        length = read(*(int *)user_data, buffer, size);
+    } while (length < 0 && errno == EINTR);
 
-                        if (op.data.constant.type == NBSM_INTEGER)
-                            op.data.constant.value.i = atoi(val_str);
-                        else if (op.data.constant.type == NBSM_FLOAT)
-                            op.data.constant.value.f = atof(val_str);
-                    }
-                    else if (const_node->value->type == json_type_true)
-                    {
-                        NBSM_Assert(op.data.constant.type == NBSM_BOOLEAN);
+    // read errors end the stream
+    return length > 0 ? (size_t)length : 0;
+}
 
-                        op.data.constant.value.b = true;
-                    }
-                    else if (const_node->value->type == json_type_false)
-                    {
-                        NBSM_Assert(op.data.constant.type == NBSM_BOOLEAN);
+static NBSM_BuilderRegistry *ListBuilderFiles(const char *path)
+{
+    DIR *dir = opendir(path);
 
-                        op.data.constant.value.b = false;
-                    }
-                }
+    if (!dir)
+        return NULL;
 
-                const_node = const_node->next;
-            }
-        }
-        else if (strcmp(op_node->name->string, "var") == 0)
-        {
-            NBSM_Assert(op_node->value->type == json_type_string);
-            NBSM_Assert(op.type == NBSM_OPERAND_VAR);
+    NBSM_BuilderRegistry *registry = NBSM_Alloc(sizeof(NBSM_BuilderRegistry));
+    unsigned int capacity = 0;
+    struct dirent *entry;
+
+    registry->names = NULL;
+    registry->count = 0;
+
+    while ((entry = readdir(dir)))
+    {
+        size_t length = strlen(entry->d_name);
+
+        if (length <= 5 || strcmp(entry->d_name + length - 5, ".json") != 0)
+            continue;
 
-            op.data.var_name = ((struct json_string_s *)op_node->value->payload)->string;
+        if (registry->count == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            registry->names = NBSM_Realloc(registry->names, sizeof(char *) * capacity);
         }
 
-        op_node = op_node->next;
+        char *name = NBSM_Alloc(length - 4);
+
+        memcpy(name, entry->d_name, length - 5);
+        name[length - 5] = 0;
+
+        registry->names[registry->count++] = name;
     }
 
-    return op;
+    closedir(dir);
+
+    // the order of the directory entries is unspecified
+    if (registry->count > 0)
+        qsort(registry->names, registry->count, sizeof(char *), CompareBuilderNames);
+
+    registry->builders = NBSM_Alloc(sizeof(NBSM_MachineBuilder *) * (registry->count > 0 ? registry->count : 1));
+    registry->builders_by_name = NULL;
+
+    return registry;
 }
 
-static NBSM_ValueType GetVariableTypeFromJSON(const char *type_str)
+static void LoadBuilderFile(NBSM_BuilderRegistry *registry, const char *directory, unsigned int index)
 {
-    if (strcmp(type_str, "int") == 0)
-        return NBSM_INTEGER;
-
-    if (strcmp(type_str, "float") == 0)
-        return NBSM_FLOAT;
+    const char *name = registry->names[index];
+    size_t directory_length = strlen(directory);
+    size_t name_length = strlen(name);
+    char *path = NBSM_Alloc(directory_length + name_length + 7);
+
+    memcpy(path, directory, directory_length);
+    path[directory_length] = '/';
+    memcpy(path + directory_length + 1, name, name_length);
+    memcpy(path + directory_length + 1 + name_length, ".json", 6);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    // entries that are not regular files (a directory named "x.json" for instance) and invalid JSON files are dropped
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        registry->builders[index] = NBSM_CreateBuilderFromJSONFd(fd);
+    else
+        registry->builders[index] = NULL;
 
-    if (strcmp(type_str, "bool") == 0)
-        return NBSM_BOOLEAN;
+    if (fd >= 0)
+        close(fd);
 
-    return -1;
+    NBSM_Dealloc(path);
 }
 
-static NBSM_ConditionType GetConditionTypeFromJSON(const char *type_str)
+static void IndexBuilderRegistry(NBSM_BuilderRegistry *registry)
 {
-    if (strcmp(type_str, "eq") == 0)
-        return NBSM_EQ;
+    unsigned int count = 0;
 
-    if (strcmp(type_str, "neq") == 0)
-        return NBSM_NEQ;
-
-    if (strcmp(type_str, "lt") == 0)
-        return NBSM_LT;
+    // drop the files that could not be loaded
 
-    if (strcmp(type_str, "lte") == 0)
-        return NBSM_LTE;
+    for (unsigned int i = 0; i < registry->count; i++)
+    {
+        if (registry->builders[i])
+        {
+            registry->names[count] = registry->names[i];
+            registry->builders[count] = registry->builders[i];
+            count++;
+        }
+        else
+        {
+            NBSM_Dealloc(registry->names[i]);
+        }
+    }
 
-    if (strcmp(type_str, "gt") == 0)
-        return NBSM_GT;
+    registry->count = count;
+    registry->builders_by_name = CreateHTableForCount(&default_allocator, count);
 
-    if (strcmp(type_str, "gte") == 0)
-        return NBSM_GTE;
+    for (unsigned int i = 0; i < count; i++)
+        AddToHTable(registry->builders_by_name, registry->names[i], registry->builders[i]);
+}
 
-    return -1;
+static int CompareBuilderNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-#endif // NBSM_JSON_BUILDER
+#endif // NBSM_POSIX
 
 #pragma endregion // State machine
 
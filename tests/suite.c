@@ -1,5 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
+
 #define NBSM_IMPL
 #define NBSM_JSON_BUILDER
+#define NBSM_PARALLEL
 
 #include <stdio.h>
 
@@ -80,10 +83,10 @@ void TestPooledMachine(CuTest *tc, NBSM_Machine *m)
 void TestPooling(CuTest *tc)
 {
     char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
 
     free(json);
 
-    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
     NBSM_MachinePool *pool = NBSM_CreatePool(builder, 2);
 
     NBSM_Machine *m1 = NBSM_GetFromPool(pool);
@@ -139,181 +142,2030 @@ void TestPooling(CuTest *tc)
     NBSM_DestroyBuilder(builder);
 }
 
-void TestLoadJSON(CuTest *tc)
-{ 
+static int enter_count;
+static int exit_count;
+
+static void OnInstanceEnter(NBSM_Instance *instance, void *user_data)
+{
+    (void)instance;
+    (void)user_data;
+
+    __atomic_fetch_add(&enter_count, 1, __ATOMIC_RELAXED); // called from worker threads by TestUpdateParallel
+}
+
+static void OnInstanceExit(NBSM_Instance *instance, void *user_data)
+{
+    (void)instance;
+    (void)user_data;
+
+    __atomic_fetch_add(&exit_count, 1, __ATOMIC_RELAXED);
+}
+
+void TestDefinition(CuTest *tc)
+{
     char *json = ReadTestJSON();
     NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
 
     free(json);
 
-    NBSM_Machine *m = NBSM_Build(builder);
+    NBSM_Definition *def = NBSM_CreateDefinition(builder);
 
-    NBSM_Value *v1 = NBSM_GetVariable(m, "v1");
-    NBSM_Value *v2 = NBSM_GetVariable(m, "v2");
-    NBSM_Value *v3 = NBSM_GetVariable(m, "v3");
-    NBSM_Value *v4 = NBSM_GetVariable(m, "v4");
+    NBSM_DestroyBuilder(builder); // the definition does not depend on the builder
 
-    CuAssertTrue(tc, v1->type == NBSM_INTEGER);
-    CuAssertTrue(tc, v2->type == NBSM_FLOAT);
-    CuAssertTrue(tc, v3->type == NBSM_BOOLEAN);
-    CuAssertTrue(tc, v4->type == NBSM_FLOAT);
+    NBSM_OnDefinitionStateEnter(def, "bar", OnInstanceEnter);
+    NBSM_OnDefinitionStateExit(def, "bar", OnInstanceExit);
 
-    CuAssertIntEquals(tc, 0, NBSM_GetInteger(v1));
-    CuAssertTrue(tc, NBSM_GetFloat(v2) == 0);
-    CuAssertTrue(tc, !NBSM_GetBoolean(v3));
-    CuAssertTrue(tc, NBSM_GetFloat(v4) == 0);
+    NBSM_Instance *i1 = NBSM_CreateInstance(def);
+    NBSM_Instance *i2 = NBSM_CreateInstance(def);
 
-    CuAssertStrEquals(tc, "foo", m->current->name);
+    unsigned int v1 = NBSM_GetVariableIndex(def, "v1");
+    unsigned int v2 = NBSM_GetVariableIndex(def, "v2");
+    unsigned int v3 = NBSM_GetVariableIndex(def, "v3");
 
-    NBSM_Update(m);
+    enter_count = 0;
+    exit_count = 0;
 
-    CuAssertStrEquals(tc, "foo", m->current->name);
+    CuAssertStrEquals(tc, "foo", NBSM_GetInstanceState(def, i1));
+    CuAssertStrEquals(tc, "foo", NBSM_GetInstanceState(def, i2));
 
-    NBSM_SetInteger(v1, 42);
-    NBSM_Update(m);
+    NBSM_SetInstanceInteger(def, i1, v1, 42);
+    NBSM_UpdateInstance(def, i1);
+    NBSM_UpdateInstance(def, i2);
 
-    CuAssertStrEquals(tc, "bar", m->current->name);
+    CuAssertStrEquals(tc, "bar", NBSM_GetInstanceState(def, i1));
+    CuAssertStrEquals(tc, "foo", NBSM_GetInstanceState(def, i2));
+    CuAssertIntEquals(tc, 0, NBSM_GetInstanceInteger(def, i2, v1));
+    CuAssertIntEquals(tc, 1, enter_count);
 
-    NBSM_SetFloat(v2, 100.f);
-    NBSM_SetBoolean(v3, true);
-    NBSM_Update(m);
+    NBSM_SetInstanceFloat(def, i1, v2, 100.625f);
+    NBSM_SetInstanceBoolean(def, i1, v3, true);
+    NBSM_UpdateInstance(def, i1);
 
-    CuAssertStrEquals(tc, "bar", m->current->name);
+    CuAssertStrEquals(tc, "plop", NBSM_GetInstanceState(def, i1));
+    CuAssertIntEquals(tc, 1, exit_count);
 
-    NBSM_SetFloat(v2, 100.625f);
-    NBSM_Update(m);
+    // "v2" < "v4" (variable operand)
+    NBSM_SetInstanceFloat(def, i2, v2, -12.f);
+    NBSM_UpdateInstance(def, i2);
 
-    CuAssertStrEquals(tc, "plop", m->current->name);
+    CuAssertStrEquals(tc, "toto", NBSM_GetInstanceState(def, i2));
 
-    NBSM_SetInteger(v1, 30);
-    NBSM_SetBoolean(v3, false);
-    NBSM_Update(m);
+    NBSM_ChangeInstanceState(def, i2, "bar");
+    NBSM_ResetInstance(def, i1);
 
-    CuAssertStrEquals(tc, "foo", m->current->name);
+    CuAssertStrEquals(tc, "bar", NBSM_GetInstanceState(def, i2));
+    CuAssertStrEquals(tc, "foo", NBSM_GetInstanceState(def, i1));
+    CuAssertIntEquals(tc, 2, enter_count);
 
-    NBSM_SetFloat(v2, -12.f);
-    NBSM_Update(m);
+    NBSM_DestroyInstance(i1);
+    NBSM_DestroyInstance(i2);
+    NBSM_DestroyDefinition(def);
+}
 
-    CuAssertStrEquals(tc, "toto", m->current->name);
+static NBSM_Definition *CreateTestDefinition(void)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    NBSM_Definition *def = NBSM_CreateDefinition(builder);
 
-    NBSM_Destroy(m, true);
+    free(json);
     NBSM_DestroyBuilder(builder);
+
+    return def;
 }
 
-void TestTransitionConditions(CuTest *tc)
+static void RandomizeInstance(const NBSM_Definition *def, NBSM_Instance *instance, unsigned int *seed)
 {
-    NBSM_Machine *m = NBSM_Create();
+    // values picked around the constants of the test machine so that all transitions are taken
+    static const int ints[] = { 0, 30, 42, 50 };
+    static const float floats[] = { -20.f, 0.f, 100.f, 100.625f };
 
-    NBSM_Value *v1 = NBSM_AddInteger(m, "v1");
-    NBSM_Value *v2 = NBSM_AddFloat(m, "v2");
-    NBSM_Value *v3 = NBSM_AddBoolean(m, "v3");
-    NBSM_Value *v4 = NBSM_AddFloat(m, "v4");
+    *seed = *seed * 1103515245 + 12345;
 
-    NBSM_SetFloat(v4, -10.150f);
+    NBSM_SetInstanceInteger(def, instance, NBSM_GetVariableIndex(def, "v1"), ints[(*seed >> 8) % 4]);
+    NBSM_SetInstanceFloat(def, instance, NBSM_GetVariableIndex(def, "v2"), floats[(*seed >> 12) % 4]);
+    NBSM_SetInstanceBoolean(def, instance, NBSM_GetVariableIndex(def, "v3"), (*seed >> 16) % 2);
+    NBSM_SetInstanceFloat(def, instance, NBSM_GetVariableIndex(def, "v4"), floats[(*seed >> 20) % 4]);
+}
 
-    NBSM_AddState(m, "foo", true);
-    NBSM_AddState(m, "bar", false);
-    NBSM_AddState(m, "plop", false);
-    NBSM_AddState(m, "toto", false);
+void TestUpdateBatch(CuTest *tc)
+{
+    NBSM_Definition *def = CreateTestDefinition();
+    NBSM_Instance *batch[64];
+    NBSM_Instance *single[64];
+    unsigned int seed = 42;
+    int total_enter_count = 0;
 
-    NBSM_Transition *t1 = NBSM_AddTransition(m, "foo", "bar");
-    NBSM_Transition *t2 = NBSM_AddTransition(m, "bar", "plop");
-    NBSM_Transition *t3 = NBSM_AddTransition(m, "plop", "foo");
-    NBSM_Transition *t4 = NBSM_AddTransition(m, "foo", "toto");
+    NBSM_OnDefinitionStateEnter(def, "bar", OnInstanceEnter);
+    NBSM_OnDefinitionStateExit(def, "bar", OnInstanceExit);
 
-    NBSM_AddCondition(m, t1, "v1", NBSM_EQ, NBSM_CONST_I(42));
-    NBSM_AddCondition(m, t2, "v2", NBSM_GT, NBSM_CONST_F(100));
-    NBSM_AddCondition(m, t2, "v3", NBSM_EQ, NBSM_TRUE);
-    NBSM_AddCondition(m, t3, "v3", NBSM_EQ, NBSM_FALSE);
-    NBSM_AddCondition(m, t3, "v1", NBSM_LT, NBSM_CONST_I(42));
-    NBSM_AddCondition(m, t4, "v2", NBSM_LT, NBSM_VAR(m, "v4"));
+    for (int i = 0; i < 64; i++)
+    {
+        batch[i] = NBSM_CreateInstance(def);
+        single[i] = NBSM_CreateInstance(def);
+    }
 
-    CuAssertStrEquals(tc, "foo", m->current->name);
+    for (int tick = 0; tick < 20; tick++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            unsigned int s = seed;
 
-    NBSM_Update(m);
+            RandomizeInstance(def, batch[i], &s);
+            RandomizeInstance(def, single[i], &seed);
+        }
 
-    CuAssertStrEquals(tc, "foo", m->current->name);
+        enter_count = 0;
+        exit_count = 0;
 
-    NBSM_SetInteger(v1, 42);
-    NBSM_Update(m);
+        for (int i = 0; i < 64; i++)
+            NBSM_UpdateInstance(def, single[i]);
 
-    CuAssertStrEquals(tc, "bar", m->current->name);
+        int single_enter_count = enter_count;
+        int single_exit_count = exit_count;
 
-    NBSM_SetFloat(v2, 100.f);
-    NBSM_SetBoolean(v3, true);
-    NBSM_Update(m);
+        enter_count = 0;
+        exit_count = 0;
 
-    CuAssertStrEquals(tc, "bar", m->current->name);
+        NBSM_UpdateBatch(def, batch, 64);
 
-    NBSM_SetFloat(v2, 100.5f);
-    NBSM_Update(m);
+        CuAssertIntEquals(tc, single_enter_count, enter_count);
+        CuAssertIntEquals(tc, single_exit_count, exit_count);
 
-    CuAssertStrEquals(tc, "plop", m->current->name);
+        total_enter_count += enter_count;
 
-    NBSM_SetInteger(v1, 30);
-    NBSM_SetBoolean(v3, false);
-    NBSM_Update(m);
+        for (int i = 0; i < 64; i++)
+            CuAssertIntEquals(tc, single[i]->current, batch[i]->current);
+    }
 
-    CuAssertStrEquals(tc, "foo", m->current->name);
+    CuAssertTrue(tc, total_enter_count > 0);
 
-    NBSM_SetFloat(v2, -12.f);
-    NBSM_Update(m);
+    for (int i = 0; i < 64; i++)
+    {
+        NBSM_DestroyInstance(batch[i]);
+        NBSM_DestroyInstance(single[i]);
+    }
 
-    CuAssertStrEquals(tc, "toto", m->current->name);
+    NBSM_DestroyDefinition(def);
+}
 
-    NBSM_Destroy(m, false);
+#define PARALLEL_INSTANCE_COUNT 10000
+
+void TestUpdateParallel(CuTest *tc)
+{
+    NBSM_Definition *def = CreateTestDefinition();
+    NBSM_WorkerPool *pool = NBSM_CreateWorkerPool(4);
+    NBSM_Instance **parallel = malloc(sizeof(NBSM_Instance *) * PARALLEL_INSTANCE_COUNT);
+    NBSM_Instance **single = malloc(sizeof(NBSM_Instance *) * PARALLEL_INSTANCE_COUNT);
+    unsigned int seed = 1337;
+
+    NBSM_OnDefinitionStateEnter(def, "bar", OnInstanceEnter);
+    NBSM_OnDefinitionStateExit(def, "bar", OnInstanceExit);
+
+    for (int i = 0; i < PARALLEL_INSTANCE_COUNT; i++)
+    {
+        parallel[i] = NBSM_CreateInstance(def);
+        single[i] = NBSM_CreateInstance(def);
+    }
+
+    for (int tick = 0; tick < 10; tick++)
+    {
+        for (int i = 0; i < PARALLEL_INSTANCE_COUNT; i++)
+        {
+            unsigned int s = seed;
+
+            RandomizeInstance(def, parallel[i], &s);
+            RandomizeInstance(def, single[i], &seed);
+        }
+
+        enter_count = 0;
+        exit_count = 0;
+
+        NBSM_UpdateBatch(def, single, PARALLEL_INSTANCE_COUNT);
+
+        int single_enter_count = enter_count;
+        int single_exit_count = exit_count;
+
+        enter_count = 0;
+        exit_count = 0;
+
+        // alternate between deferred hooks and hooks called from the worker threads
+        NBSM_UpdateParallel(pool, def, parallel, PARALLEL_INSTANCE_COUNT, tick % 2 ? NBSM_PARALLEL_RUN_HOOKS_ON_WORKERS : 0);
+
+        CuAssertIntEquals(tc, single_enter_count, enter_count);
+        CuAssertIntEquals(tc, single_exit_count, exit_count);
+
+        for (int i = 0; i < PARALLEL_INSTANCE_COUNT; i++)
+            CuAssertIntEquals(tc, single[i]->current, parallel[i]->current);
+    }
+
+    for (int i = 0; i < PARALLEL_INSTANCE_COUNT; i++)
+    {
+        NBSM_DestroyInstance(parallel[i]);
+        NBSM_DestroyInstance(single[i]);
+    }
+
+    free(parallel);
+    free(single);
+    NBSM_DestroyWorkerPool(pool);
+    NBSM_DestroyDefinition(def);
 }
 
-void TestGetAndSetVariables(CuTest *tc)
+void TestScheduler(CuTest *tc)
 {
-    NBSM_Machine *m = NBSM_Create();
+    NBSM_Definition *def = CreateTestDefinition();
+    NBSM_Scheduler *scheduler = NBSM_CreateScheduler(def);
+    NBSM_Instance *scheduled[128];
+    NBSM_Instance *single[128];
+    unsigned int seed = 7;
+    unsigned int v1 = NBSM_GetVariableIndex(def, "v1");
+    unsigned int v3 = NBSM_GetVariableIndex(def, "v3");
 
-    NBSM_Value *v1 = NBSM_AddInteger(m, "foo");
-    NBSM_Value *v2 = NBSM_AddFloat(m, "bar");
-    NBSM_Value *v3 = NBSM_AddBoolean(m, "plop");
+    for (int i = 0; i < 128; i++)
+    {
+        scheduled[i] = NBSM_CreateInstance(def);
+        single[i] = NBSM_CreateInstance(def);
 
-    CuAssertTrue(tc, v1->type == NBSM_INTEGER);
-    CuAssertTrue(tc, v2->type == NBSM_FLOAT);
-    CuAssertTrue(tc, v3->type == NBSM_BOOLEAN);
+        NBSM_AddToScheduler(scheduler, scheduled[i]);
+    }
 
-    CuAssertIntEquals(tc, 0, NBSM_GetInteger(v1));
-    CuAssertTrue(tc, NBSM_GetFloat(v2) == 0);
-    CuAssertTrue(tc, !NBSM_GetBoolean(v3));
+    // no instance can leave the initial state, they are all put to sleep
+    CuAssertIntEquals(tc, 128, NBSM_UpdateScheduler(scheduler));
+    CuAssertIntEquals(tc, 0, scheduler->active_count);
+    CuAssertIntEquals(tc, 0, NBSM_UpdateScheduler(scheduler));
 
-    NBSM_SetInteger(v1, 42);
-    NBSM_SetFloat(v2, 42.5f);
-    NBSM_SetBoolean(v3, true);
+    // "v3" is not used by the conditions of "foo"
+    NBSM_SetInstanceBoolean(def, scheduled[3], v3, true);
 
-    CuAssertIntEquals(tc, 42, NBSM_GetInteger(v1));
-    CuAssertTrue(tc, NBSM_GetFloat(v2) == 42.5);
-    CuAssertTrue(tc, NBSM_GetBoolean(v3));
+    CuAssertIntEquals(tc, 0, scheduler->active_count);
 
-    NBSM_Destroy(m, false);
+    NBSM_SetInstanceInteger(def, scheduled[5], v1, 42);
+
+    CuAssertIntEquals(tc, 1, scheduler->active_count);
+    CuAssertIntEquals(tc, 1, NBSM_UpdateScheduler(scheduler));
+    CuAssertStrEquals(tc, "bar", NBSM_GetInstanceState(def, scheduled[5]));
+
+    NBSM_ResetInstance(def, scheduled[5]);
+    NBSM_SetInstanceInteger(def, scheduled[5], v1, 0);
+    NBSM_SetInstanceBoolean(def, scheduled[3], v3, false);
+
+    // only a few instances change every tick, the scheduled ones must end up in the same states as the others
+
+    for (int tick = 0; tick < 50; tick++)
+    {
+        for (int i = tick % 8; i < 128; i += 8)
+        {
+            unsigned int s = seed;
+
+            RandomizeInstance(def, scheduled[i], &s);
+            RandomizeInstance(def, single[i], &seed);
+        }
+
+        unsigned int updated_count = NBSM_UpdateScheduler(scheduler);
+
+        CuAssertTrue(tc, updated_count < 128);
+
+        for (int i = 0; i < 128; i++)
+        {
+            NBSM_UpdateInstance(def, single[i]);
+
+            CuAssertIntEquals(tc, single[i]->current, scheduled[i]->current);
+        }
+    }
+
+    for (int i = 0; i < 128; i++)
+    {
+        NBSM_RemoveFromScheduler(scheduler, scheduled[i]);
+        NBSM_DestroyInstance(scheduled[i]);
+        NBSM_DestroyInstance(single[i]);
+    }
+
+    CuAssertIntEquals(tc, 0, scheduler->active_count);
+
+    NBSM_DestroyScheduler(scheduler);
+    NBSM_DestroyDefinition(def);
 }
 
-void TestTransitionNoCondition(CuTest *tc)
+void TestPopulation(CuTest *tc)
 {
-    NBSM_Machine *m = NBSM_Create();
+    NBSM_Definition *def = CreateTestDefinition();
+    unsigned int vars[4] = {
+        NBSM_GetVariableIndex(def, "v1"),
+        NBSM_GetVariableIndex(def, "v2"),
+        NBSM_GetVariableIndex(def, "v3"),
+        NBSM_GetVariableIndex(def, "v4") };
 
-    NBSM_AddState(m, "foo", true);
-    NBSM_AddState(m, "bar", false);
-    NBSM_AddState(m, "plop", false);
+    for (NBSM_SIMDLevel level = NBSM_SIMD_NONE; level <= NBSM_SIMD_AVX2; level++)
+    {
+        if (!NBSM_SetSIMDLevel(level))
+            continue;
 
-    NBSM_AddTransition(m, "foo", "bar");
-    NBSM_AddTransition(m, "bar", "plop");
+        CuAssertIntEquals(tc, level, NBSM_GetSIMDLevel());
 
-    CuAssertPtrNotNull(tc, m->current);
-    CuAssertStrEquals(tc, "foo", m->current->name);
+        NBSM_Population *pop = NBSM_CreatePopulation(def, 4); // will grow
+        NBSM_Instance *instances[77];
+        unsigned int seed = 42;
+
+        for (int i = 0; i < 77; i++)
+        {
+            CuAssertIntEquals(tc, i, NBSM_AddToPopulation(pop));
+
+            instances[i] = NBSM_CreateInstance(def);
+        }
+
+        for (int tick = 0; tick < 20; tick++)
+        {
+            unsigned int executed_count = 0;
+
+            for (int i = 0; i < 77; i++)
+            {
+                NBSM_Instance *inst = instances[i];
+                unsigned int prev_state = inst->current;
+
+                RandomizeInstance(def, inst, &seed);
+
+                NBSM_SetPopulationInteger(pop, i, vars[0], NBSM_GetInstanceInteger(def, inst, vars[0]));
+                NBSM_SetPopulationFloat(pop, i, vars[1], NBSM_GetInstanceFloat(def, inst, vars[1]));
+                NBSM_SetPopulationBoolean(pop, i, vars[2], NBSM_GetInstanceBoolean(def, inst, vars[2]));
+                NBSM_SetPopulationFloat(pop, i, vars[3], NBSM_GetInstanceFloat(def, inst, vars[3]));
+
+                NBSM_UpdateInstance(def, inst);
+
+                if (inst->current != prev_state)
+                    executed_count++;
+            }
+
+            CuAssertIntEquals(tc, executed_count, NBSM_UpdatePopulation(pop));
+
+            for (int i = 0; i < 77; i++)
+                CuAssertIntEquals(tc, instances[i]->current, pop->states[i]);
+        }
+
+        NBSM_SetPopulationBoolean(pop, 76, vars[2], true);
+        NBSM_RemoveFromPopulation(pop, 3);
+
+        CuAssertIntEquals(tc, 76, pop->count);
+        CuAssertIntEquals(tc, instances[76]->current, pop->states[3]);
+        CuAssertTrue(tc, NBSM_GetPopulationBoolean(pop, 3, vars[2]));
+
+        for (int i = 0; i < 77; i++)
+            NBSM_DestroyInstance(instances[i]);
+
+        NBSM_DestroyPopulation(pop);
+    }
+
+    NBSM_DestroyDefinition(def);
+}
+
+void TestPopulationBooleanDefault(CuTest *tc)
+{
+    const char *json =
+        "{\"variables\": [{\"name\": \"b\", \"type\": \"bool\", \"default\": true}],"
+        "\"states\": [{\"name\": \"foo\", \"is_initial\": true}, {\"name\": \"bar\", \"is_initial\": false}],"
+        "\"transitions\": [{\"source\": \"foo\", \"target\": \"bar\", \"conditions\": ["
+        "{\"type\": \"eq\", \"left_op\": \"b\", \"right_op\": {\"type\": \"const\", "
+        "\"const\": {\"type\": \"bool\", \"value\": true}}}]}]}";
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    NBSM_Definition *def = NBSM_CreateDefinition(builder);
+    unsigned int b = NBSM_GetVariableIndex(def, "b");
+    NBSM_StateId bar = NBSM_GetDefinitionStateId(def, "bar");
+
+    NBSM_DestroyBuilder(builder);
+
+    for (NBSM_SIMDLevel level = NBSM_SIMD_NONE; level <= NBSM_SIMD_AVX2; level++)
+    {
+        if (!NBSM_SetSIMDLevel(level))
+            continue;
+
+        // boolean defaults are stored as 0 or 1 in the population columns
+        NBSM_Population *pop = NBSM_CreatePopulation(def, 4);
+
+        for (int i = 0; i < 9; i++)
+            NBSM_AddToPopulation(pop);
+
+        CuAssertIntEquals(tc, 1, pop->columns[b * pop->capacity].i);
+        CuAssertTrue(tc, NBSM_GetPopulationBoolean(pop, 8, b));
+        CuAssertIntEquals(tc, 9, NBSM_UpdatePopulation(pop));
+
+        for (int i = 0; i < 9; i++)
+            CuAssertIntEquals(tc, bar, pop->states[i]);
+
+        NBSM_DestroyPopulation(pop);
+    }
+
+    NBSM_DestroyDefinition(def);
+}
+
+void TestPoolSlabs(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    NBSM_MachinePool *pool = NBSM_CreatePool(builder, 4);
+
+    for (unsigned int i = 0; i < 5; i++)
+        NBSM_GetFromPool(pool);
+
+    // the pool grew from 4 to 8 state machines with a single new slab
+    CuAssertIntEquals(tc, 8, pool->count);
+    CuAssertIntEquals(tc, 2, pool->slab_count);
+
+    for (unsigned int i = 0; i < pool->count; i++)
+    {
+        // state machines of the same slab are contiguous
+        if (i % 4 > 0)
+            CuAssertPtrEquals(tc, (char *)pool->machines[i - 1] + pool->machine_size, pool->machines[i]);
+    }
+
+    TestPooledMachine(tc, pool->machines[6]);
+
+    NBSM_DestroyPool(pool);
+
+    // empty pools grow as well
+    pool = NBSM_CreatePool(builder, 0);
+
+    TestPooledMachine(tc, NBSM_GetFromPool(pool));
+
+    NBSM_DestroyPool(pool);
+    NBSM_DestroyBuilder(builder);
+}
+
+void TestClone(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    NBSM_Machine *m = NBSM_Build(builder);
 
+    NBSM_SetInteger(NBSM_GetVariable(m, "v1"), 42);
     NBSM_Update(m);
 
     CuAssertStrEquals(tc, "bar", m->current->name);
 
-    NBSM_Update(m);
+    NBSM_Machine *clone = NBSM_Clone(m);
 
-    CuAssertStrEquals(tc, "plop", m->current->name);
+    // the clone starts from the state of the original
+    CuAssertStrEquals(tc, "bar", clone->current->name);
+    CuAssertIntEquals(tc, 42, NBSM_GetInteger(NBSM_GetVariable(clone, "v1")));
+    CuAssertTrue(tc, NBSM_GetVariable(clone, "v1") != NBSM_GetVariable(m, "v1"));
+    CuAssertIntEquals(tc, NBSM_GetStateId(m, "toto"), NBSM_GetStateId(clone, "toto"));
 
     NBSM_Destroy(m, false);
+
+    // and is independent from it
+    NBSM_SetFloat(NBSM_GetVariable(clone, "v2"), 100.625f);
+    NBSM_SetBoolean(NBSM_GetVariable(clone, "v3"), true);
+    NBSM_Update(clone);
+
+    CuAssertStrEquals(tc, "plop", clone->current->name);
+
+    NBSM_Reset(clone);
+    NBSM_SetInteger(NBSM_GetVariable(clone, "v1"), 0);
+    NBSM_SetFloat(NBSM_GetVariable(clone, "v2"), 0);
+    NBSM_SetBoolean(NBSM_GetVariable(clone, "v3"), false);
+
+    TestPooledMachine(tc, clone);
+
+    NBSM_Destroy(clone, false);
+    NBSM_DestroyBuilder(builder);
+}
+
+#define CONCURRENT_POOL_THREAD_COUNT 4
+#define CONCURRENT_POOL_HELD_COUNT 50
+
+static void *RunConcurrentPoolThread(void *data)
+{
+    NBSM_ConcurrentPool *pool = data;
+    NBSM_PoolCache *cache = NBSM_CreatePoolCache(pool);
+    NBSM_Machine *held[CONCURRENT_POOL_HELD_COUNT];
+    int tag;
+    void *result = NULL;
+
+    for (int i = 0; i < 200; i++)
+    {
+        // without the cache every other round
+        NBSM_PoolCache *c = i % 2 ? cache : NULL;
+
+        for (int j = 0; j < CONCURRENT_POOL_HELD_COUNT; j++)
+        {
+            held[j] = NBSM_GetFromConcurrentPool(pool, c);
+            held[j]->user_data = &tag;
+        }
+
+        // a state machine must not be handed out to another thread while held
+        for (int j = 0; j < CONCURRENT_POOL_HELD_COUNT; j++)
+        {
+            if (held[j]->user_data != &tag || strcmp(held[j]->current->name, "foo") != 0)
+                result = held[j];
+
+            NBSM_SetInteger(NBSM_GetVariable(held[j], "v1"), 42);
+            NBSM_Update(held[j]);
+        }
+
+        for (int j = 0; j < CONCURRENT_POOL_HELD_COUNT; j++)
+        {
+            NBSM_SetInteger(NBSM_GetVariable(held[j], "v1"), 0);
+            NBSM_RecycleToConcurrentPool(pool, c, held[j]);
+        }
+    }
+
+    NBSM_DestroyPoolCache(cache);
+
+    return result;
+}
+
+void TestConcurrentPool(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    NBSM_ConcurrentPool *pool = NBSM_CreateConcurrentPool(builder, 8);
+    pthread_t threads[CONCURRENT_POOL_THREAD_COUNT];
+
+    for (int i = 0; i < CONCURRENT_POOL_THREAD_COUNT; i++)
+        pthread_create(&threads[i], NULL, RunConcurrentPoolThread, pool);
+
+    for (int i = 0; i < CONCURRENT_POOL_THREAD_COUNT; i++)
+    {
+        void *result;
+
+        pthread_join(threads[i], &result);
+
+        CuAssertPtrEquals(tc, NULL, result);
+    }
+
+    // every state machine is back in the free list
+    unsigned int capacity = pool->base_slab_capacity * ((1u << pool->slab_count) - 1);
+    unsigned int free_count = 0;
+
+    CuAssertTrue(tc, capacity >= CONCURRENT_POOL_HELD_COUNT);
+
+    while (PopPoolSlot(pool))
+        free_count++;
+
+    CuAssertIntEquals(tc, capacity, free_count);
+
+    NBSM_DestroyConcurrentPool(pool);
+
+    // once refilled, the cache hands out machines without touching the shared free list
+    NBSM_Machine *machines[NBSM_POOL_CACHE_SIZE / 2];
+
+    pool = NBSM_CreateConcurrentPool(builder, NBSM_POOL_CACHE_SIZE);
+
+    NBSM_PoolCache *cache = NBSM_CreatePoolCache(pool);
+
+    machines[0] = NBSM_GetFromConcurrentPool(pool, cache);
+
+    uint64_t head = pool->free_head;
+
+    for (int i = 1; i < NBSM_POOL_CACHE_SIZE / 2; i++)
+        machines[i] = NBSM_GetFromConcurrentPool(pool, cache);
+
+    CuAssertTrue(tc, pool->free_head == head);
+
+    for (int i = 0; i < NBSM_POOL_CACHE_SIZE / 2; i++)
+        NBSM_RecycleToConcurrentPool(pool, cache, machines[i]);
+
+    CuAssertTrue(tc, pool->free_head == head);
+
+    NBSM_DestroyPoolCache(cache);
+    NBSM_DestroyConcurrentPool(pool);
+    NBSM_DestroyBuilder(builder);
+}
+
+void TestDefaultValues(CuTest *tc)
+{
+    const char *json =
+        "{\"variables\": ["
+        "{\"name\": \"v1\", \"default\": 5, \"type\": \"int\"},"
+        "{\"name\": \"v2\", \"type\": \"float\", \"default\": 1.5},"
+        "{\"name\": \"v3\", \"type\": \"bool\", \"default\": true},"
+        "{\"name\": \"v4\", \"type\": \"int\"}],"
+        "\"states\": [{\"name\": \"foo\", \"is_initial\": true}, {\"name\": \"bar\", \"is_initial\": false}],"
+        "\"transitions\": [{\"source\": \"foo\", \"target\": \"bar\", \"conditions\": ["
+        "{\"type\": \"eq\", \"left_op\": \"v1\", \"right_op\": {\"type\": \"const\", "
+        "\"const\": {\"type\": \"int\", \"value\": 6}}}]}]}";
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    NBSM_MachinePool *pool = NBSM_CreatePool(builder, 1);
+    NBSM_Machine *m = NBSM_GetFromPool(pool);
+
+    CuAssertIntEquals(tc, 5, NBSM_GetInteger(NBSM_GetVariable(m, "v1")));
+    CuAssertTrue(tc, NBSM_GetFloat(NBSM_GetVariable(m, "v2")) == 1.5f);
+    CuAssertTrue(tc, NBSM_GetBoolean(NBSM_GetVariable(m, "v3")));
+    CuAssertIntEquals(tc, 0, NBSM_GetInteger(NBSM_GetVariable(m, "v4")));
+
+    NBSM_SetInteger(NBSM_GetVariable(m, "v1"), 6);
+    NBSM_SetBoolean(NBSM_GetVariable(m, "v3"), false);
+    NBSM_SetInteger(NBSM_GetVariable(m, "v4"), 12);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    // recycling restores the default values
+    NBSM_Recycle(pool, m);
+
+    CuAssertPtrEquals(tc, m, NBSM_GetFromPool(pool));
+    CuAssertStrEquals(tc, "foo", m->current->name);
+    CuAssertIntEquals(tc, 5, NBSM_GetInteger(NBSM_GetVariable(m, "v1")));
+    CuAssertTrue(tc, NBSM_GetBoolean(NBSM_GetVariable(m, "v3")));
+    CuAssertIntEquals(tc, 0, NBSM_GetInteger(NBSM_GetVariable(m, "v4")));
+
+    NBSM_DestroyPool(pool);
+
+    // definitions use the same default values
+    NBSM_Definition *def = NBSM_CreateDefinition(builder);
+    NBSM_Instance *inst = NBSM_CreateInstance(def);
+    unsigned int v1 = NBSM_GetVariableIndex(def, "v1");
+
+    CuAssertIntEquals(tc, 5, NBSM_GetInstanceInteger(def, inst, v1));
+    CuAssertTrue(tc, NBSM_GetInstanceFloat(def, inst, NBSM_GetVariableIndex(def, "v2")) == 1.5f);
+
+    NBSM_SetInstanceInteger(def, inst, v1, 6);
+    NBSM_UpdateInstance(def, inst);
+
+    CuAssertStrEquals(tc, "bar", NBSM_GetInstanceState(def, inst));
+
+    NBSM_ResetInstance(def, inst);
+
+    CuAssertStrEquals(tc, "foo", NBSM_GetInstanceState(def, inst));
+    CuAssertIntEquals(tc, 5, NBSM_GetInstanceInteger(def, inst, v1));
+
+    NBSM_DestroyInstance(inst);
+    NBSM_DestroyDefinition(def);
+    NBSM_DestroyBuilder(builder);
+}
+
+void TestMachineHandles(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    NBSM_MachinePool *pool = NBSM_CreatePool(builder, 1);
+    NBSM_Machine *m1 = NBSM_GetFromPool(pool);
+    NBSM_Machine *m2 = NBSM_GetFromPool(pool);
+    NBSM_MachineHandle h1 = NBSM_GetMachineHandle(pool, m1);
+    NBSM_MachineHandle h2 = NBSM_GetMachineHandle(pool, m2);
+
+    CuAssertPtrEquals(tc, m1, NBSM_ResolveHandle(pool, h1));
+    CuAssertPtrEquals(tc, m2, NBSM_ResolveHandle(pool, h2));
+    CuAssertPtrEquals(tc, NULL, NBSM_ResolveHandle(pool, NBSM_NULL_HANDLE));
+
+    NBSM_Recycle(pool, m1);
+
+    // the state machine is handed out again but the old handle is stale
+    CuAssertPtrEquals(tc, m1, NBSM_GetFromPool(pool));
+    CuAssertPtrEquals(tc, NULL, NBSM_ResolveHandle(pool, h1));
+    CuAssertPtrEquals(tc, m2, NBSM_ResolveHandle(pool, h2));
+
+    NBSM_MachineHandle h3 = NBSM_GetMachineHandle(pool, m1);
+
+    CuAssertIntEquals(tc, h1.index, h3.index);
+    CuAssertPtrEquals(tc, m1, NBSM_ResolveHandle(pool, h3));
+
+    // handles survive pool growth
+    for (int i = 0; i < 10; i++)
+        NBSM_GetFromPool(pool);
+
+    CuAssertPtrEquals(tc, m1, NBSM_ResolveHandle(pool, h3));
+    CuAssertPtrEquals(tc, m2, NBSM_ResolveHandle(pool, h2));
+
+    NBSM_DestroyPool(pool);
+    NBSM_DestroyBuilder(builder);
+}
+
+static void OnPooledMachineEnter(NBSM_Machine *machine, void *user_data)
+{
+    NBSM_Recycle(user_data, machine);
+}
+
+void TestUpdatePool(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    NBSM_MachinePool *pool = NBSM_CreatePool(builder, 4);
+    NBSM_Machine *machines[6];
+
+    for (int i = 0; i < 6; i++)
+        machines[i] = NBSM_GetFromPool(pool);
+
+    NBSM_Recycle(pool, machines[1]);
+    NBSM_Recycle(pool, machines[4]);
+
+    CuAssertIntEquals(tc, 4, pool->live_count);
+
+    // the live array holds exactly the state machines taken from the pool
+    for (unsigned int i = 0; i < pool->live_count; i++)
+    {
+        NBSM_Machine *m = pool->live[i];
+
+        CuAssertTrue(tc, m == machines[0] || m == machines[2] || m == machines[3] || m == machines[5]);
+    }
+
+    for (unsigned int i = 0; i < pool->live_count; i++)
+        NBSM_SetInteger(NBSM_GetVariable(pool->live[i], "v1"), 42);
+
+    NBSM_UpdatePool(pool);
+
+    for (unsigned int i = 0; i < pool->live_count; i++)
+        CuAssertStrEquals(tc, "bar", pool->live[i]->current->name);
+
+    CuAssertStrEquals(tc, "foo", machines[1]->current->name);
+
+    // state hooks can recycle the state machine being updated
+    NBSM_OnStateEnter(machines[0], "plop", OnPooledMachineEnter);
+    NBSM_OnStateEnter(machines[3], "plop", OnPooledMachineEnter);
+    NBSM_AttachDataToState(machines[0], "plop", pool);
+    NBSM_AttachDataToState(machines[3], "plop", pool);
+
+    for (unsigned int i = 0; i < pool->live_count; i++)
+    {
+        NBSM_SetFloat(NBSM_GetVariable(pool->live[i], "v2"), 100.625f);
+        NBSM_SetBoolean(NBSM_GetVariable(pool->live[i], "v3"), true);
+    }
+
+    NBSM_UpdatePool(pool);
+
+    CuAssertIntEquals(tc, 2, pool->live_count);
+    CuAssertTrue(tc, pool->live[0] == machines[2] || pool->live[0] == machines[5]);
+    CuAssertTrue(tc, pool->live[1] == machines[2] || pool->live[1] == machines[5]);
+    CuAssertStrEquals(tc, "plop", machines[2]->current->name);
+    CuAssertStrEquals(tc, "plop", machines[5]->current->name);
+
+    NBSM_DestroyPool(pool);
+    NBSM_DestroyBuilder(builder);
+}
+
+static char *ReadFileContent(FILE *f, size_t *size)
+{
+    fseek(f, 0, SEEK_END);
+
+    *size = ftell(f);
+
+    char *content = malloc(*size + 1);
+
+    fseek(f, 0, SEEK_SET);
+    fread(content, 1, *size, f);
+    content[*size] = 0;
+
+    return content;
+}
+
+// The generated code describes everything in a machine builder, comparing it compares machine builders
+static char *GenerateTestCode(NBSM_MachineBuilder *builder)
+{
+    FILE *f = tmpfile();
+    size_t size;
+
+    NBSM_GenerateC(builder, "machine", f);
+
+    char *code = ReadFileContent(f, &size);
+
+    fclose(f);
+
+    return code;
+}
+
+void TestBinary(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    FILE *f = tmpfile();
+
+    CuAssertTrue(tc, NBSM_WriteBinary(builder, f));
+
+    size_t size;
+    char *data = ReadFileContent(f, &size);
+
+    fclose(f);
+
+    NBSM_MachineBuilder *loaded = NBSM_CreateBuilderFromBinary(data, size);
+
+    CuAssertPtrNotNull(tc, loaded);
+
+    // the loaded machine builder describes the same state machine
+    char *expected = GenerateTestCode(builder);
+    char *actual = GenerateTestCode(loaded);
+
+    CuAssertStrEquals(tc, expected, actual);
+
+    free(expected);
+    free(actual);
+
+    // names point into the binary data
+    CuAssertTrue(tc, loaded->states[0].name >= data && loaded->states[0].name < data + size);
+
+    NBSM_Machine *m = NBSM_Build(loaded);
+
+    TestPooledMachine(tc, m);
+
+    NBSM_Destroy(m, false);
+    NBSM_DestroyBuilder(loaded);
+
+    // truncated data and other versions are rejected
+    CuAssertPtrEquals(tc, NULL, NBSM_CreateBuilderFromBinary(data, size - 1));
+
+    ((uint32_t *)data)[1] = NBSM_BINARY_VERSION + 1;
+
+    CuAssertPtrEquals(tc, NULL, NBSM_CreateBuilderFromBinary(data, size));
+
+    // memory mapped file
+    char path[] = "/tmp/nbsm_testXXXXXX";
+    int fd = mkstemp(path);
+
+    CuAssertTrue(tc, fd >= 0);
+
+    f = fdopen(fd, "wb");
+
+    CuAssertTrue(tc, NBSM_WriteBinary(builder, f));
+
+    fclose(f);
+
+    loaded = NBSM_LoadBinaryFile(path);
+
+    unlink(path);
+
+    CuAssertPtrNotNull(tc, loaded);
+
+    m = NBSM_Build(loaded);
+
+    TestPooledMachine(tc, m);
+
+    NBSM_Destroy(m, false);
+    NBSM_DestroyBuilder(loaded);
+    NBSM_DestroyBuilder(builder);
+    free(data);
+
+    CuAssertPtrEquals(tc, NULL, NBSM_LoadBinaryFile("/tmp/nbsm_missing_file"));
+}
+
+typedef struct
+{
+    const char *json;
+    size_t position;
+    size_t chunk_size;
+} TestJSONReader;
+
+static size_t ReadTestJSONChunk(void *user_data, char *buffer, size_t size)
+{
+    TestJSONReader *reader = user_data;
+    size_t length = strlen(reader->json + reader->position);
+
+    if (length > reader->chunk_size)
+        length = reader->chunk_size;
+
+    if (length > size)
+        length = size;
+
+    memcpy(buffer, reader->json + reader->position, length);
+    reader->position += length;
+
+    return length;
+}
+
+void TestJSONStream(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    char *expected = GenerateTestCode(builder);
+
+    // tokens are split across chunks
+    TestJSONReader reader = { json, 0, 3 };
+    NBSM_MachineBuilder *streamed = NBSM_CreateBuilderFromJSONStream(ReadTestJSONChunk, &reader);
+    char *actual = GenerateTestCode(streamed);
+
+    CuAssertStrEquals(tc, expected, actual);
+
+    NBSM_Machine *m = NBSM_Build(streamed);
+
+    TestPooledMachine(tc, m);
+
+    NBSM_Destroy(m, false);
+    NBSM_DestroyBuilder(streamed);
+    free(actual);
+
+    int fd = open("test.json", O_RDONLY);
+
+    CuAssertTrue(tc, fd >= 0);
+
+    streamed = NBSM_CreateBuilderFromJSONFd(fd);
+    actual = GenerateTestCode(streamed);
+
+    close(fd);
+
+    CuAssertStrEquals(tc, expected, actual);
+
+    NBSM_DestroyBuilder(streamed);
+    NBSM_DestroyBuilder(builder);
+    free(actual);
+    free(expected);
+    free(json);
+
+    // escapes, default values, unknown members and values before their types
+    reader = (TestJSONReader){
+        "{\"version\": [1, {\"a\": null}, -2.5e3], \"variables\": ["
+        "{\"name\": \"v\\u00e9\\n\", \"default\": 7, \"type\": \"int\"},"
+        "{\"name\": \"b\", \"type\": \"bool\", \"default\": true, \"color\": \"#ff0000\"}],"
+        "\"states\": [{\"name\": \"f\\\"o\\\\o\", \"is_initial\": true}, {\"name\": \"bar\", \"is_initial\": false}],"
+        "\"transitions\": [{\"source\": \"f\\\"o\\\\o\", \"target\": \"bar\", \"conditions\": ["
+        "{\"type\": \"gte\", \"left_op\": \"v\\u00e9\\n\", \"right_op\": {\"type\": \"const\", "
+        "\"const\": {\"value\": 8, \"type\": \"int\"}}}]}]}  \n",
+        0,
+        5
+    };
+    streamed = NBSM_CreateBuilderFromJSONStream(ReadTestJSONChunk, &reader);
+
+    CuAssertStrEquals(tc, "v\xc3\xa9\n", streamed->variables[0].name);
+    CuAssertStrEquals(tc, "f\"o\\o", streamed->states[0].name);
+
+    m = NBSM_Build(streamed);
+
+    NBSM_Value *v = NBSM_GetVariable(m, "v\xc3\xa9\n");
+
+    CuAssertIntEquals(tc, 7, NBSM_GetInteger(v));
+    CuAssertTrue(tc, NBSM_GetBoolean(NBSM_GetVariable(m, "b")));
+
+    NBSM_SetInteger(v, 8);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_Destroy(m, false);
+    NBSM_DestroyBuilder(streamed);
+
+    // invalid JSON
+    const char *invalid_jsons[] = {
+        "{\"states\": [{\"name\": \"foo\", \"is_initial\": true}",
+        "{\"states\": [{\"name\": \"foo\" \"is_initial\": true}]}",
+        "{\"states\": [{\"is_initial\": true}]}",
+        "{\"variables\": [{\"name\": \"v\", \"type\": \"int\", \"default\": true}]}",
+        "{\"states\": []} trailing",
+        "{\"variables\": [{\"name\": \"v\", \"type\": \"string\"}]}",
+        "{\"variables\": [{\"name\": \"v\", \"type\": \"bogus\"}]}",
+        "{\"transitions\": [{\"source\": \"a\", \"target\": \"b\", \"conditions\": [{\"type\": \"bogus\", "
+        "\"left_op\": \"v\", \"right_op\": {\"type\": \"var\", \"var\": \"w\"}}]}]}",
+        "{\"transitions\": [{\"source\": \"a\", \"target\": \"b\", \"conditions\": [{\"type\": \"eq\", "
+        "\"left_op\": \"v\", \"right_op\": {\"type\": \"zzz\", \"var\": \"w\"}}]}]}",
+        "{\"transitions\": [{\"source\": \"a\", \"target\": \"b\", \"conditions\": [{"
+        "\"left_op\": \"v\", \"right_op\": {\"type\": \"var\", \"var\": \"w\"}}]}]}",
+        "{\"transitions\": [{\"source\": \"a\", \"target\": \"b\", \"conditions\": [{\"type\": \"eq\", "
+        "\"left_op\": \"v\"}]}]}",
+        "{\"transitions\": [{\"source\": \"a\", \"target\": \"b\", \"conditions\": [{\"type\": \"eq\", "
+        "\"left_op\": \"v\", \"right_op\": {\"type\": \"const\", \"const\": {\"value\": 1}}}]}]}",
+        "{\"transitions\": [{\"source\": \"a\", \"target\": \"b\", \"conditions\": [{\"type\": \"eq\", "
+        "\"left_op\": \"v\", \"right_op\": {\"type\": \"var\"}}]}]}"
+    };
+
+    for (size_t i = 0; i < sizeof(invalid_jsons) / sizeof(invalid_jsons[0]); i++)
+    {
+        reader = (TestJSONReader){ invalid_jsons[i], 0, 4 };
+
+        CuAssertPtrEquals(tc, NULL, NBSM_CreateBuilderFromJSONStream(ReadTestJSONChunk, &reader));
+    }
+
+    // deeply nested unknown values are rejected instead of overflowing the stack
+    size_t depth = 1 << 21;
+    char *nested = malloc(depth + 8);
+
+    strcpy(nested, "{\"x\": ");
+    memset(nested + 6, '[', depth);
+    nested[depth + 6] = '\0';
+
+    reader = (TestJSONReader){ nested, 0, 4096 };
+
+    CuAssertPtrEquals(tc, NULL, NBSM_CreateBuilderFromJSONStream(ReadTestJSONChunk, &reader));
+
+    free(nested);
+
+    // repeated keys append to the blueprints of the previous occurrences
+    char repeated[1024] = "{\"states\": [";
+
+    for (int i = 0; i < 12; i++)
+    {
+        snprintf(repeated + strlen(repeated), sizeof(repeated) - strlen(repeated),
+            "%s{\"name\": \"s%d\", \"is_initial\": %s}", i == 0 || i == 9 ? "" : ",", i, i == 0 ? "true" : "false");
+
+        if (i == 8)
+            strcat(repeated, "], \"variables\": [], \"states\": [");
+    }
+
+    strcat(repeated, "], \"transitions\": []}");
+
+    reader = (TestJSONReader){ repeated, 0, 16 };
+    streamed = NBSM_CreateBuilderFromJSONStream(ReadTestJSONChunk, &reader);
+
+    CuAssertIntEquals(tc, 12, streamed->state_count);
+
+    for (int i = 0; i < 12; i++)
+    {
+        char name[8];
+
+        snprintf(name, sizeof(name), "s%d", i);
+        CuAssertStrEquals(tc, name, streamed->states[i].name);
+    }
+
+    NBSM_DestroyBuilder(streamed);
+}
+
+#define DIRECTORY_FILE_COUNT 100
+
+static void WriteTestFile(const char *directory, const char *name, const char *content)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *f = fopen(path, "w");
+
+    fputs(content, f);
+    fclose(f);
+}
+
+static void AssertDirectoryRegistry(CuTest *tc, NBSM_BuilderRegistry *registry)
+{
+    CuAssertPtrNotNull(tc, registry);
+    CuAssertIntEquals(tc, DIRECTORY_FILE_COUNT, registry->count);
+
+    // sorted by name
+    CuAssertStrEquals(tc, "machine000", registry->names[0]);
+    CuAssertStrEquals(tc, "machine099", registry->names[DIRECTORY_FILE_COUNT - 1]);
+
+    for (unsigned int i = 0; i < registry->count; i++)
+        CuAssertPtrEquals(tc, registry->builders[i], NBSM_GetBuilder(registry, registry->names[i]));
+
+    CuAssertPtrEquals(tc, NULL, NBSM_GetBuilder(registry, "notes"));
+    CuAssertPtrEquals(tc, NULL, NBSM_GetBuilder(registry, "machine100"));
+
+    NBSM_Machine *m = NBSM_Build(NBSM_GetBuilder(registry, "machine042"));
+
+    TestPooledMachine(tc, m);
+
+    NBSM_Destroy(m, false);
+}
+
+void TestLoadDirectory(CuTest *tc)
+{
+    char directory[] = "/tmp/nbsm_testXXXXXX";
+    char *json = ReadTestJSON();
+    char name[32];
+
+    CuAssertPtrNotNull(tc, mkdtemp(directory));
+
+    for (int i = 0; i < DIRECTORY_FILE_COUNT; i++)
+    {
+        snprintf(name, sizeof(name), "machine%03d.json", i);
+        WriteTestFile(directory, name, json);
+    }
+
+    // ignored
+    WriteTestFile(directory, "notes.txt", "not a state machine");
+    WriteTestFile(directory, "broken.json", "{\"states\": [{\"name\": \"foo\", \"is_initial\": tru");
+
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/folder.json", directory);
+    CuAssertIntEquals(tc, 0, mkdir(path, 0700));
+
+    NBSM_BuilderRegistry *registry = NBSM_LoadBuildersFromDirectory(directory);
+
+    AssertDirectoryRegistry(tc, registry);
+    NBSM_DestroyBuilderRegistry(registry);
+
+    NBSM_WorkerPool *pool = NBSM_CreateWorkerPool(4);
+
+    registry = NBSM_LoadBuildersFromDirectoryParallel(pool, directory);
+
+    AssertDirectoryRegistry(tc, registry);
+
+    NBSM_Registry *definitions = NBSM_CreateRegistry(NULL, NULL);
+
+    NBSM_RegisterBuilders(definitions, registry);
+
+    CuAssertIntEquals(tc, DIRECTORY_FILE_COUNT, definitions->count);
+    CuAssertIntEquals(tc, 42, NBSM_GetDefinitionId(definitions, "machine042"));
+
+    NBSM_DestroyRegistry(definitions);
+    NBSM_DestroyBuilderRegistry(registry);
+    NBSM_DestroyWorkerPool(pool);
+
+    for (int i = 0; i < DIRECTORY_FILE_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "%s/machine%03d.json", directory, i);
+        unlink(path);
+    }
+
+    snprintf(path, sizeof(path), "%s/notes.txt", directory);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/broken.json", directory);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/folder.json", directory);
+    rmdir(path);
+    rmdir(directory);
+    free(json);
+
+    CuAssertPtrEquals(tc, NULL, NBSM_LoadBuildersFromDirectory("/tmp/nbsm_missing_directory"));
+}
+
+void TestStringInterning(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    // names used several times are stored once
+    NBSM_TransitionBlueprint *transition = &builder->transitions[0];
+
+    CuAssertPtrEquals(tc, builder->states[0].name, transition->from);
+    CuAssertPtrEquals(tc, builder->states[1].name, transition->to);
+    CuAssertPtrEquals(tc, builder->variables[0].name, transition->conditions[0].var_name);
+    CuAssertPtrEquals(tc, builder->transitions[1].from, transition->to);
+
+    // the names of a definition are stored in a single block
+    NBSM_Definition *def = NBSM_CreateDefinition(builder);
+
+    CuAssertPtrEquals(tc, def->names, def->states[0].name);
+    CuAssertStrEquals(tc, "bar", def->states[1].name);
+    CuAssertStrEquals(tc, "v4", def->variables[3].name);
+
+    // the state machines of a pool share the names of the prototype
+    NBSM_MachinePool *pool = NBSM_CreatePool(builder, 2);
+    NBSM_Machine *m1 = NBSM_GetFromPool(pool);
+    NBSM_Machine *m2 = NBSM_GetFromPool(pool);
+
+    CuAssertTrue(tc, pool->machine_size < pool->prototype->block_size);
+    CuAssertTrue(tc, pool->prototype->current->name == m1->current->name);
+    CuAssertTrue(tc, m1->current->name == m2->current->name);
+    CuAssertPtrEquals(tc, NBSM_GetVariableById(m1, 1), NBSM_GetVariable(m1, "v2"));
+    CuAssertIntEquals(tc, 2, NBSM_GetStateId(m2, "plop"));
+
+    TestPooledMachine(tc, m1);
+
+    // a clone of a pooled state machine gets its own names and outlives the pool
+    NBSM_Machine *clone = NBSM_Clone(m2);
+
+    CuAssertTrue(tc, m2->current->name != clone->current->name);
+    CuAssertStrEquals(tc, m2->current->name, clone->current->name);
+    CuAssertIntEquals(tc, pool->prototype->block_size, NBSM_GetCloneSize(m2));
+
+    NBSM_DestroyPool(pool);
+
+    CuAssertPtrEquals(tc, NBSM_GetVariableById(clone, 1), NBSM_GetVariable(clone, "v2"));
+    TestPooledMachine(tc, clone);
+
+    NBSM_Destroy(clone, false);
+    NBSM_DestroyDefinition(def);
+    NBSM_DestroyBuilder(builder);
+}
+
+static void OnRegistryDefinitionLoad(
+    NBSM_Registry *registry, NBSM_DefinitionId id, NBSM_Definition *definition, void *user_data)
+{
+    (void)registry;
+    (void)id;
+
+    NBSM_OnDefinitionStateEnter(definition, "bar", OnInstanceEnter);
+
+    (*(int *)user_data)++;
+}
+
+void TestRegistry(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    int load_count = 0;
+
+    free(json);
+
+    NBSM_Registry *registry = NBSM_CreateRegistry(OnRegistryDefinitionLoad, &load_count);
+    NBSM_DefinitionId enemy = NBSM_RegisterDefinition(registry, "enemy", builder);
+    NBSM_DefinitionId npc = NBSM_RegisterDefinition(registry, "npc", builder);
+
+    CuAssertIntEquals(tc, 0, enemy);
+    CuAssertIntEquals(tc, 1, npc);
+    CuAssertIntEquals(tc, npc, NBSM_GetDefinitionId(registry, "npc"));
+    CuAssertTrue(tc, NBSM_GetDefinitionId(registry, "boss") == NBSM_INVALID_DEFINITION_ID);
+
+    // definitions are created with their first instance
+    CuAssertPtrEquals(tc, NULL, NBSM_GetRegistryDefinition(registry, enemy));
+
+    NBSM_Instance *i1 = NBSM_CreateRegistryInstance(registry, enemy);
+    NBSM_Instance *i2 = NBSM_CreateRegistryInstance(registry, enemy);
+    NBSM_Definition *def = NBSM_GetRegistryDefinition(registry, enemy);
+
+    CuAssertPtrNotNull(tc, def);
+    CuAssertPtrEquals(tc, NULL, NBSM_GetRegistryDefinition(registry, npc));
+    CuAssertIntEquals(tc, 1, load_count);
+
+    unsigned int v1 = NBSM_GetVariableIndex(def, "v1");
+
+    enter_count = 0;
+
+    NBSM_SetInstanceInteger(def, i1, v1, 42);
+    NBSM_UpdateInstance(def, i1);
+
+    CuAssertStrEquals(tc, "bar", NBSM_GetInstanceState(def, i1));
+    CuAssertIntEquals(tc, 1, enter_count);
+
+    // released instances are reused and reset
+    NBSM_ReleaseRegistryInstance(registry, enemy, i1);
+
+    CuAssertPtrEquals(tc, def, NBSM_GetRegistryDefinition(registry, enemy));
+
+    NBSM_Instance *i3 = NBSM_CreateRegistryInstance(registry, enemy);
+
+    CuAssertPtrEquals(tc, i1, i3);
+    CuAssertStrEquals(tc, "foo", NBSM_GetInstanceState(def, i3));
+    CuAssertIntEquals(tc, 0, NBSM_GetInstanceInteger(def, i3, v1));
+
+    // the definition is unloaded with its last instance
+    NBSM_ReleaseRegistryInstance(registry, enemy, i2);
+    NBSM_ReleaseRegistryInstance(registry, enemy, i3);
+
+    CuAssertPtrEquals(tc, NULL, NBSM_GetRegistryDefinition(registry, enemy));
+
+    // and loaded again when needed, pinned definitions stay loaded without instances
+    def = NBSM_RetainDefinition(registry, enemy);
+
+    CuAssertIntEquals(tc, 2, load_count);
+
+    i1 = NBSM_CreateRegistryInstance(registry, enemy);
+
+    NBSM_ReleaseRegistryInstance(registry, enemy, i1);
+
+    CuAssertPtrEquals(tc, def, NBSM_GetRegistryDefinition(registry, enemy));
+
+    NBSM_ReleaseDefinition(registry, enemy);
+
+    CuAssertPtrEquals(tc, NULL, NBSM_GetRegistryDefinition(registry, enemy));
+
+    NBSM_DestroyRegistry(registry);
+    NBSM_DestroyBuilder(builder);
+}
+
+void TestLoadJSON(CuTest *tc)
+{ 
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    NBSM_Machine *m = NBSM_Build(builder);
+
+    NBSM_Value *v1 = NBSM_GetVariable(m, "v1");
+    NBSM_Value *v2 = NBSM_GetVariable(m, "v2");
+    NBSM_Value *v3 = NBSM_GetVariable(m, "v3");
+    NBSM_Value *v4 = NBSM_GetVariable(m, "v4");
+
+    CuAssertTrue(tc, v1->type == NBSM_INTEGER);
+    CuAssertTrue(tc, v2->type == NBSM_FLOAT);
+    CuAssertTrue(tc, v3->type == NBSM_BOOLEAN);
+    CuAssertTrue(tc, v4->type == NBSM_FLOAT);
+
+    CuAssertIntEquals(tc, 0, NBSM_GetInteger(v1));
+    CuAssertTrue(tc, NBSM_GetFloat(v2) == 0);
+    CuAssertTrue(tc, !NBSM_GetBoolean(v3));
+    CuAssertTrue(tc, NBSM_GetFloat(v4) == 0);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetInteger(v1, 42);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_SetFloat(v2, 100.f);
+    NBSM_SetBoolean(v3, true);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_SetFloat(v2, 100.625f);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "plop", m->current->name);
+
+    NBSM_SetInteger(v1, 30);
+    NBSM_SetBoolean(v3, false);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetFloat(v2, -12.f);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "toto", m->current->name);
+
+    NBSM_Destroy(m, true);
+    NBSM_DestroyBuilder(builder);
+}
+
+void TestTransitionConditions(CuTest *tc)
+{
+    NBSM_Machine *m = NBSM_Create();
+
+    NBSM_Value *v1 = NBSM_AddInteger(m, "v1");
+    NBSM_Value *v2 = NBSM_AddFloat(m, "v2");
+    NBSM_Value *v3 = NBSM_AddBoolean(m, "v3");
+    NBSM_Value *v4 = NBSM_AddFloat(m, "v4");
+
+    NBSM_SetFloat(v4, -10.150f);
+
+    NBSM_AddState(m, "foo", true);
+    NBSM_AddState(m, "bar", false);
+    NBSM_AddState(m, "plop", false);
+    NBSM_AddState(m, "toto", false);
+
+    NBSM_Transition *t1 = NBSM_AddTransition(m, "foo", "bar");
+    NBSM_Transition *t2 = NBSM_AddTransition(m, "bar", "plop");
+    NBSM_Transition *t3 = NBSM_AddTransition(m, "plop", "foo");
+    NBSM_Transition *t4 = NBSM_AddTransition(m, "foo", "toto");
+
+    NBSM_AddCondition(m, t1, "v1", NBSM_EQ, NBSM_CONST_I(42));
+    NBSM_AddCondition(m, t2, "v2", NBSM_GT, NBSM_CONST_F(100));
+    NBSM_AddCondition(m, t2, "v3", NBSM_EQ, NBSM_TRUE);
+    NBSM_AddCondition(m, t3, "v3", NBSM_EQ, NBSM_FALSE);
+    NBSM_AddCondition(m, t3, "v1", NBSM_LT, NBSM_CONST_I(42));
+    NBSM_AddCondition(m, t4, "v2", NBSM_LT, NBSM_VAR(m, "v4"));
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetInteger(v1, 42);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_SetFloat(v2, 100.f);
+    NBSM_SetBoolean(v3, true);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_SetFloat(v2, 100.5f);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "plop", m->current->name);
+
+    NBSM_SetInteger(v1, 30);
+    NBSM_SetBoolean(v3, false);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetFloat(v2, -12.f);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "toto", m->current->name);
+
+    NBSM_Destroy(m, false);
+}
+
+void TestGetAndSetVariables(CuTest *tc)
+{
+    NBSM_Machine *m = NBSM_Create();
+
+    NBSM_Value *v1 = NBSM_AddInteger(m, "foo");
+    NBSM_Value *v2 = NBSM_AddFloat(m, "bar");
+    NBSM_Value *v3 = NBSM_AddBoolean(m, "plop");
+
+    CuAssertTrue(tc, v1->type == NBSM_INTEGER);
+    CuAssertTrue(tc, v2->type == NBSM_FLOAT);
+    CuAssertTrue(tc, v3->type == NBSM_BOOLEAN);
+
+    CuAssertIntEquals(tc, 0, NBSM_GetInteger(v1));
+    CuAssertTrue(tc, NBSM_GetFloat(v2) == 0);
+    CuAssertTrue(tc, !NBSM_GetBoolean(v3));
+
+    NBSM_SetInteger(v1, 42);
+    NBSM_SetFloat(v2, 42.5f);
+    NBSM_SetBoolean(v3, true);
+
+    CuAssertIntEquals(tc, 42, NBSM_GetInteger(v1));
+    CuAssertTrue(tc, NBSM_GetFloat(v2) == 42.5);
+    CuAssertTrue(tc, NBSM_GetBoolean(v3));
+
+    NBSM_Destroy(m, false);
+}
+
+void TestTransitionNoCondition(CuTest *tc)
+{
+    NBSM_Machine *m = NBSM_Create();
+
+    NBSM_AddState(m, "foo", true);
+    NBSM_AddState(m, "bar", false);
+    NBSM_AddState(m, "plop", false);
+
+    NBSM_AddTransition(m, "foo", "bar");
+    NBSM_AddTransition(m, "bar", "plop");
+
+    CuAssertPtrNotNull(tc, m->current);
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "plop", m->current->name);
+
+    NBSM_Destroy(m, false);
+}
+
+static void OnMachineEnter(NBSM_Machine *machine, void *user_data)
+{
+    (void)machine;
+
+    (*(int *)user_data)++;
+}
+
+void TestCompile(CuTest *tc)
+{
+    NBSM_Machine *m = NBSM_Create();
+
+    NBSM_Value *v1 = NBSM_AddInteger(m, "v1");
+    NBSM_Value *v2 = NBSM_AddFloat(m, "v2");
+    NBSM_Value *v3 = NBSM_AddBoolean(m, "v3");
+
+    NBSM_AddState(m, "foo", true);
+    NBSM_AddState(m, "bar", false);
+    NBSM_AddState(m, "plop", false);
+    NBSM_AddState(m, "toto", false);
+
+    NBSM_Transition *t1 = NBSM_AddTransition(m, "foo", "bar");
+    NBSM_Transition *t2 = NBSM_AddTransition(m, "bar", "plop");
+    NBSM_Transition *t3 = NBSM_AddTransition(m, "bar", "toto");
+
+    NBSM_AddTransition(m, "toto", "foo"); // no condition
+
+    NBSM_AddCondition(m, t1, "v1", NBSM_EQ, NBSM_CONST_I(42));
+    NBSM_AddCondition(m, t2, "v2", NBSM_GT, NBSM_CONST_F(100));
+    NBSM_AddCondition(m, t2, "v3", NBSM_EQ, NBSM_TRUE);
+    NBSM_AddCondition(m, t3, "v3", NBSM_EQ, NBSM_TRUE);
+
+    int enter_count = 0;
+
+    NBSM_AttachDataToState(m, "foo", &enter_count);
+    NBSM_OnStateEnter(m, "foo", OnMachineEnter);
+
+    NBSM_Compile(m);
+
+    CuAssertTrue(tc, m->is_compiled);
+    CuAssertIntEquals(tc, 4, m->state_count);
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetInteger(v1, 42);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    // the first transition whose conditions are all true is executed
+    NBSM_SetBoolean(v3, true);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "toto", m->current->name);
+
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+    CuAssertIntEquals(tc, 1, enter_count);
+
+    NBSM_ChangeState(m, "bar");
+    NBSM_SetFloat(v2, 100.5f);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "plop", m->current->name);
+
+    NBSM_Reset(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_Destroy(m, false);
+}
+
+void TestIncrementalUpdate(CuTest *tc)
+{
+    for (int compile = 0; compile < 2; compile++)
+    {
+        NBSM_Machine *m = NBSM_Create();
+
+        NBSM_Value *v1 = NBSM_AddInteger(m, "v1");
+        NBSM_Value *v2 = NBSM_AddFloat(m, "v2");
+
+        NBSM_AddState(m, "foo", true);
+        NBSM_AddState(m, "bar", false);
+        NBSM_AddState(m, "plop", false);
+
+        NBSM_AddCondition(m, NBSM_AddTransition(m, "foo", "bar"), "v1", NBSM_EQ, NBSM_CONST_I(42));
+        NBSM_AddCondition(m, NBSM_AddTransition(m, "bar", "plop"), "v2", NBSM_GT, NBSM_CONST_F(10));
+        NBSM_AddTransition(m, "plop", "foo"); // no condition
+
+        if (compile)
+            NBSM_Compile(m);
+
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "foo", m->current->name);
+
+        // writing to the value directly is not supported: the variable is not marked dirty so the transitions
+        // are not evaluated
+        v1->value.i = 42;
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "foo", m->current->name);
+        CuAssertTrue(tc, !v1->dirty);
+
+        // setting the same value does not mark the variable dirty
+        NBSM_SetInteger(v1, 42);
+
+        CuAssertTrue(tc, !v1->dirty);
+
+        NBSM_SetInteger(v1, 41);
+        NBSM_SetInteger(v1, 42);
+
+        CuAssertTrue(tc, v1->dirty);
+
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "bar", m->current->name);
+        CuAssertTrue(tc, !v1->dirty);
+
+        // the transitions of a newly entered state are always evaluated on the next update
+        v2->value.f = 20.f;
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "plop", m->current->name);
+
+        // transitions without condition are always executed
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "foo", m->current->name);
+
+        NBSM_Destroy(m, false);
+    }
+}
+
+void TestConditionOpcodes(CuTest *tc)
+{
+    // expected results for left operands 1, 2 and 3 compared to 2, in NBSM_ConditionType order
+    static const bool expected[6][3] = {
+        { false, true, false },  // EQ
+        { true, false, true },   // NEQ
+        { true, false, false },  // LT
+        { true, true, false },   // LTE
+        { false, false, true },  // GT
+        { false, true, true }    // GTE
+    };
+
+    for (int compile = 0; compile < 2; compile++)
+    {
+        for (int type = NBSM_EQ; type <= NBSM_GTE; type++)
+        {
+            for (int operand = 0; operand < 2; operand++)
+            {
+                for (int left = 0; left < 3; left++)
+                {
+                    NBSM_Machine *m = NBSM_Create();
+                    NBSM_Value *i1 = NBSM_AddInteger(m, "i1");
+                    NBSM_Value *i2 = NBSM_AddInteger(m, "i2");
+
+                    NBSM_AddState(m, "foo", true);
+                    NBSM_AddState(m, "bar", false);
+
+                    NBSM_AddCondition(
+                        m, NBSM_AddTransition(m, "foo", "bar"), "i1", type, operand ? NBSM_VAR(m, "i2") : NBSM_CONST_I(2));
+
+                    if (compile)
+                        NBSM_Compile(m);
+
+                    NBSM_SetInteger(i1, left + 1);
+                    NBSM_SetInteger(i2, 2);
+                    NBSM_Update(m);
+
+                    CuAssertStrEquals(tc, expected[type][left] ? "bar" : "foo", m->current->name);
+
+                    NBSM_Destroy(m, false);
+                }
+            }
+        }
+
+        // booleans and floats
+        NBSM_Machine *m = NBSM_Create();
+        NBSM_Value *b1 = NBSM_AddBoolean(m, "b1");
+        NBSM_Value *b2 = NBSM_AddBoolean(m, "b2");
+        NBSM_Value *f1 = NBSM_AddFloat(m, "f1");
+
+        NBSM_AddState(m, "foo", true);
+        NBSM_AddState(m, "bar", false);
+        NBSM_AddState(m, "plop", false);
+
+        NBSM_AddCondition(m, NBSM_AddTransition(m, "foo", "bar"), "b1", NBSM_NEQ, NBSM_VAR(m, "b2"));
+        NBSM_AddCondition(m, NBSM_AddTransition(m, "bar", "plop"), "f1", NBSM_NEQ, NBSM_CONST_F(1.5f));
+
+        if (compile)
+            NBSM_Compile(m);
+
+        NBSM_SetBoolean(b1, true);
+        NBSM_SetBoolean(b2, true);
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "foo", m->current->name);
+
+        NBSM_SetBoolean(b2, false);
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "bar", m->current->name);
+
+        NBSM_SetFloat(f1, 1.5f);
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "bar", m->current->name);
+
+        NBSM_SetFloat(f1, 1.6f);
+        NBSM_Update(m);
+
+        CuAssertStrEquals(tc, "plop", m->current->name);
+
+        NBSM_Destroy(m, false);
+    }
+}
+
+void TestGenerateC(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    FILE *f = tmpfile();
+
+    NBSM_GenerateC(builder, "test", f);
+
+    long size = ftell(f);
+    char *code = malloc(size + 1);
+
+    fseek(f, 0, SEEK_SET);
+    CuAssertIntEquals(tc, size, fread(code, 1, size, f));
+    code[size] = '\0';
+
+    CuAssertPtrNotNull(tc, strstr(code, "} test;"));
+    CuAssertPtrNotNull(tc, strstr(code, "    int v1;\n    float v2;\n    bool v3;\n    float v4;\n"));
+    CuAssertPtrNotNull(tc, strstr(code, "    m->state = test_foo;\n"));
+    CuAssertPtrNotNull(tc, strstr(code, "    case test_foo:\n        if ((m->v1 == 42))\n"));
+    CuAssertPtrNotNull(tc, strstr(code, "if ((m->v2 < m->v4 - FLT_EPSILON))\n        {\n            m->state = test_toto;"));
+    CuAssertPtrNotNull(tc, strstr(code, "if ((m->v2 > 100.525002f + FLT_EPSILON) && (m->v3 == true))"));
+
+    free(code);
+    fclose(f);
+    free(json);
+    NBSM_DestroyBuilder(builder);
+
+    // non-finite constants
+    builder = NBSM_CreateBuilderFromJSON(
+        "{\"variables\":[{\"name\":\"v\",\"type\":\"float\"}],"
+        "\"states\":[{\"name\":\"a\",\"is_initial\":true},{\"name\":\"b\",\"is_initial\":false}],"
+        "\"transitions\":[{\"source\":\"a\",\"target\":\"b\",\"conditions\":[{\"type\":\"lt\",\"left_op\":\"v\","
+        "\"right_op\":{\"type\":\"const\",\"const\":{\"type\":\"float\",\"value\":1e999}}}]}]}");
+    f = tmpfile();
+
+    CuAssertTrue(tc, NBSM_GenerateC(builder, "test", f));
+
+    size_t code_size;
+
+    code = ReadFileContent(f, &code_size);
+
+    CuAssertPtrNotNull(tc, strstr(code, "(m->v < INFINITY - FLT_EPSILON)"));
+
+    free(code);
+    fclose(f);
+    NBSM_DestroyBuilder(builder);
+
+    // no state, distinct names mapping to the same identifier
+    const char *conflicting_jsons[] = {
+        "{\"variables\":[],\"states\":[],\"transitions\":[]}",
+        "{\"variables\":[],\"states\":[{\"name\":\"a-b\",\"is_initial\":true},{\"name\":\"a_b\",\"is_initial\":false}],"
+        "\"transitions\":[]}",
+        "{\"variables\":[],\"states\":[{\"name\":\"STATE_COUNT\",\"is_initial\":true}],\"transitions\":[]}",
+        "{\"variables\":[{\"name\":\"state\",\"type\":\"int\"}],\"states\":[{\"name\":\"a\",\"is_initial\":true}],"
+        "\"transitions\":[]}"
+    };
+
+    for (int i = 0; i < 4; i++)
+    {
+        builder = NBSM_CreateBuilderFromJSON(conflicting_jsons[i]);
+        f = tmpfile();
+
+        CuAssertTrue(tc, !NBSM_GenerateC(builder, "test", f));
+        CuAssertIntEquals(tc, 0, ftell(f));
+
+        fclose(f);
+        NBSM_DestroyBuilder(builder);
+    }
+}
+
+void TestIds(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    NBSM_Machine *m1 = NBSM_Build(builder);
+    NBSM_Machine *m2 = NBSM_Build(builder);
+
+    NBSM_StateId foo = NBSM_GetStateId(m1, "foo");
+    NBSM_StateId bar = NBSM_GetStateId(m1, "bar");
+    NBSM_VarId v1 = NBSM_GetVariableId(m1, "v1");
+
+    // ids are the same for all machines built from the same builder
+    CuAssertIntEquals(tc, foo, NBSM_GetStateId(m2, "foo"));
+    CuAssertIntEquals(tc, bar, NBSM_GetStateId(m2, "bar"));
+    CuAssertIntEquals(tc, v1, NBSM_GetVariableId(m2, "v1"));
+    CuAssertPtrEquals(tc, NBSM_GetVariable(m2, "v1"), NBSM_GetVariableById(m2, v1));
+    CuAssertIntEquals(tc, foo, NBSM_GetCurrentStateId(m1));
+
+    int enter_count = 0;
+
+    NBSM_AttachDataToStateById(m1, foo, &enter_count);
+    NBSM_OnStateEnterById(m1, foo, OnMachineEnter);
+
+    NBSM_SetInteger(NBSM_GetVariableById(m1, v1), 42);
+    NBSM_Update(m1);
+
+    CuAssertIntEquals(tc, bar, NBSM_GetCurrentStateId(m1));
+    CuAssertStrEquals(tc, "bar", m1->current->name);
+
+    NBSM_ChangeStateById(m1, foo);
+
+    CuAssertStrEquals(tc, "foo", m1->current->name);
+    CuAssertIntEquals(tc, 1, enter_count);
+
+    NBSM_Definition *def = NBSM_CreateDefinition(builder);
+    NBSM_Instance *inst = NBSM_CreateInstance(def);
+
+    NBSM_ChangeInstanceStateById(def, inst, NBSM_GetDefinitionStateId(def, "plop"));
+
+    CuAssertStrEquals(tc, "plop", NBSM_GetInstanceState(def, inst));
+
+    NBSM_DestroyInstance(inst);
+    NBSM_DestroyDefinition(def);
+    NBSM_Destroy(m1, true);
+    NBSM_Destroy(m2, true);
+    NBSM_DestroyBuilder(builder);
+    free(json);
+}
+
+void TestHTable(CuTest *tc)
+{
+    static char keys[1000][16];
+    NBSM_HTable *htable = CreateHTableWithCapacity(&default_allocator, 4);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "key_%d", i);
+        AddToHTable(htable, keys[i], keys[i]);
+    }
+
+    CuAssertIntEquals(tc, 1000, htable->count);
+    CuAssertTrue(tc, htable->capacity >= 1000 / NBSM_HTABLE_LOAD_FACTOR_THRESHOLD);
+    CuAssertIntEquals(tc, 0, htable->capacity & (htable->capacity - 1));
+
+    for (int i = 0; i < 1000; i++)
+        CuAssertPtrEquals(tc, keys[i], GetInHTable(htable, keys[i]));
+
+    CuAssertPtrEquals(tc, NULL, GetInHTable(htable, "missing"));
+
+    // remove every other key, the remaining ones must still be found
+    for (int i = 0; i < 1000; i += 2)
+        CuAssertPtrEquals(tc, keys[i], RemoveFromHTable(htable, keys[i]));
+
+    CuAssertIntEquals(tc, 500, htable->count);
+
+    for (int i = 0; i < 1000; i++)
+        CuAssertPtrEquals(tc, i % 2 ? keys[i] : NULL, GetInHTable(htable, keys[i]));
+
+    DestroyHTable(htable, false, NULL, false);
+
+    // replacing an item keeps the key owned by the table
+    htable = CreateHTableWithCapacity(&default_allocator, 4);
+
+    char *key = strdup("key");
+    char *same_key = strdup("key");
+
+    AddToHTable(htable, key, keys[0]);
+    AddToHTable(htable, same_key, keys[1]);
+
+    CuAssertIntEquals(tc, 1, htable->count);
+    CuAssertPtrEquals(tc, keys[1], GetInHTable(htable, "key"));
+    CuAssertTrue(tc, FindHTableEntry(htable, "key")->key == key);
+
+    free(same_key);
+    DestroyHTable(htable, false, NULL, true);
+}
+
+void TestTableSizes(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+    NBSM_Machine *m = NBSM_Build(builder);
+
+    // 4 states and 4 variables fit in 8 slots tables
+    CuAssertIntEquals(tc, 8, m->states->capacity);
+    CuAssertIntEquals(tc, 8, m->variables->capacity);
+    CuAssertIntEquals(tc, 4, m->state_capacity);
+    CuAssertIntEquals(tc, 4, m->variable_capacity);
+
+    NBSM_Destroy(m, true);
+
+    // machines created empty still grow as needed
+    m = NBSM_CreateWithCapacity(1, 0);
+
+    char names[20][16];
+
+    for (int i = 0; i < 20; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "s%d", i);
+        NBSM_AddState(m, names[i], i == 0);
+        NBSM_AddInteger(m, names[i]);
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+        CuAssertIntEquals(tc, i, NBSM_GetStateId(m, names[i]));
+        CuAssertIntEquals(tc, i, NBSM_GetVariableId(m, names[i]));
+    }
+
+    NBSM_Destroy(m, false);
+    NBSM_DestroyBuilder(builder);
+    free(json);
+}
+
+void TestBuildInPlace(CuTest *tc)
+{
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSON(json);
+
+    free(json);
+
+    size_t size = NBSM_GetBuildSize(builder);
+    uint64_t *buffer = malloc(size);
+    NBSM_Machine *m = NBSM_BuildInPlace(builder, buffer);
+
+    // the whole state machine lives in the caller's buffer
+    CuAssertPtrEquals(tc, buffer, m);
+    CuAssertTrue(tc, (char *)m->state_array > (char *)buffer && (char *)m->state_array < (char *)buffer + size);
+    CuAssertTrue(tc, (char *)m->current->name > (char *)buffer && (char *)m->current->name < (char *)buffer + size);
+
+    NBSM_Value *v1 = NBSM_GetVariable(m, "v1");
+    NBSM_Value *v2 = NBSM_GetVariable(m, "v2");
+    NBSM_Value *v3 = NBSM_GetVariable(m, "v3");
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetInteger(v1, 42);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "bar", m->current->name);
+
+    NBSM_SetFloat(v2, 100.625f);
+    NBSM_SetBoolean(v3, true);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "plop", m->current->name);
+
+    NBSM_SetInteger(v1, 30);
+    NBSM_SetBoolean(v3, false);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+
+    NBSM_SetFloat(v2, -12.f);
+    NBSM_Update(m);
+
+    CuAssertStrEquals(tc, "toto", m->current->name);
+
+    // building twice into the same buffer resets the state machine
+    m = NBSM_BuildInPlace(builder, buffer);
+
+    CuAssertStrEquals(tc, "foo", m->current->name);
+    CuAssertIntEquals(tc, 0, NBSM_GetInteger(NBSM_GetVariable(m, "v1")));
+
+    free(buffer);
+    NBSM_DestroyBuilder(builder);
+}
+
+typedef struct
+{
+    unsigned int alloc_count;
+    int live_count;
+} AllocatorStats;
+
+static void *StatsAlloc(void *user_data, size_t size)
+{
+    AllocatorStats *stats = user_data;
+
+    stats->alloc_count++;
+    stats->live_count++;
+
+    return malloc(size);
+}
+
+static void *StatsRealloc(void *user_data, void *ptr, size_t size)
+{
+    AllocatorStats *stats = user_data;
+
+    if (!ptr)
+    {
+        stats->alloc_count++;
+        stats->live_count++;
+    }
+
+    return realloc(ptr, size);
+}
+
+static void StatsFree(void *user_data, void *ptr)
+{
+    AllocatorStats *stats = user_data;
+
+    if (ptr)
+        stats->live_count--;
+
+    free(ptr);
+}
+
+void TestAllocator(CuTest *tc)
+{
+    AllocatorStats builder_stats = { 0, 0 };
+    AllocatorStats machine_stats = { 0, 0 };
+    NBSM_Allocator builder_allocator = { StatsAlloc, StatsRealloc, StatsFree, &builder_stats };
+    NBSM_Allocator machine_allocator = { StatsAlloc, StatsRealloc, StatsFree, &machine_stats };
+    char *json = ReadTestJSON();
+    NBSM_MachineBuilder *builder = NBSM_CreateBuilderFromJSONWithAllocator(json, &builder_allocator);
+
+    free(json);
+
+    CuAssertTrue(tc, builder_stats.alloc_count > 0);
+
+    // built state machines are a single allocation
+    NBSM_Machine *m1 = NBSM_BuildWithAllocator(builder, &machine_allocator);
+
+    CuAssertIntEquals(tc, 1, machine_stats.live_count);
+
+    NBSM_SetInteger(NBSM_GetVariable(m1, "v1"), 42);
+    NBSM_Update(m1);
+
+    CuAssertStrEquals(tc, "bar", m1->current->name);
+
+    NBSM_Destroy(m1, true);
+
+    CuAssertIntEquals(tc, 0, machine_stats.live_count);
+
+    NBSM_MachinePool *pool = NBSM_CreatePoolWithAllocator(builder, 2, &machine_allocator);
+
+    NBSM_GetFromPool(pool);
+    NBSM_GetFromPool(pool);
+    NBSM_GetFromPool(pool);
+
+    CuAssertTrue(tc, machine_stats.live_count > 4);
+
+    NBSM_DestroyPool(pool);
+
+    CuAssertIntEquals(tc, 0, machine_stats.live_count);
+
+    NBSM_Machine *m2 = NBSM_CreateWithAllocator(1, 1, &machine_allocator);
+
+    NBSM_AddState(m2, "foo", true);
+    NBSM_AddState(m2, "bar", false);
+    NBSM_AddInteger(m2, "v1");
+    NBSM_AddInteger(m2, "v2");
+    NBSM_AddCondition(m2, NBSM_AddTransition(m2, "foo", "bar"), "v1", NBSM_EQ, NBSM_VAR(m2, "v2"));
+    NBSM_Compile(m2);
+    NBSM_Destroy(m2, false);
+
+    CuAssertIntEquals(tc, 0, machine_stats.live_count);
+
+    NBSM_DestroyBuilder(builder);
+
+    CuAssertIntEquals(tc, 0, builder_stats.live_count);
 }
 
 int main(void)
@@ -326,6 +2178,32 @@ int main(void)
     SUITE_ADD_TEST(suite, TestTransitionConditions);
     SUITE_ADD_TEST(suite, TestLoadJSON);
     SUITE_ADD_TEST(suite, TestPooling);
+    SUITE_ADD_TEST(suite, TestDefinition);
+    SUITE_ADD_TEST(suite, TestCompile);
+    SUITE_ADD_TEST(suite, TestIncrementalUpdate);
+    SUITE_ADD_TEST(suite, TestConditionOpcodes);
+    SUITE_ADD_TEST(suite, TestGenerateC);
+    SUITE_ADD_TEST(suite, TestIds);
+    SUITE_ADD_TEST(suite, TestHTable);
+    SUITE_ADD_TEST(suite, TestTableSizes);
+    SUITE_ADD_TEST(suite, TestBuildInPlace);
+    SUITE_ADD_TEST(suite, TestAllocator);
+    SUITE_ADD_TEST(suite, TestPoolSlabs);
+    SUITE_ADD_TEST(suite, TestClone);
+    SUITE_ADD_TEST(suite, TestConcurrentPool);
+    SUITE_ADD_TEST(suite, TestDefaultValues);
+    SUITE_ADD_TEST(suite, TestMachineHandles);
+    SUITE_ADD_TEST(suite, TestUpdatePool);
+    SUITE_ADD_TEST(suite, TestBinary);
+    SUITE_ADD_TEST(suite, TestJSONStream);
+    SUITE_ADD_TEST(suite, TestLoadDirectory);
+    SUITE_ADD_TEST(suite, TestStringInterning);
+    SUITE_ADD_TEST(suite, TestRegistry);
+    SUITE_ADD_TEST(suite, TestUpdateBatch);
+    SUITE_ADD_TEST(suite, TestPopulation);
+    SUITE_ADD_TEST(suite, TestPopulationBooleanDefault);
+    SUITE_ADD_TEST(suite, TestUpdateParallel);
+    SUITE_ADD_TEST(suite, TestScheduler);
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);